@@ -0,0 +1,118 @@
+/*
+ *  Bump allocator
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN(x) (((x) + 7) & ~7)
+
+
+/**
+ *
+ */
+void
+arena_init(arena_t *a, size_t block_size)
+{
+  a->a_blocks = NULL;
+  a->a_block_size = block_size;
+}
+
+
+/**
+ *
+ */
+void *
+arena_alloc(arena_t *a, size_t size)
+{
+  arena_block_t *ab = a->a_blocks;
+  void *r;
+
+  size = ARENA_ALIGN(size);
+
+  if(ab == NULL || ab->ab_size - ab->ab_used < size) {
+    size_t bs = size > a->a_block_size ? size : a->a_block_size;
+    ab = malloc(sizeof(arena_block_t) + bs);
+    ab->ab_size = bs;
+    ab->ab_used = 0;
+    ab->ab_next = a->a_blocks;
+    a->a_blocks = ab;
+  }
+
+  r = ab->ab_data + ab->ab_used;
+  ab->ab_used += size;
+  return r;
+}
+
+
+/**
+ *
+ */
+char *
+arena_strndup(arena_t *a, const char *str, size_t len)
+{
+  char *r = arena_alloc(a, len + 1);
+  memcpy(r, str, len);
+  r[len] = 0;
+  return r;
+}
+
+
+/**
+ *
+ */
+char *
+arena_strdup(arena_t *a, const char *str)
+{
+  return arena_strndup(a, str, strlen(str));
+}
+
+
+/**
+ * Free all blocks except the first one
+ */
+void
+arena_reset(arena_t *a)
+{
+  arena_block_t *ab;
+
+  if(a->a_blocks == NULL)
+    return;
+
+  while((ab = a->a_blocks)->ab_next != NULL) {
+    a->a_blocks = ab->ab_next;
+    free(ab);
+  }
+  ab->ab_used = 0;
+}
+
+
+/**
+ *
+ */
+void
+arena_destroy(arena_t *a)
+{
+  arena_block_t *ab;
+
+  while((ab = a->a_blocks) != NULL) {
+    a->a_blocks = ab->ab_next;
+    free(ab);
+  }
+}
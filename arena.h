@@ -0,0 +1,51 @@
+/*
+ *  Bump allocator
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Simple bump allocator. Everything allocated is released at once with
+ * arena_reset(). The first block is retained across resets so an arena
+ * that is reused for similarly sized work settles at zero mallocs.
+ */
+
+typedef struct arena_block {
+  struct arena_block *ab_next;
+  size_t ab_size;
+  size_t ab_used;
+  char ab_data[0];
+} arena_block_t;
+
+typedef struct arena {
+  arena_block_t *a_blocks;
+  size_t a_block_size;
+} arena_t;
+
+void arena_init(arena_t *a, size_t block_size);
+
+void *arena_alloc(arena_t *a, size_t size);
+
+char *arena_strdup(arena_t *a, const char *str);
+
+char *arena_strndup(arena_t *a, const char *str, size_t len);
+
+void arena_reset(arena_t *a);
+
+void arena_destroy(arena_t *a);
@@ -33,6 +33,12 @@ static struct asyncio_worker_list asyncio_workers;
 
 static pthread_t asyncio_tid;
 
+// Loop stats are only written by the asyncio thread
+static int asyncio_num_fds;
+static uint64_t asyncio_wakeups;
+static uint64_t asyncio_events;
+static int64_t asyncio_busy;
+
 /**
  *
  */
@@ -209,6 +215,7 @@ async_fd_create(int fd, int flags)
   async_fd_t *af = calloc(1, sizeof(async_fd_t));
   af->af_fd = fd;
   af->af_refcount = 1;
+  __atomic_add_fetch(&asyncio_num_fds, 1, __ATOMIC_RELAXED);
   htsbuf_queue_init(&af->af_sendq, INT32_MAX);
   htsbuf_queue_init(&af->af_recvq, INT32_MAX);
   mod_poll_flags(af, flags, 0);
@@ -237,6 +244,7 @@ async_fd_release(async_fd_t *af)
   htsbuf_queue_flush(&af->af_recvq);
   free(af->af_hostname);
   free(af);
+  __atomic_sub_fetch(&asyncio_num_fds, 1, __ATOMIC_RELAXED);
 }
 
 
@@ -348,6 +356,7 @@ static void *
 asyncio_loop(void *aux)
 {
   struct epoll_event ev[32];
+  int64_t woke = asyncio_now();
   int r, i;
 
   while(1) {
@@ -370,7 +379,19 @@ asyncio_loop(void *aux)
     if(timeout == INT32_MAX)
       timeout = -1;
 
+    __atomic_store_n(&asyncio_busy, asyncio_busy + asyncio_now() - woke,
+                     __ATOMIC_RELAXED);
+
     r = epoll_wait(epfd, ev, sizeof(ev) / sizeof(ev[0]), timeout);
+
+    woke = asyncio_now();
+    if(r > 0) {
+      __atomic_store_n(&asyncio_wakeups, asyncio_wakeups + 1,
+                       __ATOMIC_RELAXED);
+      __atomic_store_n(&asyncio_events, asyncio_events + r,
+                       __ATOMIC_RELAXED);
+    }
+
     if(r == -1) {
       perror("tcp_server: epoll_wait");
       usleep(100000);
@@ -439,6 +460,20 @@ asyncio_close(async_fd_t *af)
 }
 
 
+/**
+ * For users that write to af_fd themselves (overriding af_pollout),
+ * get af_pollout called when the socket becomes writable
+ */
+void
+asyncio_pollout(async_fd_t *af, int on)
+{
+  if(on)
+    mod_poll_flags(af, EPOLLOUT, 0);
+  else
+    mod_poll_flags(af, 0, EPOLLOUT);
+}
+
+
 /**
  *
  */
@@ -670,7 +705,9 @@ connect_timeout(void *opaque)
     mod_poll_flags(af, 0, -1);
     close(af->af_fd);
     af->af_fd = -1;
+    // Either released or rearmed for a retry, which ends up below
     con_send_err(af, "Connection timed out");
+    return;
   }
 
   assert(af->af_dns_req == NULL);
@@ -1027,3 +1064,16 @@ asyncio_now(void)
   gettimeofday(&tv, NULL);
   return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
 }
+
+
+/**
+ *
+ */
+void
+asyncio_get_stats(asyncio_stats_t *as)
+{
+  as->fds       = __atomic_load_n(&asyncio_num_fds, __ATOMIC_RELAXED);
+  as->wakeups   = __atomic_load_n(&asyncio_wakeups, __ATOMIC_RELAXED);
+  as->events    = __atomic_load_n(&asyncio_events, __ATOMIC_RELAXED);
+  as->busy_usec = __atomic_load_n(&asyncio_busy, __ATOMIC_RELAXED);
+}
@@ -102,6 +102,8 @@ void asyncio_send(async_fd_t *af, const void *buf, size_t len, int cork);
 
 void asyncio_sendq(async_fd_t *af, htsbuf_queue_t *hq, int cork);
 
+void asyncio_pollout(async_fd_t *af, int on);
+
 void asyncio_reconnect(async_fd_t *af, int delay);
 
 /*************************************************************************
@@ -112,6 +114,19 @@ int asyncio_add_worker(void (*fn)(void));
 
 void asyncio_wakeup_worker(int id);
 
+/*************************************************************************
+ * Stats
+ *************************************************************************/
+
+typedef struct asyncio_stats {
+  int fds;
+  uint64_t wakeups;
+  uint64_t events;
+  int64_t busy_usec; // Time spent outside epoll_wait()
+} asyncio_stats_t;
+
+void asyncio_get_stats(asyncio_stats_t *as);
+
 /************************************************************************
  * Async DNS
  ************************************************************************/
@@ -15,6 +15,7 @@
 static pthread_mutex_t cfg_mutex = PTHREAD_MUTEX_INITIALIZER;
 static cfg_t *cfgroot;
 
+volatile int cfg_generation = 1;
 
 
 /**
@@ -38,6 +39,29 @@ cfg_releasep(cfg_t **p)
 }
 
 
+/**
+ * Slow path of cfg_view_refresh(). Generation and root are sampled
+ * together so the view is never tagged newer than its contents
+ */
+void
+cfg_view_fill(int *genp, void (*fill)(void *view, cfg_t *root), void *view)
+{
+  pthread_mutex_lock(&cfg_mutex);
+  cfg_t *c = cfgroot;
+  int gen = cfg_generation;
+  if(c != NULL)
+    htsmsg_retain(c);
+  pthread_mutex_unlock(&cfg_mutex);
+
+  if(c == NULL)
+    c = htsmsg_create_map();
+
+  fill(view, c);
+  htsmsg_release(c);
+  *genp = gen;
+}
+
+
 /**
  *
  */
@@ -83,6 +107,7 @@ cfg_load(const char *filename, const char *defconf)
 
   cfgroot = m;
   htsmsg_retain(m);
+  atomic_add(&cfg_generation, 1);
   pthread_mutex_unlock(&cfg_mutex);
   trace(LOG_NOTICE, "Config updated");
   return 0;
@@ -28,3 +28,36 @@ cfg_t *cfg_get_list(cfg_t *c, const char *id);
 cfg_t *cfg_find_map(cfg_t *c, const char *key, const char *value);
 
 int cfg_list_length(cfg_t *c);
+
+
+/**
+ * Bumped every time cfg_load() installs a new root
+ */
+extern volatile int cfg_generation;
+
+void cfg_view_fill(int *genp, void (*fill)(void *view, cfg_t *root),
+                   void *view);
+
+/**
+ * Refresh a cached config view if a new config has been loaded since
+ * it was last filled. Fast path is a single integer compare
+ */
+static inline void
+cfg_view_refresh(int *genp, void (*fill)(void *view, cfg_t *root),
+                 void *view)
+{
+  if(__builtin_expect(*genp != cfg_generation, 0))
+    cfg_view_fill(genp, fill, view);
+}
+
+/**
+ * Define a per-thread typed config view. Expands to a function
+ * 'name()' returning a const pointer to the current view
+ */
+#define CFG_VIEW(type, name, fill)                                      \
+  static __thread type name ## _view;                                   \
+  static __thread int name ## _gen;                                     \
+  static inline const type *name(void) {                                \
+    cfg_view_refresh(&name ## _gen, fill, &name ## _view);              \
+    return &name ## _view;                                              \
+  }
@@ -9,6 +9,19 @@
 struct filebundle *filebundles;
 
 
+const struct filebundle *
+filebundle_find(const char *prefix)
+{
+  const struct filebundle *fb;
+
+  for(fb = filebundles; fb != NULL; fb = fb->next) {
+    if(!strcmp(prefix, fb->prefix))
+      break;
+  }
+  return fb;
+}
+
+
 int
 filebundle_get(const char *p, const void **ptr, int *len)
 {
@@ -21,10 +34,7 @@ filebundle_get(const char *p, const void **ptr, int *len)
     return ENOTDIR;
 
   *x++ = 0;
-  for(fb = filebundles; fb != NULL; fb = fb->next) {
-    if(!strcmp(path, fb->prefix))
-      break;
-  }
+  fb = filebundle_find(path);
   if(fb == NULL)
     return ENODEV;
 
@@ -1,8 +1,11 @@
+#pragma once
+
 struct filebundle_entry {
   const char *filename;
   const unsigned char *data;
   int size;
-  int original_size;
+  int original_size; // -1 if not compressed, otherwise data is gzip'ed
+  const char *etag;  // Quoted, computed by mkbundle from original content
 };
 
 struct filebundle {
@@ -12,3 +15,5 @@ struct filebundle {
 };
 
 int filebundle_get(const char *p, const void **ptr, int *len);
+
+const struct filebundle *filebundle_find(const char *prefix);
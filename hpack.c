@@ -0,0 +1,665 @@
+/*
+ *  HPACK header compression for HTTP/2 (RFC 7541)
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack.h"
+
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_ENTRY_OVERHEAD 32
+
+/**
+ * Huffman code from RFC 7541 Appendix B (EOS is never encoded)
+ */
+static const uint32_t hpack_huff_code[256] = {
+  0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+  0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+  0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+  0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+  0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+  0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+  0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+  0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+  0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+  0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+  0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+  0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+  0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+  0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+  0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+  0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+  0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+  0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+  0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+  0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+  0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+  0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+  0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+  0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+  0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+  0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+  0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+  0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+  0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+  0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+  0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+  0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+  0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+  0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+  0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+  0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+  0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+  0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+  0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+  0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+  0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+  0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+  0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const uint8_t hpack_huff_len[256] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+static const struct {
+  const char *name;
+  const char *value;
+} hpack_static_table[HPACK_STATIC_ENTRIES] = {
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" },
+};
+
+
+/**
+ * Huffman decoding walks a tree where each node consumes 8 bits.
+ * An entry is either the index of the next node or, with bit 15 set,
+ * a symbol in the low byte and the number of bits (1 - 8) it used
+ * out of the 8 in bits 8-11. Zero means the code is invalid (EOS)
+ *
+ * The tree for the RFC table is 15 nodes deep in total
+ */
+#define HPACK_HUFF_NODES 16
+#define HPACK_HUFF_LEAF  0x8000
+
+static uint16_t hpack_huff_tree[HPACK_HUFF_NODES][256];
+
+
+static void __attribute__((constructor))
+hpack_huff_init(void)
+{
+  int sym, node, nodes = 1, len, i, shift, start;
+  uint32_t code;
+
+  for(sym = 0; sym < 256; sym++) {
+    code = hpack_huff_code[sym];
+    len = hpack_huff_len[sym];
+    node = 0;
+
+    while(len > 8) {
+      len -= 8;
+      i = (code >> len) & 0xff;
+      if(hpack_huff_tree[node][i] == 0)
+        hpack_huff_tree[node][i] = nodes++;
+      node = hpack_huff_tree[node][i];
+    }
+
+    shift = 8 - len;
+    start = (code << shift) & 0xff;
+    for(i = 0; i < 1 << shift; i++)
+      hpack_huff_tree[node][start + i] = HPACK_HUFF_LEAF | len << 8 | sym;
+  }
+}
+
+
+/**
+ * Returns decoded length or -1 on invalid input. dst must have room
+ * for len * 8 / 5 bytes (shortest code is 5 bits)
+ */
+static int
+hpack_huff_decode(const uint8_t *src, int len, char *dst)
+{
+  uint32_t cur = 0, e;
+  int cbits = 0, sbits = 0, node = 0, n = 0;
+
+  for(int i = 0; i < len; i++) {
+    cur = cur << 8 | src[i];
+    cbits += 8;
+    sbits += 8;
+
+    while(cbits >= 8) {
+      e = hpack_huff_tree[node][(cur >> (cbits - 8)) & 0xff];
+      if(e == 0)
+        return -1;
+      if(e & HPACK_HUFF_LEAF) {
+        dst[n++] = e & 0xff;
+        cbits -= (e >> 8) & 0xf;
+        sbits = cbits;
+        node = 0;
+      } else {
+        cbits -= 8;
+        node = e;
+      }
+    }
+  }
+
+  while(cbits > 0) {
+    e = hpack_huff_tree[node][(cur << (8 - cbits)) & 0xff];
+    if(!(e & HPACK_HUFF_LEAF) || ((e >> 8) & 0xf) > cbits)
+      break;
+    dst[n++] = e & 0xff;
+    cbits -= (e >> 8) & 0xf;
+    sbits = cbits;
+    node = 0;
+  }
+
+  // Padding must be shorter than a byte and be a prefix of EOS (all ones)
+  if(sbits > 7)
+    return -1;
+  if((cur & ((1 << cbits) - 1)) != (1 << cbits) - 1)
+    return -1;
+  return n;
+}
+
+
+/**
+ *
+ */
+static int
+hpack_huff_encoded_len(const char *s, int len)
+{
+  int bits = 0;
+  for(int i = 0; i < len; i++)
+    bits += hpack_huff_len[(uint8_t)s[i]];
+  return (bits + 7) / 8;
+}
+
+
+/**
+ *
+ */
+static void
+hpack_huff_encode(uint8_t *dst, const char *s, int len)
+{
+  uint64_t cur = 0;
+  int cbits = 0;
+
+  for(int i = 0; i < len; i++) {
+    uint8_t c = s[i];
+    cur = cur << hpack_huff_len[c] | hpack_huff_code[c];
+    cbits += hpack_huff_len[c];
+    while(cbits >= 8) {
+      cbits -= 8;
+      *dst++ = cur >> cbits;
+    }
+  }
+  if(cbits > 0)
+    *dst = (cur << (8 - cbits)) | (0xff >> cbits);
+}
+
+
+/**
+ *
+ */
+void
+hpack_table_init(hpack_table_t *ht, int limit)
+{
+  memset(ht, 0, sizeof(hpack_table_t));
+  ht->ht_limit = limit;
+  ht->ht_max_size = limit;
+}
+
+
+/**
+ *
+ */
+static void
+hpack_table_evict(hpack_table_t *ht, int need)
+{
+  while(ht->ht_count > 0 && ht->ht_size + need > ht->ht_max_size) {
+    int i = (ht->ht_first + ht->ht_count - 1) % ht->ht_capacity;
+    hpack_entry_t *he = &ht->ht_entries[i];
+    ht->ht_size -= he->he_name_len + he->he_value_len + HPACK_ENTRY_OVERHEAD;
+    free(he->he_name);
+    ht->ht_count--;
+  }
+}
+
+
+/**
+ *
+ */
+void
+hpack_table_destroy(hpack_table_t *ht)
+{
+  ht->ht_max_size = 0;
+  hpack_table_evict(ht, 0);
+  free(ht->ht_entries);
+  free(ht->ht_scratch);
+}
+
+
+/**
+ * Our encoder never uses more than the default size even if the peer
+ * allows it
+ */
+void
+hpack_table_set_limit(hpack_table_t *ht, int limit)
+{
+  int max = limit < HPACK_DEFAULT_TABLE_SIZE ?
+    limit : HPACK_DEFAULT_TABLE_SIZE;
+
+  ht->ht_limit = limit;
+  if(max == ht->ht_max_size)
+    return;
+  ht->ht_max_size = max;
+  hpack_table_evict(ht, 0);
+  ht->ht_resized = 1;
+}
+
+
+/**
+ * Name and value are copied before eviction as they may point into
+ * an entry that is about to go away (RFC 7541 4.4)
+ */
+static void
+hpack_table_add(hpack_table_t *ht, const char *name, int name_len,
+                const char *value, int value_len)
+{
+  int size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+  hpack_entry_t *he;
+  char *mem;
+
+  if(size > ht->ht_max_size) {
+    // Does not fit, which leaves the table empty
+    hpack_table_evict(ht, size);
+    return;
+  }
+
+  mem = malloc(name_len + value_len + 2);
+  memcpy(mem, name, name_len);
+  mem[name_len] = 0;
+  memcpy(mem + name_len + 1, value, value_len);
+  mem[name_len + 1 + value_len] = 0;
+
+  hpack_table_evict(ht, size);
+
+  if(ht->ht_count == ht->ht_capacity) {
+    int cap = ht->ht_capacity ? ht->ht_capacity * 2 : 16;
+    hpack_entry_t *v = malloc(cap * sizeof(hpack_entry_t));
+    for(int i = 0; i < ht->ht_count; i++)
+      v[i] = ht->ht_entries[(ht->ht_first + i) % ht->ht_capacity];
+    free(ht->ht_entries);
+    ht->ht_entries = v;
+    ht->ht_capacity = cap;
+    ht->ht_first = 0;
+  }
+
+  ht->ht_first = (ht->ht_first + ht->ht_capacity - 1) % ht->ht_capacity;
+  he = &ht->ht_entries[ht->ht_first];
+  he->he_name = mem;
+  he->he_name_len = name_len;
+  he->he_value = mem + name_len + 1;
+  he->he_value_len = value_len;
+  ht->ht_count++;
+  ht->ht_size += size;
+}
+
+
+/**
+ * Index is 1 based, static table first
+ */
+static int
+hpack_table_get(const hpack_table_t *ht, uint32_t idx,
+                const char **name, int *name_len,
+                const char **value, int *value_len)
+{
+  if(idx == 0)
+    return -1;
+
+  if(idx <= HPACK_STATIC_ENTRIES) {
+    *name = hpack_static_table[idx - 1].name;
+    *name_len = strlen(*name);
+    *value = hpack_static_table[idx - 1].value;
+    *value_len = strlen(*value);
+    return 0;
+  }
+
+  idx -= HPACK_STATIC_ENTRIES + 1;
+  if(idx >= ht->ht_count)
+    return -1;
+
+  const hpack_entry_t *he =
+    &ht->ht_entries[(ht->ht_first + idx) % ht->ht_capacity];
+  *name = he->he_name;
+  *name_len = he->he_name_len;
+  *value = he->he_value;
+  *value_len = he->he_value_len;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+hpack_get_int(const uint8_t **pp, const uint8_t *end, int prefix,
+              uint32_t *out)
+{
+  const uint8_t *p = *pp;
+  uint32_t max = (1 << prefix) - 1;
+  uint32_t v = *p++ & max;
+  int shift = 0;
+  uint8_t b;
+
+  if(v == max) {
+    do {
+      if(p == end || shift > 21)
+        return -1;
+      b = *p++;
+      v += (uint32_t)(b & 0x7f) << shift;
+      shift += 7;
+    } while(b & 0x80);
+  }
+  *pp = p;
+  *out = v;
+  return 0;
+}
+
+
+/**
+ * Plain strings are returned pointing into the block, Huffman coded
+ * ones are decoded into the scratch buffer at *soff
+ */
+static int
+hpack_get_string(hpack_table_t *ht, const uint8_t **pp, const uint8_t *end,
+                 int *soff, const char **str, int *len)
+{
+  int huff;
+  uint32_t l;
+
+  if(*pp == end)
+    return -1;
+
+  huff = **pp & 0x80;
+  if(hpack_get_int(pp, end, 7, &l) || l > end - *pp)
+    return -1;
+
+  if(huff) {
+    char *dst = ht->ht_scratch + *soff;
+    int n = hpack_huff_decode(*pp, l, dst);
+    if(n < 0)
+      return -1;
+    *soff += n;
+    *str = dst;
+    *len = n;
+  } else {
+    *str = (const char *)*pp;
+    *len = l;
+  }
+  *pp += l;
+  return 0;
+}
+
+
+/**
+ *
+ */
+int
+hpack_decode(hpack_table_t *ht, const uint8_t *buf, int len,
+             hpack_header_cb_t *cb, void *opaque)
+{
+  const uint8_t *p = buf, *end = buf + len;
+  const char *name, *value;
+  int name_len, value_len, soff, r;
+  uint32_t idx;
+
+  // Name and value of one header can never expand beyond this
+  if(ht->ht_scratch_size < len * 2 + 16) {
+    ht->ht_scratch_size = len * 2 + 16;
+    free(ht->ht_scratch);
+    ht->ht_scratch = malloc(ht->ht_scratch_size);
+  }
+
+  while(p < end) {
+    uint8_t b = *p;
+    soff = 0;
+
+    if(b & 0x80) {
+      // Indexed header field
+      if(hpack_get_int(&p, end, 7, &idx) ||
+         hpack_table_get(ht, idx, &name, &name_len, &value, &value_len))
+        return -1;
+
+    } else if((b & 0xe0) == 0x20) {
+      // Dynamic table size update
+      if(hpack_get_int(&p, end, 5, &idx) || idx > ht->ht_limit)
+        return -1;
+      ht->ht_max_size = idx;
+      hpack_table_evict(ht, 0);
+      continue;
+
+    } else {
+      // Literal, with incremental indexing (01), without (0000) or
+      // never indexed (0001)
+      int incremental = (b & 0xc0) == 0x40;
+
+      if(hpack_get_int(&p, end, incremental ? 6 : 4, &idx))
+        return -1;
+
+      if(idx) {
+        if(hpack_table_get(ht, idx, &name, &name_len, &value, &value_len))
+          return -1;
+      } else {
+        if(hpack_get_string(ht, &p, end, &soff, &name, &name_len))
+          return -1;
+      }
+
+      if(hpack_get_string(ht, &p, end, &soff, &value, &value_len))
+        return -1;
+
+      if(incremental) {
+        // Insert after the callback, name may point into an entry
+        // that the insertion evicts
+        r = cb(opaque, name, name_len, value, value_len);
+        hpack_table_add(ht, name, name_len, value, value_len);
+        if(r)
+          return r;
+        continue;
+      }
+    }
+
+    if((r = cb(opaque, name, name_len, value, value_len)) != 0)
+      return r;
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+hpack_put_int(htsbuf_queue_t *hq, uint8_t first, int prefix, uint32_t v)
+{
+  uint8_t buf[8];
+  uint32_t max = (1 << prefix) - 1;
+  int n = 0;
+
+  if(v < max) {
+    buf[n++] = first | v;
+  } else {
+    buf[n++] = first | max;
+    v -= max;
+    while(v >= 128) {
+      buf[n++] = (v & 0x7f) | 0x80;
+      v >>= 7;
+    }
+    buf[n++] = v;
+  }
+  htsbuf_append(hq, buf, n);
+}
+
+
+/**
+ * Strings are Huffman coded whenever that makes them shorter
+ */
+static void
+hpack_put_string(htsbuf_queue_t *hq, const char *s, int len)
+{
+  int hlen = hpack_huff_encoded_len(s, len);
+
+  if(hlen < len) {
+    uint8_t *tmp = alloca(hlen);
+    hpack_huff_encode(tmp, s, len);
+    hpack_put_int(hq, 0x80, 7, hlen);
+    htsbuf_append(hq, tmp, hlen);
+  } else {
+    hpack_put_int(hq, 0, 7, len);
+    htsbuf_append(hq, s, len);
+  }
+}
+
+
+/**
+ * Header names must be lower case
+ */
+void
+hpack_encode(hpack_table_t *ht, htsbuf_queue_t *hq,
+             const char *name, const char *value, int flags)
+{
+  int name_len = strlen(name);
+  int value_len = strlen(value);
+  int name_idx = 0, i;
+
+  if(ht->ht_resized) {
+    hpack_put_int(hq, 0x20, 5, ht->ht_max_size);
+    ht->ht_resized = 0;
+  }
+
+  for(i = 0; i < HPACK_STATIC_ENTRIES; i++) {
+    if(strcmp(hpack_static_table[i].name, name))
+      continue;
+    if(!strcmp(hpack_static_table[i].value, value)) {
+      hpack_put_int(hq, 0x80, 7, i + 1);
+      return;
+    }
+    if(name_idx == 0)
+      name_idx = i + 1;
+  }
+
+  for(i = 0; i < ht->ht_count; i++) {
+    const hpack_entry_t *he =
+      &ht->ht_entries[(ht->ht_first + i) % ht->ht_capacity];
+    if(he->he_name_len != name_len || memcmp(he->he_name, name, name_len))
+      continue;
+    if(he->he_value_len == value_len &&
+       !memcmp(he->he_value, value, value_len)) {
+      hpack_put_int(hq, 0x80, 7, HPACK_STATIC_ENTRIES + 1 + i);
+      return;
+    }
+    if(name_idx == 0)
+      name_idx = HPACK_STATIC_ENTRIES + 1 + i;
+  }
+
+  if(flags & HPACK_NO_INDEX)
+    hpack_put_int(hq, 0x00, 4, name_idx);
+  else
+    hpack_put_int(hq, 0x40, 6, name_idx);
+
+  if(name_idx == 0)
+    hpack_put_string(hq, name, name_len);
+  hpack_put_string(hq, value, value_len);
+
+  if(!(flags & HPACK_NO_INDEX))
+    hpack_table_add(ht, name, name_len, value, value_len);
+}
@@ -0,0 +1,81 @@
+/*
+ *  HPACK header compression for HTTP/2 (RFC 7541)
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "htsbuf.h"
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+typedef struct hpack_entry {
+  char *he_name;   // Name and value share one allocation
+  char *he_value;
+  int he_name_len;
+  int he_value_len;
+} hpack_entry_t;
+
+
+/**
+ * Dynamic table. One instance per direction and connection
+ *
+ * Entries live in a ring, ht_first is the most recently inserted
+ */
+typedef struct hpack_table {
+  hpack_entry_t *ht_entries;
+  int ht_capacity;
+  int ht_first;
+  int ht_count;
+
+  int ht_size;       // Sum of entry sizes as defined in RFC 7541 4.1
+  int ht_max_size;   // Current limit
+  int ht_limit;      // Limit as negotiated by SETTINGS_HEADER_TABLE_SIZE
+
+  int ht_resized;    // Encoder must signal a size update
+
+  char *ht_scratch;  // Decoder string buffer
+  int ht_scratch_size;
+} hpack_table_t;
+
+
+void hpack_table_init(hpack_table_t *ht, int limit);
+
+void hpack_table_destroy(hpack_table_t *ht);
+
+void hpack_table_set_limit(hpack_table_t *ht, int limit);
+
+
+typedef int (hpack_header_cb_t)(void *opaque,
+                                const char *name, int name_len,
+                                const char *value, int value_len);
+
+/**
+ * Decode a complete header block, the callback is invoked for each
+ * header in order. Returns 0 or -1 if the block is broken (which is a
+ * connection error as the table state is lost). Non-zero returns from
+ * the callback are passed back as is
+ */
+int hpack_decode(hpack_table_t *ht, const uint8_t *buf, int len,
+                 hpack_header_cb_t *cb, void *opaque);
+
+#define HPACK_NO_INDEX 0x1  // Value changes often, don't waste table space
+
+void hpack_encode(hpack_table_t *ht, htsbuf_queue_t *hq,
+                  const char *name, const char *value, int flags);
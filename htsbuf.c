@@ -109,6 +109,56 @@ htsbuf_append(htsbuf_queue_t *hq, const void *buf, size_t len)
   memcpy(hd->hd_data, buf, len);
 }
 
+/**
+ *
+ */
+void
+htsbuf_append_str(htsbuf_queue_t *hq, const char *str)
+{
+  htsbuf_append(hq, str, strlen(str));
+}
+
+
+/**
+ * Decimal integer without going through printf
+ */
+void
+htsbuf_append_int64(htsbuf_queue_t *hq, int64_t v)
+{
+  char buf[24], *p = buf + sizeof(buf);
+  uint64_t u = v < 0 ? -(uint64_t)v : v;
+
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while(u);
+
+  if(v < 0)
+    *--p = '-';
+
+  htsbuf_append(hq, p, buf + sizeof(buf) - p);
+}
+
+
+/**
+ *
+ */
+void
+htsbuf_prepend(htsbuf_queue_t *hq, const void *buf, size_t len)
+{
+  htsbuf_data_t *hd = malloc(sizeof(htsbuf_data_t));
+
+  hq->hq_size += len;
+  TAILQ_INSERT_HEAD(&hq->hq_q, hd, hd_link);
+
+  hd->hd_data = malloc(len);
+  hd->hd_data_size = len;
+  hd->hd_data_len = len;
+  hd->hd_data_off = 0;
+  memcpy(hd->hd_data, buf, len);
+}
+
+
 /**
  *
  */
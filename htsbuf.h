@@ -53,6 +53,17 @@ void htsbuf_qprintf(htsbuf_queue_t *hq, const char *fmt, ...);
 
 void htsbuf_append(htsbuf_queue_t *hq, const void *buf, size_t len);
 
+void htsbuf_append_str(htsbuf_queue_t *hq, const char *str);
+
+void htsbuf_append_int64(htsbuf_queue_t *hq, int64_t v);
+
+/**
+ * Append a string literal, length is known at compile time
+ */
+#define HTSBUF_APPEND_CONST(hq, str) htsbuf_append(hq, "" str, sizeof(str) - 1)
+
+void htsbuf_prepend(htsbuf_queue_t *hq, const void *buf, size_t len);
+
 void htsbuf_append_prealloc(htsbuf_queue_t *hq, const void *buf, size_t len);
 
 void htsbuf_data_free(htsbuf_queue_t *hq, htsbuf_data_t *hd);
@@ -23,21 +23,34 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <inttypes.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/param.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 
+#include <zlib.h>
+
 #include "strtab.h"
 #include "misc.h"
 #include "trace.h"
 #include "tcp.h"
 #include "http.h"
+#include "http2.h"
 #include "cfg.h"
 #include "htsmsg_json.h"
+#include "json.h"
 #include "talloc.h"
+#include "http_accesslog.h"
+#include "http_metrics.h"
+#include "http_ratelimit.h"
+#include "http_qos.h"
 
 static void *http_server;
 
@@ -47,25 +60,71 @@ typedef struct http_path {
   void *hp_opaque;
   http_callback_t *hp_callback;
   int hp_len;
+  int hp_seq;
+  int hp_metrics_id;
 } http_path_t;
 
 
 static LIST_HEAD(, http_path) http_paths;
+static int http_path_seq;
 
 
-typedef struct http_route {
+struct http_route {
   LIST_ENTRY(http_route) hr_link;
+  LIST_ENTRY(http_route) hr_regex_link;
   int hr_flags;
   char *hr_path;
   regex_t hr_reg;
   int hr_depth;
+  int hr_prio;     // Position in http_routes, lower wins
+  int hr_compiled; // Matched via route trie, else hr_reg
+  int64_t hr_max_body; // -1 means use http.maxBodySize
+  struct http_route_cache *hr_cache;
+  http_ratelimit_t hr_ratelimit; // rate -1 means use http.rateLimit
+  int hr_metrics_id;
   http_callback2_t *hr_callback;
-} http_route_t;
+};
 
 
 static LIST_HEAD(, http_route) http_routes;
+static LIST_HEAD(, http_route) http_regex_routes;
+
+
+/**
+ * Routes and paths are dispatched via radix tries. Literal edges are
+ * compressed, parameters hang off their own child list.
+ *
+ * Route literals are stored in lower case (routes are REG_ICASE),
+ * path literals are stored verbatim
+ */
+LIST_HEAD(route_node_list, route_node);
+
+#define ROUTE_PARAM_SEGMENT   1  // ([^/]*) or ([^/]+)
+#define ROUTE_PARAM_INTEGER   2  // ([0-9]*) or ([0-9]+)
+#define ROUTE_PARAM_REST      3  // (.*) or (.+)
 
-#define HTTP_ERROR_DISCONNECT -1
+typedef struct route_node {
+  LIST_ENTRY(route_node) rn_link;
+  struct route_node_list rn_literals;
+  struct route_node_list rn_params;
+
+  char *rn_label;
+  int rn_label_len;
+
+  int rn_param;
+  int rn_param_nonempty;
+
+  http_route_t *rn_route;      // Route ending here (prefix match)
+  http_route_t *rn_route_eol;  // Route ending here with '$'
+  http_path_t *rn_path;
+
+  int rn_min_prio;             // Best priority in this subtree
+} route_node_t;
+
+static route_node_t route_root;
+static route_node_t path_root;
+
+#define HTTP_BODY_DRAIN_MAX 65536
 
 static struct strtab HTTP_cmdtab[] = {
   { "GET",        HTTP_CMD_GET },
@@ -73,6 +132,7 @@ static struct strtab HTTP_cmdtab[] = {
   { "POST",       HTTP_CMD_POST },
   { "PUT",        HTTP_CMD_PUT },
   { "DELETE",     HTTP_CMD_DELETE },
+  { "PRI",        HTTP_CMD_PRI },
   { "DESCRIBE",   RTSP_CMD_DESCRIBE },
   { "OPTIONS",    RTSP_CMD_OPTIONS },
   { "SETUP",      RTSP_CMD_SETUP },
@@ -87,10 +147,119 @@ static struct strtab HTTP_versiontab[] = {
   { "HTTP/1.0",        HTTP_VERSION_1_0 },
   { "HTTP/1.1",        HTTP_VERSION_1_1 },
   { "RTSP/1.0",        RTSP_VERSION_1_0 },
+  { "HTTP/2.0",        HTTP_VERSION_2 },
 };
 
 static void http_parse_query_args(http_connection_t *hc, char *args);
 
+static unsigned int http_arg_hash(const char *s);
+
+
+/**
+ *
+ */
+const char *
+http_cmd2str(int cmd)
+{
+  return val2str(cmd, HTTP_cmdtab);
+}
+
+
+/**
+ * Settings used by the request loop, refreshed when config is reloaded
+ */
+typedef struct http_config {
+  int trace;
+  int max_header_size;
+  int compress_level;
+  int compress_min_size;
+  int stream_flush_size;
+  int output_flush_size;
+  int64_t max_body_size;
+  int64_t body_spill_size;
+  int64_t cache_size;
+  int header_timeout;
+  int keepalive_timeout;
+  int body_timeout;
+  int body_min_rate;
+  int send_timeout;
+  int coalesce_timeout;
+  char tmp_dir[256];
+} http_config_t;
+
+static void
+http_config_fill(void *opaque, cfg_t *cr)
+{
+  http_config_t *c = opaque;
+  c->trace = cfg_get_int(cr, CFG("http", "trace"), 0);
+  c->max_header_size =
+    MAX(cfg_get_int(cr, CFG("http", "maxHeaderSize"), 16384), 1024);
+  c->compress_level =
+    MIN(MAX(cfg_get_int(cr, CFG("http", "compressLevel"), 6), 0), 9);
+  c->compress_min_size =
+    cfg_get_int(cr, CFG("http", "compressMinSize"), 1024);
+  c->stream_flush_size =
+    MAX(cfg_get_int(cr, CFG("http", "streamFlushSize"), 16384), 1);
+  c->output_flush_size =
+    cfg_get_int(cr, CFG("http", "outputFlushSize"), 65536);
+  c->max_body_size =
+    cfg_get_s64(cr, CFG("http", "maxBodySize"), 1024 * 1024 * 1024);
+  c->body_spill_size =
+    cfg_get_s64(cr, CFG("http", "bodySpillSize"), 1024 * 1024);
+  c->cache_size =
+    cfg_get_s64(cr, CFG("http", "cacheSize"), 16 * 1024 * 1024);
+  snprintf(c->tmp_dir, sizeof(c->tmp_dir), "%s",
+           cfg_get_str(cr, CFG("http", "tmpDir"), "/tmp"));
+
+  // Slow client limits, in seconds (bytes per second for the rate)
+  c->header_timeout =
+    MAX(cfg_get_int(cr, CFG("http", "headerTimeout"), 10), 0);
+  c->keepalive_timeout =
+    MAX(cfg_get_int(cr, CFG("http", "keepAliveTimeout"), 15), 0);
+  c->body_timeout =
+    MAX(cfg_get_int(cr, CFG("http", "bodyTimeout"), 10), 0);
+  c->body_min_rate =
+    MAX(cfg_get_int(cr, CFG("http", "bodyMinRate"), 1024), 0);
+  c->send_timeout =
+    MAX(cfg_get_int(cr, CFG("http", "sendTimeout"), 30), 0);
+  c->coalesce_timeout =
+    MAX(cfg_get_int(cr, CFG("http", "coalesceTimeout"), 10), 0);
+}
+
+CFG_VIEW(http_config_t, http_config, http_config_fill);
+
+
+/**
+ * Walk the path trie. Among all registered paths that are a prefix of
+ * the request path (ending at a path boundary) the most recently added
+ * one wins
+ */
+static http_path_t *
+path_trie_match(const char *path, int *lenp)
+{
+  const route_node_t *rn = &path_root, *c;
+  const char *p = path;
+  http_path_t *best = NULL;
+
+  while(1) {
+    if(rn->rn_path != NULL && (*p == 0 || *p == '/' || *p == '?') &&
+       (best == NULL || rn->rn_path->hp_seq > best->hp_seq))
+      best = rn->rn_path;
+
+    LIST_FOREACH(c, &rn->rn_literals, rn_link)
+      if(c->rn_label[0] == *p)
+        break;
+
+    if(c == NULL || strncmp(p, c->rn_label, c->rn_label_len))
+      break;
+    p += c->rn_label_len;
+    rn = c;
+  }
+  if(best != NULL)
+    *lenp = best->hp_len;
+  return best;
+}
+
 
 /**
  *
@@ -101,19 +270,15 @@ http_resolve_path(http_connection_t *hc)
   http_path_t *hp;
   char *v;
   const char *remain = NULL;
+  int len;
 
-  LIST_FOREACH(hp, &http_paths, hp_link) {
-    if(!strncmp(hc->hc_path, hp->hp_path, hp->hp_len)) {
-      if(hc->hc_path[hp->hp_len] == 0 || hc->hc_path[hp->hp_len] == '/' ||
-	 hc->hc_path[hp->hp_len] == '?')
-	break;
-    }
-  }
+  hp = path_trie_match(hc->hc_path, &len);
 
   if(hp == NULL)
     return 404;
 
-  v = hc->hc_path + hp->hp_len;
+  hc->hc_metrics_id = hp->hp_metrics_id;
+  v = hc->hc_path + len;
 
 
   switch(*v) {
@@ -136,34 +301,157 @@ http_resolve_path(http_connection_t *hc)
 
 #define MAX_ROUTE_MATCHES 32
 
+typedef struct route_match {
+  http_route_t *rm_route;
+  int rm_prio;
+  int rm_argc;
+  regmatch_t rm_match[MAX_ROUTE_MATCHES];
+} route_match_t;
+
+
 /**
- *
+ * Depth first search for the best (lowest priority value) route.
+ * Parameters are greedy, which is exact since they are only compiled
+ * when followed by a '/', '$' or end of pattern
  */
-static int
-http_resolve_route(http_connection_t *hc, int cont)
+static void
+route_trie_match(const route_node_t *rn, const char *path, const char *p,
+                 regmatch_t *m, int argc, route_match_t *best)
+{
+  const route_node_t *c;
+  const char *q;
+
+  if(rn->rn_min_prio >= best->rm_prio)
+    return;
+
+  http_route_t *hr = rn->rn_route;
+  if(*p == 0 && rn->rn_route_eol != NULL &&
+     (hr == NULL || rn->rn_route_eol->hr_prio < hr->hr_prio))
+    hr = rn->rn_route_eol;
+
+  if(hr != NULL && hr->hr_prio < best->rm_prio) {
+    best->rm_route = hr;
+    best->rm_prio = hr->hr_prio;
+    best->rm_argc = argc;
+    memcpy(best->rm_match, m, argc * sizeof(regmatch_t));
+    best->rm_match[0].rm_so = 0;
+    best->rm_match[0].rm_eo = p - path;
+  }
+
+  LIST_FOREACH(c, &rn->rn_literals, rn_link)
+    if(c->rn_label[0] == tolower((unsigned char)*p))
+      break;
+
+  if(c != NULL && !strncasecmp(p, c->rn_label, c->rn_label_len))
+    route_trie_match(c, path, p + c->rn_label_len, m, argc, best);
+
+  if(argc == MAX_ROUTE_MATCHES)
+    return;
+
+  LIST_FOREACH(c, &rn->rn_params, rn_link) {
+    q = p;
+    switch(c->rn_param) {
+    case ROUTE_PARAM_SEGMENT:
+      while(*q && *q != '/')
+        q++;
+      break;
+    case ROUTE_PARAM_INTEGER:
+      while(*q >= '0' && *q <= '9')
+        q++;
+      break;
+    case ROUTE_PARAM_REST:
+      q += strlen(q);
+      break;
+    }
+    if(q == p && c->rn_param_nonempty)
+      continue;
+
+    m[argc].rm_so = p - path;
+    m[argc].rm_eo = q - path;
+    route_trie_match(c, path, q, m, argc + 1, best);
+  }
+}
+
+
+/**
+ * Find the route for path, rm_route is NULL if none matches
+ */
+static http_route_t *
+http_route_match(const char *path, route_match_t *best)
 {
   http_route_t *hr;
   regmatch_t match[MAX_ROUTE_MATCHES];
-  char *argv[MAX_ROUTE_MATCHES];
   int argc;
 
-  LIST_FOREACH(hr, &http_routes, hr_link)
-    if(!regexec(&hr->hr_reg, hc->hc_path, 32, match, 0))
+  best->rm_route = NULL;
+  best->rm_prio = INT_MAX;
+  route_trie_match(&route_root, path, path, match, 1, best);
+
+  // Regex routes are kept in priority order, only those ranked before
+  // the trie match need to be tried
+
+  LIST_FOREACH(hr, &http_regex_routes, hr_regex_link) {
+    if(hr->hr_prio >= best->rm_prio)
+      break;
+    if(!regexec(&hr->hr_reg, path, MAX_ROUTE_MATCHES,
+                best->rm_match, 0)) {
+      best->rm_route = hr;
+      for(argc = 0; argc < MAX_ROUTE_MATCHES; argc++)
+        if(best->rm_match[argc].rm_so == -1)
+          break;
+      best->rm_argc = argc;
       break;
+    }
+  }
+  return best->rm_route;
+}
 
-  if(hr == NULL)
-    return 404;
+
+/**
+ *
+ */
+static http_route_t *
+http_route_find(http_connection_t *hc, route_match_t *best)
+{
+  return http_route_match(hc->hc_path, best);
+}
+
+
+/**
+ * For HTTP/2 streams, which must settle flow control before the
+ * request is dispatched
+ */
+int64_t
+http_route_body_limit(const char *path, int *flags)
+{
+  route_match_t rm;
+  http_route_t *hr = http_route_match(path, &rm);
+
+  *flags = hr != NULL ? hr->hr_flags : 0;
+  return hr != NULL && hr->hr_max_body >= 0 ?
+    hr->hr_max_body : http_config()->max_body_size;
+}
+
+
+/**
+ *
+ */
+static int
+http_route_invoke(http_connection_t *hc, const route_match_t *best, int cont)
+{
+  http_route_t *hr = best->rm_route;
+  char *argv[MAX_ROUTE_MATCHES];
+  int argc;
 
   if(cont && !(hr->hr_flags & HTTP_ROUTE_HANDLE_100_CONTINUE))
     return 100;
 
-  for(argc = 0; argc < MAX_ROUTE_MATCHES; argc++) {
-    if(match[argc].rm_so == -1)
-      break;
-    int len = match[argc].rm_eo - match[argc].rm_so;
+  for(argc = 0; argc < best->rm_argc; argc++) {
+    const regmatch_t *rm = &best->rm_match[argc];
+    int len = rm->rm_eo - rm->rm_so;
     char *s = argv[argc] = alloca(len + 1);
     s[len] = 0;
-    memcpy(s, hc->hc_path + match[argc].rm_so, len);
+    memcpy(s, hc->hc_path + rm->rm_so, len);
   }
 
   return hr->hr_callback(hc, argc, argv,
@@ -180,11 +468,23 @@ static const char *
 http_rc2str(int code)
 {
   switch(code) {
+  case HTTP_STATUS_CONTINUE:        return "Continue";
+  case HTTP_STATUS_SWITCHING_PROTOCOLS: return "Switching Protocols";
   case HTTP_STATUS_OK:              return "OK";
   case HTTP_STATUS_PARTIAL_CONTENT: return "Partial Content";
   case HTTP_STATUS_NOT_FOUND:       return "Not found";
   case HTTP_STATUS_UNAUTHORIZED:    return "Unauthorized";
   case HTTP_STATUS_BAD_REQUEST:     return "Bad request";
+  case HTTP_STATUS_REQUEST_TIMEOUT: return "Request Timeout";
+  case HTTP_STATUS_PAYLOAD_TOO_LARGE: return "Payload Too Large";
+  case HTTP_STATUS_URI_TOO_LONG:    return "URI Too Long";
+  case HTTP_STATUS_RANGE_NOT_SATISFIABLE: return "Range Not Satisfiable";
+  case HTTP_STATUS_UPGRADE_REQUIRED: return "Upgrade Required";
+  case HTTP_STATUS_TOO_MANY_REQUESTS: return "Too Many Requests";
+  case HTTP_STATUS_HEADER_TOO_LARGE:
+    return "Request Header Fields Too Large";
+  case HTTP_STATUS_NOT_IMPLEMENTED: return "Not Implemented";
+  case HTTP_STATUS_SERVICE_UNAVAILABLE: return "Service Unavailable";
   case HTTP_STATUS_FOUND:           return "Found";
   case HTTP_STATUS_NOT_MODIFIED:    return "Not modified";
   case HTTP_STATUS_TEMPORARY_REDIRECT: return "Temporary redirect";
@@ -195,14 +495,110 @@ http_rc2str(int code)
   }
 }
 
-static const char *cachedays[7] = {
-  "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
-};
+/**
+ *
+ */
+static void
+http_append_status_line(htsbuf_queue_t *q, http_connection_t *hc, int rc)
+{
+  htsbuf_append_str(q, val2str(hc->hc_version, HTTP_versiontab));
+  htsbuf_append(q, " ", 1);
+  htsbuf_append_int64(q, rc);
+  htsbuf_append(q, " ", 1);
+  htsbuf_append_str(q, http_rc2str(rc));
+  HTSBUF_APPEND_CONST(q, "\r\n");
+}
 
-static const char *cachemonths[12] = {
-  "Jan", "Feb", "Mar", "Apr", "May", "Jun",
-  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
-};
+
+/**
+ *
+ */
+static void
+http_append_header(htsbuf_queue_t *q, const char *name, const char *value)
+{
+  htsbuf_append_str(q, name);
+  HTSBUF_APPEND_CONST(q, ": ");
+  htsbuf_append_str(q, value);
+  HTSBUF_APPEND_CONST(q, "\r\n");
+}
+
+
+/**
+ * Write out everything queued in hc_output
+ */
+int
+http_output_flush(http_connection_t *hc)
+{
+  int64_t ts;
+  int r;
+
+  if(hc->hc_h2 == NULL && TAILQ_EMPTY(&hc->hc_output.hq_q))
+    return 0;
+
+  hc->hc_bytes_out += hc->hc_output.hq_size;
+  ts = get_ts();
+
+  if(hc->hc_h2 != NULL) {
+    r = http2_output_flush(hc);
+  } else if(hc->hc_ts == NULL) {
+    htsbuf_queue_flush(&hc->hc_output);
+    r = -1;
+  } else {
+    r = tcp_write_queue(hc->hc_ts, &hc->hc_output);
+    if(r && (errno == EAGAIN || errno == EWOULDBLOCK))
+      http_metrics_timeout(HTTP_TIMEOUT_SEND);
+  }
+
+  hc->hc_write_time += get_ts() - ts;
+  return r;
+}
+
+
+/**
+ * Take the socket away from the server, for protocols that upgrade from
+ * HTTP/1.1. Whatever is queued is written first. The connection is
+ * done once the current request returns. Returns the fd or -1
+ */
+int
+http_detach(http_connection_t *hc)
+{
+  int fd;
+
+  if(hc->hc_ts == NULL || hc->hc_h2 != NULL || http_output_flush(hc))
+    return -1;
+
+  if((fd = tcp_steal_fd(hc->hc_ts)) == -1)
+    return -1;
+
+  hc->hc_ts = NULL;
+  hc->hc_keep_alive = 0;
+  return fd;
+}
+
+
+/**
+ * Responses are collected in hc_output and written when we are about
+ * to block on the socket, so replies to pipelined requests go out in a
+ * single gathered write
+ */
+static int
+http_output_check(http_connection_t *hc)
+{
+  if(hc->hc_output.hq_size >= http_config()->output_flush_size)
+    return http_output_flush(hc);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+http_output_queue(http_connection_t *hc, htsbuf_queue_t *hq)
+{
+  htsbuf_appendq(&hc->hc_output, hq);
+  return http_output_check(hc);
+}
 
 
 /**
@@ -212,192 +608,1153 @@ int
 http_send_100_continue(http_connection_t *hc)
 {
   htsbuf_queue_t q;
+
+  if(hc->hc_h2 != NULL)
+    return 0; // Flow control makes it pointless
+
   htsbuf_queue_init(&q, 0);
 
-  htsbuf_qprintf(&q, "%s 100 Continue\r\n\r\n",
-		 val2str(hc->hc_version, HTTP_versiontab));
-  return tcp_write_queue(hc->hc_ts, &q);
+  http_append_status_line(&q, hc, HTTP_STATUS_CONTINUE);
+  HTSBUF_APPEND_CONST(&q, "\r\n");
+  htsbuf_appendq(&hc->hc_output, &q);
+  return http_output_flush(hc);
 }
 
 
 
 /**
- * Transmit a HTTP reply
+ * Headers are appended straight into the queue, constant lines are
+ * copied as is and timestamps come from a per second cache
  */
-int
-http_send_header(http_connection_t *hc, int rc, const char *content, 
-		 int64_t contentlen,
-		 const char *encoding, const char *location, 
-		 int maxage, const char *range,
-		 const char *disposition, const char *transfer_encoding)
+static void
+http_format_header(http_connection_t *hc, htsbuf_queue_t *q, int rc,
+                   const char *content, int64_t contentlen,
+                   const char *encoding, const char *location,
+                   int maxage, const char *range,
+                   const char *disposition, const char *transfer_encoding)
 {
-  struct tm tm0, *tm;
-  htsbuf_queue_t hdrs;
-  time_t t;
+  time_t now = time(NULL);
 
-  htsbuf_queue_init(&hdrs, 0);
+  hc->hc_status = rc;
 
-  htsbuf_qprintf(&hdrs, "%s %d %s\r\n", 
-		 val2str(hc->hc_version, HTTP_versiontab),
-		 rc, http_rc2str(rc));
+  http_append_status_line(q, hc, rc);
 
-  htsbuf_qprintf(&hdrs, "Server: doozer2\r\n");
+  HTSBUF_APPEND_CONST(q, "Server: doozer2\r\nDate: ");
+  htsbuf_append_str(q, time_to_http_date(now));
+  HTSBUF_APPEND_CONST(q, "\r\n");
 
   if(maxage == 0) {
-    htsbuf_qprintf(&hdrs, "Cache-Control: no-cache\r\n");
+    HTSBUF_APPEND_CONST(q, "Cache-Control: no-cache\r\n");
   } else {
-    time(&t);
-
-    tm = gmtime_r(&t, &tm0);
-    htsbuf_qprintf(&hdrs, 
-		"Last-Modified: %s, %02d %s %d %02d:%02d:%02d GMT\r\n",
-		cachedays[tm->tm_wday],	tm->tm_year + 1900,
-		cachemonths[tm->tm_mon], tm->tm_mday,
-		tm->tm_hour, tm->tm_min, tm->tm_sec);
-
-    t += maxage;
-
-    tm = gmtime_r(&t, &tm0);
-    htsbuf_qprintf(&hdrs, 
-		"Expires: %s, %02d %s %d %02d:%02d:%02d GMT\r\n",
-		cachedays[tm->tm_wday],	tm->tm_year + 1900,
-		cachemonths[tm->tm_mon], tm->tm_mday,
-		tm->tm_hour, tm->tm_min, tm->tm_sec);
-      
-    htsbuf_qprintf(&hdrs, "Cache-Control: max-age=%d\r\n", maxage);
+    HTSBUF_APPEND_CONST(q, "Last-Modified: ");
+    htsbuf_append_str(q, time_to_http_date(now));
+    HTSBUF_APPEND_CONST(q, "\r\nExpires: ");
+    htsbuf_append_str(q, time_to_http_date(now + maxage));
+    HTSBUF_APPEND_CONST(q, "\r\nCache-Control: max-age=");
+    htsbuf_append_int64(q, maxage);
+    HTSBUF_APPEND_CONST(q, "\r\n");
   }
 
   if(rc == HTTP_STATUS_UNAUTHORIZED)
-    htsbuf_qprintf(&hdrs, "WWW-Authenticate: Basic realm=\"doozer\"\r\n");
+    HTSBUF_APPEND_CONST(q,
+                        "WWW-Authenticate: Basic realm=\"doozer\"\r\n");
+
+  if(rc == HTTP_STATUS_NOT_MODIFIED) {
+    // Never has a body, connection can be kept
+  } else if(contentlen >= 0) {
+    HTSBUF_APPEND_CONST(q, "Content-Length: ");
+    htsbuf_append_int64(q, contentlen);
+    HTSBUF_APPEND_CONST(q, "\r\n");
+  } else if(transfer_encoding == NULL) {
+    // Unknown length and not chunked, body is delimited by close
+    hc->hc_keep_alive = 0;
+  }
 
-  if(contentlen > 0)
-    htsbuf_qprintf(&hdrs, "Content-Length: %"PRId64"\r\n", contentlen);
-  else
+  if(hc->hc_body_remain > HTTP_BODY_DRAIN_MAX) {
+    // Too much of the request body left to skip once we're done
     hc->hc_keep_alive = 0;
+  }
 
-  htsbuf_qprintf(&hdrs, "Connection: %s\r\n", 
-	      hc->hc_keep_alive ? "Keep-Alive" : "Close");
+  if(hc->hc_keep_alive)
+    HTSBUF_APPEND_CONST(q, "Connection: Keep-Alive\r\n");
+  else
+    HTSBUF_APPEND_CONST(q, "Connection: Close\r\n");
 
   if(encoding != NULL)
-    htsbuf_qprintf(&hdrs, "Content-Encoding: %s\r\n", encoding);
+    http_append_header(q, "Content-Encoding", encoding);
 
   if(transfer_encoding != NULL)
-    htsbuf_qprintf(&hdrs, "Transfer-Encoding: %s\r\n", transfer_encoding);
+    http_append_header(q, "Transfer-Encoding", transfer_encoding);
 
   if(location != NULL)
-    htsbuf_qprintf(&hdrs, "Location: %s\r\n", location);
+    http_append_header(q, "Location", location);
 
   if(content != NULL)
-    htsbuf_qprintf(&hdrs, "Content-Type: %s\r\n", content);
-
+    http_append_header(q, "Content-Type", content);
 
   if(range) {
-    htsbuf_qprintf(&hdrs, "Accept-Ranges: %s\r\n", "bytes");
-    htsbuf_qprintf(&hdrs, "Content-Range: %s\r\n", range);
+    HTSBUF_APPEND_CONST(q, "Accept-Ranges: bytes\r\n");
+    http_append_header(q, "Content-Range", range);
   }
 
   if(disposition != NULL)
-    htsbuf_qprintf(&hdrs, "Content-Disposition: %s\r\n", disposition);
+    http_append_header(q, "Content-Disposition", disposition);
 
   http_arg_t *ra;
-  TAILQ_FOREACH(ra, &hc->hc_response_headers, link)
-    htsbuf_qprintf(&hdrs, "%s: %s\r\n", ra->key, ra->val);
-
-  htsbuf_qprintf(&hdrs, "\r\n");
-  //  fprintf(stderr, "-- OUTPUT ------------------\n");
-  //  htsbuf_dump_raw_stderr(&hdrs);
-  //  fprintf(stderr, "----------------------------\n");
+  HTTP_ARG_FOREACH(ra, &hc->hc_response_headers)
+    http_append_header(q, ra->key, ra->val);
 
-  return tcp_write_queue(hc->hc_ts, &hdrs);
+  HTSBUF_APPEND_CONST(q, "\r\n");
 }
 
 
-
 /**
  * Transmit a HTTP reply
  */
-static int
-http_send_reply(http_connection_t *hc, int rc, const char *content, 
-		const char *encoding, const char *location, int maxage)
+int
+http_send_header(http_connection_t *hc, int rc, const char *content,
+		 int64_t contentlen,
+		 const char *encoding, const char *location,
+		 int maxage, const char *range,
+		 const char *disposition, const char *transfer_encoding)
 {
-  if(http_send_header(hc, rc, content, hc->hc_reply.hq_size,
-                      encoding, location, maxage, 0, NULL, NULL))
-    return -1;
+  htsbuf_queue_t hdrs;
 
-  if(hc->hc_no_output)
-    return 0;
+  if(hc->hc_h2 != NULL) {
+    hc->hc_status = rc;
+    return http2_send_header(hc, rc, content, contentlen, encoding,
+                             location, maxage, range, disposition);
+  }
 
-  return tcp_write_queue(hc->hc_ts, &hc->hc_reply);
+  htsbuf_queue_init(&hdrs, 0);
+  http_format_header(hc, &hdrs, rc, content, contentlen, encoding,
+                     location, maxage, range, disposition,
+                     transfer_encoding);
+  return http_output_queue(hc, &hdrs);
 }
 
 
+
 /**
- * Send HTTP error back
+ * Returns q-value (0 - 1000) for the given coding in an Accept-Encoding
+ * header. '*' matches anything not explicitly listed
  */
-int
-http_err(http_connection_t *hc, int error, const char *str)
+static int
+http_accept_encoding_q(const char *s, const char *coding)
 {
-  const char *errtxt = http_rc2str(error);
-  htsbuf_queue_flush(&hc->hc_reply);
-
-  htsbuf_qprintf(&hc->hc_reply, 
-		 "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
-		 "<HTML><HEAD>\r\n"
-		 "<TITLE>%d %s</TITLE>\r\n"
-		 "</HEAD><BODY>\r\n"
-		 "<H1>%d %s</H1>\r\n",
-		 error, errtxt, error, errtxt);
-
-  if(str != NULL)
-    htsbuf_qprintf(&hc->hc_reply, "<p>%s</p>\r\n", str);
+  int len = strlen(coding);
+  int q_wild = 0;
 
-  htsbuf_qprintf(&hc->hc_reply, "</BODY></HTML>\r\n");
+  while(*s) {
+    while(*s == ' ' || *s == '\t' || *s == ',')
+      s++;
+    const char *name = s;
+    while(*s && *s != ',' && *s != ';' && *s != ' ' && *s != '\t')
+      s++;
+    int namelen = s - name;
+    int q = 1000;
+
+    while(*s && *s != ',') {
+      if(*s == ';') {
+        s++;
+        while(*s == ' ' || *s == '\t')
+          s++;
+        if((*s == 'q' || *s == 'Q') && s[1] == '=') {
+          s += 2;
+          q = (*s == '1') ? 1000 : 0;
+          if(*s == '0' || *s == '1') {
+            s++;
+            if(*s == '.') {
+              s++;
+              for(int m = 100; m > 0 && *s >= '0' && *s <= '9'; m /= 10)
+                q += (*s++ - '0') * m;
+            }
+          }
+          continue;
+        }
+      }
+      s++;
+    }
 
-  http_send_reply(hc, error, "text/html", NULL, NULL, 0);
-  return 0;
+    if(namelen == len && !strncasecmp(name, coding, len))
+      return MIN(q, 1000);
+    if(namelen == 1 && *name == '*')
+      q_wild = MIN(q, 1000);
+  }
+  return q_wild;
 }
 
 
 /**
- * Send HTTP error back
+ *
  */
-void
-http_error(http_connection_t *hc, int error)
+int
+http_encoding_accepted(http_connection_t *hc, int encoding)
 {
-  http_err(hc, error, NULL);
+  const char *ae = http_header_get(hc, HTTP_HDR_ACCEPT_ENCODING);
+  if(ae == NULL)
+    return 0;
+
+  switch(encoding) {
+  case HTTP_ENCODING_GZIP:
+    return MAX(http_accept_encoding_q(ae, "gzip"),
+               http_accept_encoding_q(ae, "x-gzip"));
+  case HTTP_ENCODING_DEFLATE:
+    return http_accept_encoding_q(ae, "deflate");
+  default:
+    return 0;
+  }
 }
 
 
 /**
- * Send an HTTP OK, simple version for text/html
+ * Pick content coding from Accept-Encoding, gzip wins ties
  */
 int
-http_output_html(http_connection_t *hc)
+http_negotiate_encoding(http_connection_t *hc)
 {
-  return http_send_reply(hc, HTTP_STATUS_OK, "text/html; charset=UTF-8",
-			 NULL, NULL, 0);
+  int gzip = http_encoding_accepted(hc, HTTP_ENCODING_GZIP);
+  int deflate = http_encoding_accepted(hc, HTTP_ENCODING_DEFLATE);
+
+  if(gzip > 0 && gzip >= deflate)
+    return HTTP_ENCODING_GZIP;
+  if(deflate > 0)
+    return HTTP_ENCODING_DEFLATE;
+  return HTTP_ENCODING_IDENTITY;
 }
 
+
 /**
- * Send an HTTP OK, simple version for text/html
+ * Only textual formats are worth compressing, everything else
+ * (images, archives, video, ...) is most likely compressed already
  */
-int
-http_output_content(http_connection_t *hc, const char *content)
+static int
+http_content_compressible(const char *content)
 {
-  return http_send_reply(hc, HTTP_STATUS_OK, content, NULL, NULL, 0);
-}
+  if(content == NULL)
+    return 0;
+
+  if(!strncasecmp(content, "text/", 5))
+    return 1;
+
+  const char *sub = strchr(content, '/');
+  if(sub == NULL)
+    return 0;
+  sub++;
+  int len = strcspn(sub, "; ");
 
+  if(len >= 4 && !strncasecmp(sub + len - 4, "json", 4))
+    return 1;
+  if(len >= 3 && !strncasecmp(sub + len - 3, "xml", 3))
+    return 1;
+  if(len == 10 && !strncasecmp(sub, "javascript", 10))
+    return 1;
+  return 0;
+}
 
 
 /**
- * Send an HTTP REDIRECT
+ * Deflate streams are kept per thread and reset between uses
  */
-void
-http_redirect(http_connection_t *hc, const char *location, int status)
-{
-  htsbuf_queue_flush(&hc->hc_reply);
+typedef struct http_zstate {
+  z_stream hz_zs[2];
+  int hz_level[2]; // -1 == not initialized
+} http_zstate_t;
 
-  htsbuf_qprintf(&hc->hc_reply,
+static pthread_key_t http_zstate_key;
+
+static void
+http_zstate_destroy(void *aux)
+{
+  http_zstate_t *hz = aux;
+  for(int i = 0; i < 2; i++)
+    if(hz->hz_level[i] != -1)
+      deflateEnd(&hz->hz_zs[i]);
+  free(hz);
+}
+
+static void __attribute__((constructor))
+http_zstate_init(void)
+{
+  pthread_key_create(&http_zstate_key, http_zstate_destroy);
+}
+
+static z_stream *
+http_zstream_get(int encoding, int level)
+{
+  http_zstate_t *hz = pthread_getspecific(http_zstate_key);
+  if(hz == NULL) {
+    hz = calloc(1, sizeof(http_zstate_t));
+    hz->hz_level[0] = hz->hz_level[1] = -1;
+    pthread_setspecific(http_zstate_key, hz);
+  }
+
+  int i = encoding == HTTP_ENCODING_GZIP;
+  z_stream *z = &hz->hz_zs[i];
+
+  if(hz->hz_level[i] == -1) {
+    if(deflateInit2(z, level, Z_DEFLATED, i ? 15 + 16 : 15, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+      return NULL;
+  } else {
+    deflateReset(z);
+    if(hz->hz_level[i] != level &&
+       deflateParams(z, level, Z_DEFAULT_STRATEGY) != Z_OK)
+      return NULL;
+  }
+  hz->hz_level[i] = level;
+  return z;
+}
+
+
+/**
+ * Compress hc_reply in place if the client accepts it and it's worth it
+ *
+ * Returns the Content-Encoding to send or NULL
+ */
+static const char *
+http_compress_reply(http_connection_t *hc, const char *content)
+{
+  const http_config_t *conf = http_config();
+  htsbuf_queue_t *hq = &hc->hc_reply;
+  htsbuf_data_t *hd;
+
+  if(conf->compress_level == 0 || hq->hq_size < conf->compress_min_size ||
+     !http_content_compressible(content))
+    return NULL;
+
+  http_arg_set(&hc->hc_response_headers, "Vary", "Accept-Encoding");
+
+  int encoding = http_negotiate_encoding(hc);
+  if(encoding == HTTP_ENCODING_IDENTITY)
+    return NULL;
+
+  z_stream *z = http_zstream_get(encoding, conf->compress_level);
+  if(z == NULL)
+    return NULL;
+
+  size_t bound = deflateBound(z, hq->hq_size);
+  uint8_t *out = malloc(bound);
+  z->next_out = out;
+  z->avail_out = bound;
+
+  int r = Z_OK;
+  TAILQ_FOREACH(hd, &hq->hq_q, hd_link) {
+    z->next_in = hd->hd_data + hd->hd_data_off;
+    z->avail_in = hd->hd_data_len - hd->hd_data_off;
+    r = deflate(z, TAILQ_NEXT(hd, hd_link) ? Z_NO_FLUSH : Z_FINISH);
+    if(r != Z_OK && r != Z_STREAM_END)
+      break;
+  }
+
+  if(r != Z_STREAM_END || z->total_out >= hq->hq_size) {
+    // Failed or didn't gain anything
+    free(out);
+    return NULL;
+  }
+
+  htsbuf_queue_flush(hq);
+  htsbuf_append_prealloc(hq, out, z->total_out);
+  return encoding == HTTP_ENCODING_GZIP ? "gzip" : "deflate";
+}
+
+
+/**
+ * Send (part of) a response body directly from memory, for use after
+ * http_send_header()
+ */
+int
+http_send_data(http_connection_t *hc, const void *data, size_t len)
+{
+  if(hc->hc_no_output)
+    return 0;
+
+  if(hc->hc_h2 != NULL) {
+    // Framed into DATA when flushed
+    htsbuf_append(&hc->hc_output, data, len);
+    if(hc->hc_output.hq_size >= http_config()->output_flush_size)
+      return http_output_flush(hc);
+    return 0;
+  }
+
+  if(hc->hc_output.hq_size + len < http_config()->output_flush_size) {
+    htsbuf_append(&hc->hc_output, data, len);
+    return 0;
+  }
+
+  if(http_output_flush(hc))
+    return -1;
+
+  while(len > 0) {
+    int r = tcp_write(hc->hc_ts, data, len);
+    if(r < 1)
+      return -1;
+    data += r;
+    len -= r;
+  }
+  return 0;
+}
+
+
+/**
+ * Returns 1 if the comma separated header value contains token
+ * (case insensitive), as used by Connection and Upgrade
+ */
+int
+http_token_match(const char *list, const char *token)
+{
+  int len = strlen(token);
+
+  while(*list) {
+    while(*list == ' ' || *list == ',')
+      list++;
+    if(!strncasecmp(list, token, len) &&
+       (list[len] == 0 || list[len] == ',' || list[len] == ' '))
+      return 1;
+    while(*list && *list != ',')
+      list++;
+  }
+  return 0;
+}
+
+
+/**
+ * Entity tag for a HTTP_ROUTE_ETAG reply, a 64 bit hash of the body as
+ * it goes out (after compression, so each content coding gets its own
+ * tag). Input is folded in a word at a time, bytes that don't fill a
+ * word are carried over to the next buffer
+ */
+static uint64_t
+http_etag_mix(uint64_t h, uint64_t w)
+{
+  h ^= w * 0x9e3779b97f4a7c15ULL;
+  return (h << 31 | h >> 33) * 0xc2b2ae3d27d4eb4fULL;
+}
+
+static void
+http_reply_etag(const htsbuf_queue_t *hq, char *etag, size_t size)
+{
+  const htsbuf_data_t *hd;
+  uint64_t h = hq->hq_size, w = 0, v;
+  int fill = 0;
+
+  TAILQ_FOREACH(hd, &hq->hq_q, hd_link) {
+    const uint8_t *p = hd->hd_data + hd->hd_data_off;
+    size_t len = hd->hd_data_len - hd->hd_data_off;
+
+    for(; fill > 0 && len > 0; len--) {
+      w |= (uint64_t)*p++ << (fill * 8);
+      if(++fill == 8) {
+        h = http_etag_mix(h, w);
+        w = fill = 0;
+      }
+    }
+
+    for(; len >= 8; p += 8, len -= 8) {
+      memcpy(&v, p, 8);
+      h = http_etag_mix(h, v);
+    }
+
+    for(; len > 0; len--)
+      w |= (uint64_t)*p++ << (fill++ * 8);
+  }
+
+  if(fill)
+    h = http_etag_mix(h, w);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  snprintf(etag, size, "\"%016"PRIx64"\"", h);
+}
+
+
+/**
+ * Returns 1 if If-None-Match matches the given (quoted) entity tag.
+ * Comparison is weak as mandated for If-None-Match (RFC 7232 3.2)
+ */
+int
+http_etag_match(http_connection_t *hc, const char *etag)
+{
+  const char *s = http_header_get(hc, HTTP_HDR_IF_NONE_MATCH);
+  int len;
+
+  if(s == NULL || etag == NULL)
+    return 0;
+
+  if(!strncmp(etag, "W/", 2))
+    etag += 2;
+  len = strlen(etag);
+
+  while(*s) {
+    while(*s == ' ' || *s == '\t' || *s == ',')
+      s++;
+    if(*s == '*')
+      return 1;
+    if(!strncmp(s, "W/", 2))
+      s += 2;
+    if(!strncmp(s, etag, len) &&
+       (s[len] == 0 || s[len] == ',' || s[len] == ' ' || s[len] == '\t'))
+      return 1;
+    while(*s && *s != ',')
+      s++;
+  }
+  return 0;
+}
+
+
+/**
+ * Streaming responses
+ *
+ * Data written is collected in hc_reply and sent as a chunk whenever
+ * http.streamFlushSize bytes have accumulated. HTTP/1.0 clients get the
+ * body raw and the connection is closed when done
+ */
+int
+http_stream_begin(http_connection_t *hc, int rc, const char *content)
+{
+  const char *te = NULL;
+
+  htsbuf_queue_flush(&hc->hc_reply);
+
+  if(hc->hc_version == HTTP_VERSION_1_1) {
+    hc->hc_streaming = HTTP_STREAM_CHUNKED;
+    te = "chunked";
+  } else {
+    hc->hc_streaming = HTTP_STREAM_RAW;
+  }
+
+  if(http_send_header(hc, rc, content, -1, NULL, NULL, 0, NULL, NULL, te)) {
+    hc->hc_streaming = HTTP_STREAM_ERROR;
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+http_stream_flush(http_connection_t *hc)
+{
+  htsbuf_queue_t *hq = &hc->hc_reply;
+
+  if(hc->hc_streaming == HTTP_STREAM_ERROR)
+    return -1;
+
+  if(hq->hq_size == 0)
+    return 0;
+
+  if(hc->hc_no_output) {
+    htsbuf_queue_flush(hq);
+    return 0;
+  }
+
+  if(hc->hc_streaming == HTTP_STREAM_CHUNKED) {
+    char hdr[20];
+    int len = snprintf(hdr, sizeof(hdr), "%x\r\n", hq->hq_size);
+    htsbuf_prepend(hq, hdr, len);
+    HTSBUF_APPEND_CONST(hq, "\r\n");
+  }
+
+  htsbuf_appendq(&hc->hc_output, hq);
+
+  if(http_output_flush(hc)) {
+    hc->hc_streaming = HTTP_STREAM_ERROR;
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+int
+http_stream_write(http_connection_t *hc, const void *data, size_t len)
+{
+  if(hc->hc_streaming == HTTP_STREAM_ERROR)
+    return -1;
+
+  htsbuf_append(&hc->hc_reply, data, len);
+
+  if(hc->hc_reply.hq_size >= http_config()->stream_flush_size)
+    return http_stream_flush(hc);
+  return 0;
+}
+
+
+/**
+ *
+ */
+int
+http_stream_printf(http_connection_t *hc, const char *fmt, ...)
+{
+  va_list ap;
+
+  if(hc->hc_streaming == HTTP_STREAM_ERROR)
+    return -1;
+
+  va_start(ap, fmt);
+  htsbuf_vqprintf(&hc->hc_reply, fmt, ap);
+  va_end(ap);
+
+  if(hc->hc_reply.hq_size >= http_config()->stream_flush_size)
+    return http_stream_flush(hc);
+  return 0;
+}
+
+
+/**
+ * Returns 0 or HTTP_ERROR_DISCONNECT so it can be the return value of
+ * a route or path callback
+ */
+int
+http_stream_end(http_connection_t *hc)
+{
+  int r = http_stream_flush(hc);
+
+  if(!r && hc->hc_streaming == HTTP_STREAM_CHUNKED && !hc->hc_no_output)
+    HTSBUF_APPEND_CONST(&hc->hc_output, "0\r\n\r\n");
+
+  hc->hc_streaming = HTTP_STREAM_NONE;
+  return r ? HTTP_ERROR_DISCONNECT : 0;
+}
+
+
+/**
+ * Route response cache
+ *
+ * Complete 200 replies of cached routes are stored pre-serialized,
+ * header and body back to back, and copied into hc_output on a hit.
+ * Entries are keyed on path, the route's selected query args and
+ * request headers, HTTP version and the negotiated content coding. An expired entry
+ * is served for another hrc_stale while the first request to see it
+ * recomputes it
+ */
+
+#define HTTP_CACHE_HASH_SIZE 256
+#define HTTP_CACHE_MAX_KEYS  16
+
+typedef struct http_route_cache {
+  int64_t hrc_ttl;    // usec
+  int64_t hrc_stale;  // usec
+  char *hrc_argbuf;
+  char *hrc_headerbuf;
+  int hrc_num_args;
+  int hrc_num_headers;
+  char *hrc_args[HTTP_CACHE_MAX_KEYS];
+  char *hrc_headers[HTTP_CACHE_MAX_KEYS];
+} http_route_cache_t;
+
+typedef struct http_cache_entry {
+  LIST_ENTRY(http_cache_entry) hce_hash_link;
+  TAILQ_ENTRY(http_cache_entry) hce_lru_link;
+  char *hce_key;
+  int64_t hce_stored;
+  int64_t hce_expire;
+  int64_t hce_stale;
+  int hce_revalidating;
+  int hce_status;
+  char hce_etag[20];  // Empty unless the route has HTTP_ROUTE_ETAG
+  size_t hce_size;  // Accounted against http.cacheSize
+  size_t hce_len;
+  size_t hce_age_at; // Where Age goes, before the blank line
+  uint8_t hce_data[0];
+} http_cache_entry_t;
+
+static pthread_mutex_t http_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, http_cache_entry) http_cache_hash[HTTP_CACHE_HASH_SIZE];
+static TAILQ_HEAD(http_cache_entry_queue, http_cache_entry) http_cache_lru =
+  TAILQ_HEAD_INITIALIZER(http_cache_lru);
+static size_t http_cache_used;
+
+
+/**
+ * Must be called with http_cache_mutex held
+ */
+static void
+http_cache_unlink(http_cache_entry_t *hce)
+{
+  LIST_REMOVE(hce, hce_hash_link);
+  TAILQ_REMOVE(&http_cache_lru, hce, hce_lru_link);
+  http_cache_used -= hce->hce_size;
+  free(hce->hce_key);
+  free(hce);
+}
+
+
+/**
+ * Must be called with http_cache_mutex held
+ */
+static http_cache_entry_t *
+http_cache_find(const char *key, unsigned int hash)
+{
+  http_cache_entry_t *hce;
+
+  LIST_FOREACH(hce, &http_cache_hash[hash], hce_hash_link)
+    if(!strcmp(hce->hce_key, key))
+      break;
+  return hce;
+}
+
+
+/**
+ * Values are length prefixed so they can't be crafted to look like
+ * other values, absent ones are -1
+ */
+static void
+http_cache_key_append(htsbuf_queue_t *q, const char *name, const char *v)
+{
+  if(v != NULL)
+    htsbuf_qprintf(q, "\n%s:%zd:%s", name, strlen(v), v);
+  else
+    htsbuf_qprintf(q, "\n%s:-1", name);
+}
+
+
+/**
+ *
+ */
+static char *
+http_cache_key(http_connection_t *hc, const http_route_cache_t *hrc)
+{
+  htsbuf_queue_t q;
+  int i;
+
+  htsbuf_queue_init(&q, 0);
+  htsbuf_append_str(&q, hc->hc_path);
+
+  for(i = 0; i < hrc->hrc_num_args; i++)
+    http_cache_key_append(&q, hrc->hrc_args[i],
+                          http_arg_get(&hc->hc_req_args, hrc->hrc_args[i]));
+
+  for(i = 0; i < hrc->hrc_num_headers; i++)
+    http_cache_key_append(&q, hrc->hrc_headers[i],
+                          http_arg_get(&hc->hc_args, hrc->hrc_headers[i]));
+
+  htsbuf_qprintf(&q, "\n%d %d", hc->hc_version, http_negotiate_encoding(hc));
+  return htsbuf_to_string(&q);
+}
+
+
+/**
+ * Returns 1 if the reply was queued from the cache. Otherwise the
+ * request may have been picked to fill the cache, in which case
+ * hc_cache_key is set
+ */
+static int
+http_cache_serve(http_connection_t *hc, const http_route_cache_t *hrc)
+{
+  http_cache_entry_t *hce;
+  unsigned int hash;
+  int64_t now;
+  char *key;
+
+  if(hc->hc_cmd != HTTP_CMD_GET || hc->hc_h2 != NULL || !hc->hc_keep_alive)
+    return 0;
+
+  key = http_cache_key(hc, hrc);
+  hash = http_arg_hash(key) % HTTP_CACHE_HASH_SIZE;
+  now = get_ts();
+
+  pthread_mutex_lock(&http_cache_mutex);
+  hce = http_cache_find(key, hash);
+  if(hce != NULL) {
+    if(now < hce->hce_expire ||
+       (now < hce->hce_stale && hce->hce_revalidating)) {
+      TAILQ_REMOVE(&http_cache_lru, hce, hce_lru_link);
+      TAILQ_INSERT_HEAD(&http_cache_lru, hce, hce_lru_link);
+      free(key);
+
+      if(hce->hce_etag[0] && http_etag_match(hc, hce->hce_etag)) {
+        char etag[sizeof(hce->hce_etag)];
+        strcpy(etag, hce->hce_etag);
+        pthread_mutex_unlock(&http_cache_mutex);
+        http_arg_set(&hc->hc_response_headers, "ETag", etag);
+        http_send_header(hc, HTTP_STATUS_NOT_MODIFIED, NULL, 0,
+                         NULL, NULL, 0, NULL, NULL, NULL);
+        return 1;
+      }
+
+      // The stored Date is from when the reply was made (RFC 9111 5.1)
+      htsbuf_append(&hc->hc_output, hce->hce_data, hce->hce_age_at);
+      htsbuf_qprintf(&hc->hc_output, "Age: %"PRId64"\r\n",
+                     (now - hce->hce_stored) / 1000000);
+      htsbuf_append(&hc->hc_output, hce->hce_data + hce->hce_age_at,
+                    hce->hce_len - hce->hce_age_at);
+      hc->hc_status = hce->hce_status;
+      pthread_mutex_unlock(&http_cache_mutex);
+      return 1;
+    }
+
+    if(now < hce->hce_stale)
+      hce->hce_revalidating = 1; // Others get the stale copy meanwhile
+    else
+      http_cache_unlink(hce);
+  }
+  pthread_mutex_unlock(&http_cache_mutex);
+
+  hc->hc_cache = hrc;
+  hc->hc_cache_key = key;
+  return 0;
+}
+
+
+/**
+ * Copy a reply into the cache. Header and body stay in their queues
+ */
+static void
+http_cache_store(http_connection_t *hc, htsbuf_queue_t *hdrs,
+                 htsbuf_queue_t *body)
+{
+  const http_route_cache_t *hrc = hc->hc_cache;
+  size_t budget = http_config()->cache_size;
+  size_t len = hdrs->hq_size + body->hq_size;
+  size_t size = sizeof(http_cache_entry_t) + len +
+    strlen(hc->hc_cache_key) + 1;
+  http_cache_entry_t *hce, *old;
+  unsigned int hash;
+
+  if(size > budget)
+    return;
+
+  hce = malloc(sizeof(http_cache_entry_t) + len);
+  hce->hce_key = hc->hc_cache_key;
+  hce->hce_size = size;
+  hce->hce_len = len;
+  hce->hce_revalidating = 0;
+  hce->hce_status = hc->hc_status;
+  snprintf(hce->hce_etag, sizeof(hce->hce_etag), "%s",
+           hc->hc_etag ?
+           http_arg_get(&hc->hc_response_headers, "ETag") ?: "" : "");
+  hce->hce_age_at = hdrs->hq_size - 2;
+  hce->hce_stored = get_ts();
+  hce->hce_expire = hce->hce_stored + hrc->hrc_ttl;
+  hce->hce_stale = hce->hce_expire + hrc->hrc_stale;
+  htsbuf_peek(hdrs, hce->hce_data, hdrs->hq_size);
+  htsbuf_peek(body, hce->hce_data + hdrs->hq_size, body->hq_size);
+  hc->hc_cache_key = NULL;
+
+  hash = http_arg_hash(hce->hce_key) % HTTP_CACHE_HASH_SIZE;
+
+  pthread_mutex_lock(&http_cache_mutex);
+  if((old = http_cache_find(hce->hce_key, hash)) != NULL)
+    http_cache_unlink(old);
+
+  LIST_INSERT_HEAD(&http_cache_hash[hash], hce, hce_hash_link);
+  TAILQ_INSERT_HEAD(&http_cache_lru, hce, hce_lru_link);
+  http_cache_used += size;
+
+  while(http_cache_used > budget)
+    http_cache_unlink(TAILQ_LAST(&http_cache_lru, http_cache_entry_queue));
+  pthread_mutex_unlock(&http_cache_mutex);
+}
+
+
+/**
+ * The request picked to fill the cache didn't produce a cacheable
+ * reply, let the next one try
+ */
+static void
+http_cache_abandon(http_connection_t *hc)
+{
+  unsigned int hash = http_arg_hash(hc->hc_cache_key) % HTTP_CACHE_HASH_SIZE;
+  http_cache_entry_t *hce;
+
+  pthread_mutex_lock(&http_cache_mutex);
+  if((hce = http_cache_find(hc->hc_cache_key, hash)) != NULL)
+    hce->hce_revalidating = 0;
+  pthread_mutex_unlock(&http_cache_mutex);
+
+  free(hc->hc_cache_key);
+  hc->hc_cache_key = NULL;
+}
+
+
+/**
+ * Request coalescing
+ *
+ * Concurrent identical GETs to a HTTP_ROUTE_COALESCE route wait for the
+ * first one (the leader) to run the callback and get a copy of its
+ * reply. The key is the cache key if the route is cached, else the
+ * path, all query args, HTTP version and the negotiated content coding.
+ * Only 200 replies are shared. If the leader produces something else,
+ * or hasn't finished within http.coalesceTimeout seconds of the
+ * waiter's request start, the waiter runs the callback itself
+ */
+
+typedef struct http_flight {
+  LIST_ENTRY(http_flight) hf_link;
+  char *hf_key;
+  int hf_refcount;
+  int hf_done;
+  pthread_cond_t hf_cond;
+  uint8_t *hf_data;  // Header and body, NULL if nothing to share
+  size_t hf_len;
+} http_flight_t;
+
+static pthread_mutex_t http_flight_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, http_flight) http_flights[HTTP_CACHE_HASH_SIZE];
+
+
+/**
+ * Must be called with http_flight_mutex held
+ */
+static void
+http_flight_release(http_flight_t *hf)
+{
+  if(--hf->hf_refcount > 0)
+    return;
+  pthread_cond_destroy(&hf->hf_cond);
+  free(hf->hf_data);
+  free(hf->hf_key);
+  free(hf);
+}
+
+
+/**
+ *
+ */
+static char *
+http_flight_key(http_connection_t *hc)
+{
+  htsbuf_queue_t q;
+  http_arg_t *ra;
+
+  if(hc->hc_cache_key != NULL)
+    return strdup(hc->hc_cache_key);
+
+  htsbuf_queue_init(&q, 0);
+  htsbuf_append_str(&q, hc->hc_path);
+  HTTP_ARG_FOREACH(ra, &hc->hc_req_args)
+    http_cache_key_append(&q, ra->key, ra->val);
+  htsbuf_qprintf(&q, "\n%d %d", hc->hc_version, http_negotiate_encoding(hc));
+  return htsbuf_to_string(&q);
+}
+
+
+/**
+ * Returns 1 if the reply was queued from another request. Otherwise
+ * this request may have become the leader, in which case hc_flight
+ * is set
+ */
+static int
+http_flight_join(http_connection_t *hc)
+{
+  const int64_t deadline =
+    hc->hc_t_start + http_config()->coalesce_timeout * 1000000LL;
+  const struct timespec ts = {
+    .tv_sec = deadline / 1000000,
+    .tv_nsec = (deadline % 1000000) * 1000
+  };
+  http_flight_t *hf;
+  unsigned int hash;
+  char *key;
+  int r = 0;
+
+  if(hc->hc_cmd != HTTP_CMD_GET || hc->hc_h2 != NULL || !hc->hc_keep_alive)
+    return 0;
+
+  // The key doesn't say who is asking, so requests with credentials
+  // always run the callback themselves
+  if(hc->hc_username != NULL ||
+     http_header_get(hc, HTTP_HDR_AUTHORIZATION) != NULL ||
+     http_arg_get(&hc->hc_args, "Cookie") != NULL)
+    return 0;
+
+  key = http_flight_key(hc);
+  hash = http_arg_hash(key) % HTTP_CACHE_HASH_SIZE;
+
+  pthread_mutex_lock(&http_flight_mutex);
+
+  LIST_FOREACH(hf, &http_flights[hash], hf_link)
+    if(!strcmp(hf->hf_key, key))
+      break;
+
+  if(hf == NULL) {
+    hf = calloc(1, sizeof(http_flight_t));
+    hf->hf_key = key;
+    hf->hf_refcount = 1;
+    pthread_cond_init(&hf->hf_cond, NULL);
+    LIST_INSERT_HEAD(&http_flights[hash], hf, hf_link);
+    pthread_mutex_unlock(&http_flight_mutex);
+    hc->hc_flight = hf;
+    return 0;
+  }
+
+  free(key);
+  hf->hf_refcount++;
+  // Condition variables wait on CLOCK_REALTIME, same as get_ts()
+  while(!hf->hf_done &&
+        pthread_cond_timedwait(&hf->hf_cond, &http_flight_mutex,
+                               &ts) != ETIMEDOUT) {}
+
+  if(hf->hf_done && hf->hf_data != NULL) {
+    htsbuf_append(&hc->hc_output, hf->hf_data, hf->hf_len);
+    hc->hc_status = HTTP_STATUS_OK;
+    r = 1;
+  }
+  http_flight_release(hf);
+  pthread_mutex_unlock(&http_flight_mutex);
+  return r;
+}
+
+
+/**
+ * Wake up the waiters, hdrs and body of a 200 reply are copied to them
+ * if given. Called by the leader as soon as the reply is known
+ */
+static void
+http_flight_complete(http_connection_t *hc, htsbuf_queue_t *hdrs,
+                     htsbuf_queue_t *body)
+{
+  http_flight_t *hf = hc->hc_flight;
+  uint8_t *data = NULL;
+  size_t len = 0;
+
+  if(hdrs != NULL) {
+    len = hdrs->hq_size + body->hq_size;
+    data = malloc(len);
+    htsbuf_peek(hdrs, data, hdrs->hq_size);
+    htsbuf_peek(body, data + hdrs->hq_size, body->hq_size);
+  }
+
+  pthread_mutex_lock(&http_flight_mutex);
+  LIST_REMOVE(hf, hf_link);
+  hf->hf_data = data;
+  hf->hf_len = len;
+  hf->hf_done = 1;
+  pthread_cond_broadcast(&hf->hf_cond);
+  http_flight_release(hf);
+  pthread_mutex_unlock(&http_flight_mutex);
+
+  hc->hc_flight = NULL;
+}
+
+
+/**
+ * Transmit a HTTP reply
+ */
+static int
+http_send_reply(http_connection_t *hc, int rc, const char *content, 
+		const char *encoding, const char *location, int maxage)
+{
+  htsbuf_queue_t hdrs;
+  int not_modified = 0;
+
+  if(hc->hc_etag && rc == HTTP_STATUS_OK) {
+    char etag[20];
+    http_reply_etag(&hc->hc_reply, etag, sizeof(etag));
+    http_arg_set(&hc->hc_response_headers, "ETag", etag);
+    not_modified = http_etag_match(hc, etag);
+  }
+
+  if((hc->hc_cache_key != NULL && rc == HTTP_STATUS_OK) ||
+     hc->hc_flight != NULL) {
+    htsbuf_queue_init(&hdrs, 0);
+    http_format_header(hc, &hdrs, rc, content, hc->hc_reply.hq_size,
+                       encoding, location, maxage, NULL, NULL, NULL);
+    if(hc->hc_keep_alive) {
+      if(hc->hc_cache_key != NULL && rc == HTTP_STATUS_OK)
+        http_cache_store(hc, &hdrs, &hc->hc_reply);
+      if(hc->hc_flight != NULL)
+        http_flight_complete(hc, rc == HTTP_STATUS_OK ? &hdrs : NULL,
+                             &hc->hc_reply);
+    }
+    if(!not_modified) {
+      htsbuf_appendq(&hc->hc_output, &hdrs);
+      return http_output_queue(hc, &hc->hc_reply);
+    }
+    htsbuf_queue_flush(&hdrs);
+  }
+
+  if(not_modified) {
+    htsbuf_queue_flush(&hc->hc_reply);
+    return http_send_header(hc, HTTP_STATUS_NOT_MODIFIED, NULL, 0,
+                            NULL, NULL, 0, NULL, NULL, NULL);
+  }
+
+  if(http_send_header(hc, rc, content, hc->hc_reply.hq_size,
+                      encoding, location, maxage, 0, NULL, NULL))
+    return -1;
+
+  if(hc->hc_no_output)
+    return 0;
+
+  return http_output_queue(hc, &hc->hc_reply);
+}
+
+
+/**
+ * Send HTTP error back
+ */
+int
+http_err(http_connection_t *hc, int error, const char *str)
+{
+  const char *errtxt = http_rc2str(error);
+  htsbuf_queue_flush(&hc->hc_reply);
+
+  htsbuf_qprintf(&hc->hc_reply, 
+		 "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
+		 "<HTML><HEAD>\r\n"
+		 "<TITLE>%d %s</TITLE>\r\n"
+		 "</HEAD><BODY>\r\n"
+		 "<H1>%d %s</H1>\r\n",
+		 error, errtxt, error, errtxt);
+
+  if(str != NULL)
+    htsbuf_qprintf(&hc->hc_reply, "<p>%s</p>\r\n", str);
+
+  htsbuf_qprintf(&hc->hc_reply, "</BODY></HTML>\r\n");
+
+  http_send_reply(hc, error, "text/html", NULL, NULL, 0);
+  return 0;
+}
+
+
+/**
+ * Send HTTP error back
+ */
+void
+http_error(http_connection_t *hc, int error)
+{
+  http_err(hc, error, NULL);
+}
+
+
+/**
+ * Send an HTTP OK, simple version for text/html
+ */
+int
+http_output_html(http_connection_t *hc)
+{
+  const char *content = "text/html; charset=UTF-8";
+  return http_send_reply(hc, HTTP_STATUS_OK, content,
+			 http_compress_reply(hc, content), NULL, 0);
+}
+
+/**
+ * Send an HTTP OK, simple version for text/html
+ */
+int
+http_output_content(http_connection_t *hc, const char *content)
+{
+  return http_send_reply(hc, HTTP_STATUS_OK, content,
+                         http_compress_reply(hc, content), NULL, 0);
+}
+
+
+
+/**
+ * Send an HTTP REDIRECT
+ */
+void
+http_redirect(http_connection_t *hc, const char *location, int status)
+{
+  htsbuf_queue_flush(&hc->hc_reply);
+
+  htsbuf_qprintf(&hc->hc_reply,
 		 "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
 		 "<HTML><HEAD>\r\n"
 		 "<TITLE>Redirect</TITLE>\r\n"
@@ -410,6 +1767,43 @@ http_redirect(http_connection_t *hc, const char *location, int status)
 }
 
 
+/**
+ * Take a slot in the route's class before its handler runs (or its
+ * body is read). Returns 0 or 503 with Retry-After set if the class is
+ * overloaded. The slot is given back by http_qos_release()
+ */
+static int
+http_qos_acquire(http_connection_t *hc, const http_route_t *hr)
+{
+  int class, r;
+
+  if(hr == NULL || hc->hc_qos_class)
+    return 0;
+
+  class = HTTP_ROUTE_CLASS_OF(hr->hr_flags);
+  if((r = http_qos_enter(class)) < 0) {
+    http_arg_set(&hc->hc_response_headers, "Retry-After", "1");
+    return HTTP_STATUS_SERVICE_UNAVAILABLE;
+  }
+  if(r)
+    hc->hc_qos_class = class + 1;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+http_qos_release(http_connection_t *hc)
+{
+  if(hc->hc_qos_class) {
+    http_qos_leave(hc->hc_qos_class - 1);
+    hc->hc_qos_class = 0;
+  }
+}
+
+
 /**
  * Resolve URL and invoke handler
  *
@@ -423,18 +1817,58 @@ http_redirect(http_connection_t *hc, const char *location, int status)
  *
  */
 static int
-http_resolve(http_connection_t *hc)
+http_resolve(http_connection_t *hc, const route_match_t *rm)
 {
+  route_match_t rm0;
   int err;
 
-  err = http_resolve_route(hc, 0);
+  if(rm == NULL) {
+    http_route_find(hc, &rm0);
+    rm = &rm0;
+  }
+
+  if(rm->rm_route != NULL) {
+    hc->hc_metrics_id = rm->rm_route->hr_metrics_id;
+    hc->hc_etag = rm->rm_route->hr_flags & HTTP_ROUTE_ETAG &&
+      (hc->hc_cmd == HTTP_CMD_GET || hc->hc_cmd == HTTP_CMD_HEAD);
+  }
 
-  if(err == 404)
+  if(rm->rm_route == NULL)
+    err = http_resolve_path(hc);
+  else if(rm->rm_route->hr_cache != NULL &&
+          http_cache_serve(hc, rm->rm_route->hr_cache))
+    err = http_output_check(hc);
+  else if(rm->rm_route->hr_flags & HTTP_ROUTE_COALESCE &&
+          http_flight_join(hc))
+    err = http_output_check(hc);
+  else if((err = http_qos_acquire(hc, rm->rm_route)) == 0)
+    err = http_route_invoke(hc, rm, 0);
+
+  http_qos_release(hc);
+
+  if(hc->hc_flight != NULL)
+    http_flight_complete(hc, NULL, NULL);
+
+  if(hc->hc_cache_key != NULL)
+    http_cache_abandon(hc);
+
+  // A route that doesn't know the path leaves it to http_path_add()
+  // handlers, unless it already started a reply
+  if(err == 404 && rm->rm_route != NULL && hc->hc_status == 0 &&
+     hc->hc_streaming == HTTP_STREAM_NONE) {
+    htsbuf_queue_flush(&hc->hc_reply);
     err = http_resolve_path(hc);
+  }
 
   if(err == HTTP_ERROR_DISCONNECT)
     return 1;
 
+  if(hc->hc_streaming != HTTP_STREAM_NONE) {
+    // Handler left a stream unterminated, framing is lost
+    hc->hc_streaming = HTTP_STREAM_NONE;
+    return 1;
+  }
+
   if(err)
     http_error(hc, err);
   return 0;
@@ -444,84 +1878,409 @@ http_resolve(http_connection_t *hc)
 
 
 
+/**
+ * Check the route's rate limit, or the server wide one. Returns
+ * non-zero if the request is over it, Retry-After is then set and the
+ * caller replies with 429
+ */
+static int
+http_ratelimited(http_connection_t *hc, const http_route_t *hr)
+{
+  const http_ratelimit_t *rl = http_ratelimit_default();
+  const void *scope = NULL;
+  char buf[16];
+  int wait;
+
+  if(hr != NULL && hr->hr_ratelimit.rate >= 0) {
+    rl = &hr->hr_ratelimit;
+    scope = hr;
+  } else if(rl->key == HTTP_RATELIMIT_ROUTE) {
+    scope = hr;
+  }
+
+  if((wait = http_ratelimit_check(hc, scope, rl)) == 0)
+    return 0;
+
+  snprintf(buf, sizeof(buf), "%d", wait);
+  http_arg_set(&hc->hc_response_headers, "Retry-After", buf);
+  return 1;
+}
+
+
+/**
+ * Read request body. Whatever already arrived together with the
+ * header is taken from the receive buffer first
+ */
+static int
+http_read_body(http_connection_t *hc, char *buf, size_t len)
+{
+  size_t n = MIN(len, hc->hc_rbuf_len - hc->hc_rbuf_used);
+  int r;
+
+  memcpy(buf, hc->hc_rbuf + hc->hc_rbuf_used, n);
+  hc->hc_rbuf_used += n;
+  hc->hc_body_remain -= len;
+
+  if(n == len)
+    return 0;
+
+  if(hc->hc_h2 != NULL) {
+    for(; n < len; n += r)
+      if((r = http2_body_read(hc, buf + n, len - n)) <= 0)
+        return -1;
+    return 0;
+  }
+
+  if(http_output_flush(hc))
+    return -1;
+  if(tcp_read_data(hc->hc_ts, buf + n, len - n)) {
+    if(errno == ETIMEDOUT)
+      http_metrics_timeout(HTTP_TIMEOUT_BODY);
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * Read the next part of the request body, for HTTP_ROUTE_STREAM_BODY
+ * routes. Returns number of bytes read, 0 at end of body and -1 if
+ * the connection failed
+ */
+int
+http_body_read(http_connection_t *hc, void *buf, size_t len)
+{
+  size_t n;
+  int r;
+
+  len = MIN(len, hc->hc_body_remain);
+  if(len == 0)
+    return 0;
+
+  n = MIN(len, hc->hc_rbuf_len - hc->hc_rbuf_used);
+  if(n > 0) {
+    memcpy(buf, hc->hc_rbuf + hc->hc_rbuf_used, n);
+    hc->hc_rbuf_used += n;
+    hc->hc_body_remain -= n;
+    return n;
+  }
+
+  if(hc->hc_h2 != NULL) {
+    if((r = http2_body_read(hc, buf, len)) <= 0)
+      return -1;
+    hc->hc_body_remain -= r;
+    return r;
+  }
+
+  if(http_output_flush(hc)) {
+    hc->hc_keep_alive = 0;
+    return -1;
+  }
+
+  r = tcp_read(hc->hc_ts, buf, MIN(len, INT_MAX));
+  if(r <= 0) {
+    if(r < 0 && errno == ETIMEDOUT)
+      http_metrics_timeout(HTTP_TIMEOUT_BODY);
+    hc->hc_keep_alive = 0;
+    return -1;
+  }
+  hc->hc_body_remain -= r;
+  return r;
+}
+
+
+/**
+ * Fail a request before its body has been read. Unless the body is
+ * empty it can't be skipped, so the connection must be closed
+ */
+static int
+http_body_reject(http_connection_t *hc, int err)
+{
+  if(hc->hc_body_remain)
+    hc->hc_keep_alive = 0;
+  http_error(hc, err);
+  return 0;
+}
+
+
+/**
+ * Returns the body if the request carries a JSON document in memory
+ */
+static const char *
+http_post_json_src(http_connection_t *hc)
+{
+  if(hc->hc_post_data == NULL || hc->hc_content_type == NULL ||
+     strcmp(hc->hc_content_type, "application/json"))
+    return NULL;
+  return hc->hc_post_data;
+}
+
+
+/**
+ *
+ */
+htsmsg_t *
+http_post_json(http_connection_t *hc)
+{
+  const char *src;
+  char errbuf[256];
+
+  if(hc->hc_post_json_parsed)
+    return hc->hc_post_json;
+  hc->hc_post_json_parsed = 1;
+
+  if((src = http_post_json_src(hc)) == NULL)
+    return NULL;
+
+  hc->hc_post_json = htsmsg_json_deserialize(src, errbuf, sizeof(errbuf));
+  if(hc->hc_post_json == NULL && http_config()->trace)
+    trace(LOG_DEBUG, "HTTP: %s: Bad JSON body -- %s", hc->hc_path, errbuf);
+  return hc->hc_post_json;
+}
+
+
+/**
+ *
+ */
+const char *
+http_post_json_str(http_connection_t *hc, const char *path)
+{
+  const char *src = http_post_json_src(hc);
+  char *s, *r;
+
+  if(src == NULL || (s = json_get_str(src, path)) == NULL)
+    return NULL;
+  r = arena_strdup(&hc->hc_arena, s);
+  free(s);
+  return r;
+}
+
+
+/**
+ *
+ */
+int64_t
+http_post_json_int(http_connection_t *hc, const char *path, int64_t def)
+{
+  const char *src = http_post_json_src(hc);
+  int64_t v;
+
+  if(src == NULL || json_get_int64(src, path, &v))
+    return def;
+  return v;
+}
+
+
+/**
+ * Discard whatever a streaming handler left unread. Small leftovers
+ * are skipped to keep the connection, otherwise it's closed
+ */
+static int
+http_body_drain(http_connection_t *hc)
+{
+  char buf[4096];
+
+  if(hc->hc_body_remain > HTTP_BODY_DRAIN_MAX) {
+    hc->hc_keep_alive = 0;
+    return 0;
+  }
+
+  while(hc->hc_body_remain > 0)
+    if(http_body_read(hc, buf, sizeof(buf)) < 0)
+      return 1;
+  return 0;
+}
+
+
+/**
+ * Spool the request body to an unlinked temporary file
+ */
+static int
+http_body_spill(http_connection_t *hc, const char *tmpdir)
+{
+  char path[PATH_MAX];
+  const size_t bufsize = 65536;
+  char *buf;
+  int fd, r, err = 0;
+
+  snprintf(path, sizeof(path), "%s/httpbodyXXXXXX", tmpdir);
+  if((fd = mkstemp(path)) == -1) {
+    trace(LOG_ERR, "HTTP: Unable to create %s -- %s", path, strerror(errno));
+    return HTTP_STATUS_ISE;
+  }
+  unlink(path);
+
+  buf = malloc(bufsize);
+
+  while(err == 0 && (r = http_body_read(hc, buf, bufsize)) != 0) {
+    if(r < 0) {
+      err = HTTP_ERROR_DISCONNECT;
+      break;
+    }
+    for(int off = 0; off < r; ) {
+      ssize_t w = write(fd, buf + off, r - off);
+      if(w < 0) {
+        if(errno == EINTR)
+          continue;
+        trace(LOG_ERR, "HTTP: Unable to spool request body -- %s",
+              strerror(errno));
+        err = HTTP_STATUS_ISE;
+        break;
+      }
+      off += w;
+    }
+  }
+  free(buf);
+
+  if(err) {
+    close(fd);
+    return err;
+  }
+
+  lseek(fd, 0, SEEK_SET);
+  hc->hc_post_fd = fd;
+  return 0;
+}
+
+
+/**
+ * The body must arrive within http.bodyTimeout plus the time it takes
+ * at http.bodyMinRate. Reset when the next request header is read
+ */
+static void
+http_body_deadline(http_connection_t *hc, const http_config_t *conf)
+{
+  int64_t usec;
+
+  if(hc->hc_ts == NULL || conf->body_timeout == 0)
+    return;
+
+  usec = conf->body_timeout * 1000000LL;
+  if(conf->body_min_rate > 0)
+    usec += hc->hc_body_remain * 1000000 / conf->body_min_rate;
+  tcp_set_read_deadline(hc->hc_ts, get_ts() + usec);
+}
+
+
 /**
  * Initial processing of HTTP POST
  *
+ * The route is resolved before the body is read so its size limit and
+ * body flags can be applied
+ *
  * Return non-zero if we should disconnect
  */
 static int
 http_cmd_post(http_connection_t *hc)
 {
-  char *v, *argv[2];
-  int n;
+  const http_config_t *conf = http_config();
+  route_match_t rm;
+  http_route_t *hr;
+  const char *v;
+  char *argv[2], *end;
+  int64_t max_body;
+  int n, err, flags;
 
-  v = http_arg_get(&hc->hc_args, "Content-Length");
+  v = http_header_get(hc, HTTP_HDR_CONTENT_LENGTH);
   if(v == NULL) {
     /* No content length in POST, make us disconnect */
     return HTTP_ERROR_DISCONNECT;
   }
-  hc->hc_post_len = atoi(v);
 
-  v = http_arg_get(&hc->hc_args, "Expect");
+  hc->hc_post_len = strtoll(v, &end, 10);
+  if(end == v || *end || hc->hc_post_len < 0) {
+    hc->hc_keep_alive = 0;
+    http_error(hc, HTTP_STATUS_BAD_REQUEST);
+    return 0;
+  }
+  hc->hc_body_remain = hc->hc_post_len;
+
+  hr = http_route_find(hc, &rm);
+
+  if(http_ratelimited(hc, hr))
+    return http_body_reject(hc, HTTP_STATUS_TOO_MANY_REQUESTS);
+
+  // Overloaded classes turn requests away before the body is read
+  if((err = http_qos_acquire(hc, hr)) != 0)
+    return http_body_reject(hc, err);
+
+  flags = hr != NULL ? hr->hr_flags : 0;
+  max_body = hr != NULL && hr->hr_max_body >= 0 ?
+    hr->hr_max_body : conf->max_body_size;
+
+  if(hc->hc_post_len > max_body)
+    return http_body_reject(hc, HTTP_STATUS_PAYLOAD_TOO_LARGE);
+
+  v = http_header_get(hc, HTTP_HDR_EXPECT);
   if(v != NULL && !strcasecmp(v, "100-continue")) {
-    int err = http_resolve_route(hc, 1);
+    err = hr != NULL ? http_route_invoke(hc, &rm, 1) : 100;
 
     if(err == 100) {
 
       if(http_send_100_continue(hc))
         return 1;
 
+    } else if(err == HTTP_ERROR_DISCONNECT) {
+      return 1;
     } else if(err != 0) {
-      http_error(hc, err);
-      return 0;
+      return http_body_reject(hc, err);
     }
   }
 
+  /* Parse content-type */
+  v = http_header_get(hc, HTTP_HDR_CONTENT_TYPE);
+  if(v == NULL)
+    return http_body_reject(hc, HTTP_STATUS_BAD_REQUEST);
 
-  if(hc->hc_post_len > 1024 * 1024 * 1024) {
-    /* Bail out if POST data > 1 GB */
-    hc->hc_keep_alive = 0;
-    return HTTP_ERROR_DISCONNECT;
+  char *ct = mystrdupa(v);
+  n = str_tokenize(ct, argv, 2, ';');
+  if(n == 0)
+    return http_body_reject(hc, HTTP_STATUS_BAD_REQUEST);
+
+  hc->hc_content_type = argv[0];
+
+  http_body_deadline(hc, conf);
+
+  if(flags & HTTP_ROUTE_STREAM_BODY) {
+    if(http_resolve(hc, &rm))
+      return 1;
+    return http_body_drain(hc);
+  }
+
+  if(flags & HTTP_ROUTE_SPILL_BODY && hc->hc_post_len > conf->body_spill_size) {
+    err = http_body_spill(hc, conf->tmp_dir);
+    if(err == HTTP_ERROR_DISCONNECT)
+      return 1;
+    if(err)
+      return http_body_reject(hc, err);
+    return http_resolve(hc, &rm);
   }
 
   /* Allocate space for data, we add a terminating null char to ease
      string processing on the content */
 
   hc->hc_post_data = malloc(hc->hc_post_len + 1);
+  if(hc->hc_post_data == NULL)
+    return http_body_reject(hc, HTTP_STATUS_PAYLOAD_TOO_LARGE);
   hc->hc_post_data[hc->hc_post_len] = 0;
 
-  if(tcp_read_data(hc->hc_ts, hc->hc_post_data, hc->hc_post_len) < 0)
+  if(http_read_body(hc, hc->hc_post_data, hc->hc_post_len) < 0)
     return HTTP_ERROR_DISCONNECT;
 
-  /* Parse content-type */
-  v = http_arg_get(&hc->hc_args, "Content-Type");
-  if(v == NULL) {
-    http_error(hc, HTTP_STATUS_BAD_REQUEST);
-    return 0;
-  }
-  v = mystrdupa(v);
-  n = str_tokenize(v, argv, 2, ';');
-  if(n == 0) {
-    http_error(hc, HTTP_STATUS_BAD_REQUEST);
-    return 0;
-  }
-
-  hc->hc_content_type = argv[0];
-
   if(!strcmp(argv[0], "application/x-www-form-urlencoded"))
     http_parse_query_args(hc, hc->hc_post_data);
 
-  assert(hc->hc_post_message == NULL);
-  if(!strcmp(argv[0], "application/json")) {
-    char errbuf[256];
-    hc->hc_post_message = htsmsg_json_deserialize(hc->hc_post_data,
-                                                  errbuf, sizeof(errbuf));
-
-    if(hc->hc_post_message == NULL)
-      return 400;
+  // JSON is only checked here, the tree is built on demand by
+  // http_post_json()
+  if(!strcmp(argv[0], "application/json")) {
+    const char *s = hc->hc_post_data + strspn(hc->hc_post_data, " \t\r\n");
+    if((*s != '{' && *s != '[') || json_skip_value(s) == NULL) {
+      http_error(hc, HTTP_STATUS_BAD_REQUEST);
+      return 0;
+    }
   }
 
-  return http_resolve(hc);
+  return http_resolve(hc, &rm);
 }
 
 
@@ -531,6 +2290,8 @@ http_cmd_post(http_connection_t *hc)
 static int
 http_process_request(http_connection_t *hc)
 {
+  route_match_t rm;
+
   // Split of query args
 
   char *args = strchr(hc->hc_path, '?');
@@ -544,12 +2305,16 @@ http_process_request(http_connection_t *hc)
   default:
     http_error(hc, HTTP_STATUS_BAD_REQUEST);
     return 0;
-  case HTTP_CMD_GET:
-  case HTTP_CMD_DELETE:
-    return http_resolve(hc);
   case HTTP_CMD_HEAD:
     hc->hc_no_output = 1;
-    return http_resolve(hc);
+    // FALLTHRU
+  case HTTP_CMD_GET:
+  case HTTP_CMD_DELETE:
+    if(http_ratelimited(hc, http_route_find(hc, &rm))) {
+      http_error(hc, HTTP_STATUS_TOO_MANY_REQUESTS);
+      return 0;
+    }
+    return http_resolve(hc, &rm);
   case HTTP_CMD_POST:
   case HTTP_CMD_PUT:
     return http_cmd_post(hc);
@@ -563,17 +2328,29 @@ http_process_request(http_connection_t *hc)
 static int
 process_request(http_connection_t *hc)
 {
-  char *v, *argv[2];
+  const char *v;
+  char *argv[2];
   int n, rval = -1;
   uint8_t authbuf[150];
   
-  hc->hc_path_orig = strdup(hc->hc_path);
+  hc->hc_path_orig = arena_strdup(&hc->hc_arena, hc->hc_path);
+
+  if(hc->hc_h2 == NULL) {
+    // "PRI * HTTP/2.0" opens the preface of a prior knowledge client
+    if(hc->hc_version == HTTP_VERSION_2)
+      return hc->hc_cmd == HTTP_CMD_PRI && !strcmp(hc->hc_path, "*") ?
+        http2_serve(hc, 0) : 1;
+
+    if(hc->hc_version == HTTP_VERSION_1_1 && http2_upgrade_ok(hc))
+      return http2_serve(hc, 1);
+  }
 
   /* Set keep-alive status */
-  v = http_arg_get(&hc->hc_args, "connection");
+  v = http_header_get(hc, HTTP_HDR_CONNECTION);
 
   switch(hc->hc_version) {
   case RTSP_VERSION_1_0:
+  case HTTP_VERSION_2:
     hc->hc_keep_alive = 1;
     break;
 
@@ -589,29 +2366,27 @@ process_request(http_connection_t *hc)
   }
 
   /* Extract authorization */
-  if((v = http_arg_get(&hc->hc_args, "Authorization")) != NULL) {
-    v = mystrdupa(v);
-    if((n = str_tokenize(v, argv, 2, -1)) == 2) {
+  if((v = http_header_get(hc, HTTP_HDR_AUTHORIZATION)) != NULL) {
+    char *a = mystrdupa(v);
+    if((n = str_tokenize(a, argv, 2, -1)) == 2) {
 
       if(!strcasecmp(argv[0], "basic")) {
         n = base64_decode(authbuf, argv[1], sizeof(authbuf) - 1);
         authbuf[n] = 0;
         if((n = str_tokenize((char *)authbuf, argv, 2, ':')) == 2) {
-          hc->hc_username = strdup(argv[0]);
-          hc->hc_password = strdup(argv[1]);
+          hc->hc_username = arena_strdup(&hc->hc_arena, argv[0]);
+          hc->hc_password = arena_strdup(&hc->hc_arena, argv[1]);
         }
       }
     }
   }
 
   if(hc->hc_username != NULL) {
-    hc->hc_representative = strdup(hc->hc_username);
+    hc->hc_representative = hc->hc_username;
   } else {
-    hc->hc_representative = malloc(30);
-    /* Not threadsafe ? */
-    snprintf(hc->hc_representative, 30,
-	     "%s", inet_ntoa(hc->hc_peer->sin_addr));
-
+    hc->hc_representative = arena_alloc(&hc->hc_arena, INET_ADDRSTRLEN);
+    inet_ntop(AF_INET, &hc->hc_peer->sin_addr, hc->hc_representative,
+              INET_ADDRSTRLEN);
   }
 
   switch(hc->hc_version) {
@@ -620,17 +2395,28 @@ process_request(http_connection_t *hc)
 
   case HTTP_VERSION_1_0:
   case HTTP_VERSION_1_1:
+  case HTTP_VERSION_2:
     rval = http_process_request(hc);
     break;
   }
-  free(hc->hc_representative);
-  free(hc->hc_path_orig);
   return rval;
 }
 
 
 
 
+/**
+ *
+ */
+void
+http_arg_list_init(struct http_arg_list *list, arena_t *arena)
+{
+  TAILQ_INIT(&list->hal_args);
+  list->hal_arena = arena;
+  memset(list->hal_hash, 0, sizeof(list->hal_hash));
+}
+
+
 /*
  * Delete all arguments associated with a connection
  */
@@ -638,12 +2424,65 @@ void
 http_arg_flush(struct http_arg_list *list)
 {
   http_arg_t *ra;
-  while((ra = TAILQ_FIRST(list)) != NULL) {
-    TAILQ_REMOVE(list, ra, link);
-    free(ra->key);
-    free(ra->val);
-    free(ra);
+
+  if(list->hal_arena == NULL) {
+    while((ra = TAILQ_FIRST(&list->hal_args)) != NULL) {
+      TAILQ_REMOVE(&list->hal_args, ra, link);
+      free(ra->key);
+      free(ra->val);
+      free(ra);
+    }
+  }
+  http_arg_list_init(list, list->hal_arena);
+}
+
+
+/**
+ * Case insensitive FNV-1a, good enough for telling header names apart
+ */
+static unsigned int
+http_arg_hash(const char *s)
+{
+  unsigned int h = 2166136261U;
+  while(*s) {
+    h ^= *s++ | 0x20;
+    h *= 16777619;
+  }
+  return h;
+}
+
+
+/**
+ *
+ */
+static http_arg_t *
+http_arg_find(struct http_arg_list *list, const char *name, unsigned int hash)
+{
+  http_arg_t *ra;
+  for(ra = list->hal_hash[hash & (HTTP_ARG_HASH_SIZE - 1)]; ra != NULL;
+      ra = ra->hash_next)
+    if(ra->hash == hash && !strcasecmp(ra->key, name))
+      return ra;
+  return NULL;
+}
+
+
+/**
+ * Link an argument into list. Only the first entry for a key is hashed
+ * so lookups keep returning the first one, as they always have
+ */
+static void
+http_arg_insert(struct http_arg_list *list, http_arg_t *ra)
+{
+  ra->hash = http_arg_hash(ra->key);
+  TAILQ_INSERT_TAIL(&list->hal_args, ra, link);
+  if(http_arg_find(list, ra->key, ra->hash) != NULL) {
+    ra->hash_next = NULL;
+    return;
   }
+  http_arg_t **p = &list->hal_hash[ra->hash & (HTTP_ARG_HASH_SIZE - 1)];
+  ra->hash_next = *p;
+  *p = ra;
 }
 
 
@@ -653,11 +2492,8 @@ http_arg_flush(struct http_arg_list *list)
 char *
 http_arg_get(struct http_arg_list *list, const char *name)
 {
-  http_arg_t *ra;
-  TAILQ_FOREACH(ra, list, link)
-    if(!strcasecmp(ra->key, name))
-      return ra->val;
-  return NULL;
+  http_arg_t *ra = http_arg_find(list, name, http_arg_hash(name));
+  return ra ? ra->val : NULL;
 }
 
 
@@ -682,10 +2518,30 @@ http_arg_set(struct http_arg_list *list, const char *key,
 {
   http_arg_t *ra;
 
-  ra = malloc(sizeof(http_arg_t));
-  TAILQ_INSERT_TAIL(list, ra, link);
-  ra->key = strdup(key);
-  ra->val = strdup(val);
+  if(list->hal_arena != NULL) {
+    ra = arena_alloc(list->hal_arena, sizeof(http_arg_t));
+    ra->key = arena_strdup(list->hal_arena, key);
+    ra->val = arena_strdup(list->hal_arena, val);
+  } else {
+    ra = malloc(sizeof(http_arg_t));
+    ra->key = strdup(key);
+    ra->val = strdup(val);
+  }
+  http_arg_insert(list, ra);
+}
+
+
+/**
+ * Add an argument without copying key and value, they must stay valid
+ * for the lifetime of the request. Only for arena backed lists
+ */
+static void
+http_arg_set_ref(struct http_arg_list *list, char *key, char *val)
+{
+  http_arg_t *ra = arena_alloc(list->hal_arena, sizeof(http_arg_t));
+  ra->key = key;
+  ra->val = val;
+  http_arg_insert(list, ra);
 }
 
 
@@ -697,15 +2553,233 @@ static int route_cmp(const http_route_t *a, const http_route_t *b)
   return a->hr_depth - b->hr_depth;
 }
 
+/**
+ *
+ */
+static route_node_t *
+route_node_create(void)
+{
+  route_node_t *rn = calloc(1, sizeof(route_node_t));
+  rn->rn_min_prio = INT_MAX;
+  return rn;
+}
+
+
+/**
+ * Descend along a literal, splitting edges as needed
+ */
+static route_node_t *
+route_node_literal(route_node_t *rn, const char *s, int len)
+{
+  route_node_t *c, *n;
+  int i;
+
+  while(len > 0) {
+    LIST_FOREACH(c, &rn->rn_literals, rn_link)
+      if(c->rn_label[0] == s[0])
+        break;
+
+    if(c == NULL) {
+      c = route_node_create();
+      c->rn_label = strndup(s, len);
+      c->rn_label_len = len;
+      LIST_INSERT_HEAD(&rn->rn_literals, c, rn_link);
+      return c;
+    }
+
+    for(i = 1; i < len && i < c->rn_label_len; i++)
+      if(c->rn_label[i] != s[i])
+        break;
+
+    if(i < c->rn_label_len) {
+      n = route_node_create();
+      n->rn_label = strndup(c->rn_label, i);
+      n->rn_label_len = i;
+      LIST_REMOVE(c, rn_link);
+      LIST_INSERT_HEAD(&rn->rn_literals, n, rn_link);
+
+      c->rn_label_len -= i;
+      memmove(c->rn_label, c->rn_label + i, c->rn_label_len + 1);
+      LIST_INSERT_HEAD(&n->rn_literals, c, rn_link);
+      c = n;
+    }
+    rn = c;
+    s += i;
+    len -= i;
+  }
+  return rn;
+}
+
+
+/**
+ *
+ */
+static route_node_t *
+route_node_param(route_node_t *rn, int type, int nonempty)
+{
+  route_node_t *c;
+
+  LIST_FOREACH(c, &rn->rn_params, rn_link)
+    if(c->rn_param == type && c->rn_param_nonempty == nonempty)
+      return c;
+
+  c = route_node_create();
+  c->rn_param = type;
+  c->rn_param_nonempty = nonempty;
+  LIST_INSERT_HEAD(&rn->rn_params, c, rn_link);
+  return c;
+}
+
+
+static const struct {
+  const char *str;
+  int type;
+  int nonempty;
+} route_params[] = {
+  { "([^/]*)",  ROUTE_PARAM_SEGMENT, 0 },
+  { "([^/]+)",  ROUTE_PARAM_SEGMENT, 1 },
+  { "([0-9]*)", ROUTE_PARAM_INTEGER, 0 },
+  { "([0-9]+)", ROUTE_PARAM_INTEGER, 1 },
+  { "(.*)",     ROUTE_PARAM_REST,    0 },
+  { "(.+)",     ROUTE_PARAM_REST,    1 },
+};
+
+
+/**
+ * Insert route into trie. Returns -1 if the pattern uses regex features
+ * that the trie can't express, it's then left to regexec()
+ *
+ * The pattern is validated in full before the trie is touched
+ */
+static int
+route_trie_add(http_route_t *hr, const char *pattern, int do_insert)
+{
+  route_node_t *rn = &route_root;
+  char *lit = alloca(strlen(pattern) + 1);
+  const char *s = pattern;
+  int litlen = 0;
+  int eol = 0;
+
+  while(*s) {
+    if(*s == '(') {
+      int i;
+      for(i = 0; i < sizeof(route_params) / sizeof(route_params[0]); i++)
+        if(mystrbegins(s, route_params[i].str))
+          break;
+      if(i == sizeof(route_params) / sizeof(route_params[0]))
+        return -1;
+      s += strlen(route_params[i].str);
+
+      // Must be followed by something that terminates it unambiguously
+      if(!(*s == 0 || (*s == '$' && s[1] == 0) ||
+           (*s == '/' && route_params[i].type != ROUTE_PARAM_REST)))
+        return -1;
+
+      if(do_insert) {
+        if(litlen > 0)
+          rn = route_node_literal(rn, lit, litlen);
+        rn = route_node_param(rn, route_params[i].type,
+                              route_params[i].nonempty);
+      }
+      litlen = 0;
+      continue;
+    }
+
+    if(*s == '$' && s[1] == 0) {
+      eol = 1;
+      break;
+    }
+
+    if(*s == '\\' && s[1] && !isalnum((unsigned char)s[1])) {
+      lit[litlen++] = s[1];
+      s += 2;
+      continue;
+    }
+
+    if(strchr(".[]()*+?{}|^$\\", *s))
+      return -1;
+
+    lit[litlen++] = tolower((unsigned char)*s);
+    s++;
+  }
+
+  if(!do_insert)
+    return 0;
+
+  if(litlen > 0)
+    rn = route_node_literal(rn, lit, litlen);
+
+  http_route_t **hrp = eol ? &rn->rn_route_eol : &rn->rn_route;
+  // Identical patterns are shadowed by the higher ranked one anyway,
+  // and that's the one registered last at the same depth
+  *hrp = hr;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+route_trie_update_prio(route_node_t *rn)
+{
+  route_node_t *c;
+  int prio = INT_MAX;
+
+  if(rn->rn_route != NULL)
+    prio = MIN(prio, rn->rn_route->hr_prio);
+  if(rn->rn_route_eol != NULL)
+    prio = MIN(prio, rn->rn_route_eol->hr_prio);
+
+  LIST_FOREACH(c, &rn->rn_literals, rn_link)
+    prio = MIN(prio, route_trie_update_prio(c));
+  LIST_FOREACH(c, &rn->rn_params, rn_link)
+    prio = MIN(prio, route_trie_update_prio(c));
+
+  rn->rn_min_prio = prio;
+  return prio;
+}
+
+
+/**
+ * Priority is simply the position in the depth sorted route list,
+ * renumber everything whenever a route is added
+ */
+static void
+route_renumber(void)
+{
+  http_route_t *hr, *prev = NULL;
+  int prio = 0;
+
+  LIST_INIT(&http_regex_routes);
+
+  LIST_FOREACH(hr, &http_routes, hr_link) {
+    hr->hr_prio = prio++;
+    if(hr->hr_compiled)
+      continue;
+    if(prev == NULL)
+      LIST_INSERT_HEAD(&http_regex_routes, hr, hr_regex_link);
+    else
+      LIST_INSERT_AFTER(prev, hr, hr_regex_link);
+    prev = hr;
+  }
+  route_trie_update_prio(&route_root);
+}
+
+
 /**
  * Add a regexp'ed route
  */
-void
+http_route_t *
 http_route_add(const char *path, http_callback2_t *callback, int flags)
 {
   http_route_t *hr = malloc(sizeof(http_route_t));
 
   hr->hr_flags = flags;
+  hr->hr_max_body = -1;
+  hr->hr_cache = NULL;
+  hr->hr_ratelimit.rate = -1;
+  hr->hr_metrics_id = http_metrics_register(path);
   int len = strlen(path);
   hr->hr_depth = 0;
   for(int i = 0; i < len; i++)
@@ -729,6 +2803,58 @@ http_route_add(const char *path, http_callback2_t *callback, int flags)
   hr->hr_path     = strdup(path);
   hr->hr_callback = callback;
   LIST_INSERT_SORTED(&http_routes, hr, hr_link, route_cmp);
+
+  hr->hr_compiled = !route_trie_add(hr, path, 0);
+  if(hr->hr_compiled)
+    route_trie_add(hr, path, 1);
+  route_renumber();
+  return hr;
+}
+
+
+/**
+ * Override http.maxBodySize for requests dispatched to this route
+ */
+void
+http_route_set_max_body(http_route_t *hr, int64_t bytes)
+{
+  hr->hr_max_body = bytes;
+}
+
+
+/**
+ *
+ */
+void
+http_route_set_ratelimit(http_route_t *hr, int rate, int burst, int key)
+{
+  hr->hr_ratelimit.rate = MIN(MAX(rate, 0), 1000000);
+  hr->hr_ratelimit.burst = MAX(burst, 1);
+  hr->hr_ratelimit.key = key;
+}
+
+
+/**
+ *
+ */
+void
+http_route_set_cache(http_route_t *hr, int ttl, int stale,
+                     const char *args, const char *headers)
+{
+  http_route_cache_t *hrc = calloc(1, sizeof(http_route_cache_t));
+
+  hrc->hrc_ttl   = ttl * 1000000LL;
+  hrc->hrc_stale = stale * 1000000LL;
+
+  hrc->hrc_argbuf = strdup(args ?: "");
+  hrc->hrc_num_args = str_tokenize(hrc->hrc_argbuf, hrc->hrc_args,
+                                   HTTP_CACHE_MAX_KEYS, ',');
+
+  hrc->hrc_headerbuf = strdup(headers ?: "");
+  hrc->hrc_num_headers = str_tokenize(hrc->hrc_headerbuf, hrc->hrc_headers,
+                                      HTTP_CACHE_MAX_KEYS, ',');
+
+  hr->hr_cache = hrc;
 }
 
 
@@ -744,7 +2870,11 @@ http_path_add(const char *path, void *opaque, http_callback_t *callback)
   hp->hp_path     = strdup(path);
   hp->hp_opaque   = opaque;
   hp->hp_callback = callback;
+  hp->hp_seq      = ++http_path_seq;
+  hp->hp_metrics_id = http_metrics_register(path);
   LIST_INSERT_HEAD(&http_paths, hp, hp_link);
+
+  route_node_literal(&path_root, path, hp->hp_len)->rn_path = hp;
 }
 
 
@@ -823,103 +2953,273 @@ http_parse_query_args(http_connection_t *hc, char *args)
 
     http_deescape(k);
     http_deescape(v);
-    http_arg_set(&hc->hc_req_args, k, v);
+    http_arg_set_ref(&hc->hc_req_args, k, v);
   }
 }
 
 
 /**
+ * Read and parse a request header into the receive buffer
  *
+ * Returns 0 on success, HTTP_ERROR_DISCONNECT if the connection
+ * went away or a negated HTTP status code if the request is broken
+ */
+static int
+http_read_header(http_connection_t *hc, int keepalive)
+{
+  const http_config_t *conf = http_config();
+  http_parser_t *hps = &hc->hc_parser;
+  int64_t now = get_ts();
+  int r;
+
+  http_parser_init(hps);
+  hc->hc_t_start = hc->hc_rbuf_len ? now : 0;
+
+  while((r = http_parser_parse(hps, hc->hc_rbuf, hc->hc_rbuf_len)) == 0) {
+
+    if(hc->hc_rbuf_len == hc->hc_rbuf_size) {
+      /* Reject as soon as the buffer is full, never grow it */
+      return hps->hps_state == HTTP_PARSE_REQUEST_LINE ?
+        -HTTP_STATUS_URI_TOO_LONG : -HTTP_STATUS_HEADER_TOO_LARGE;
+    }
+
+    // Nothing more to process without blocking, send pending replies
+    if(http_output_flush(hc))
+      return HTTP_ERROR_DISCONNECT;
+
+    /* An idle keep-alive connection waits for http.keepAliveTimeout.
+       Once the request has begun (or for the first request on a
+       connection) all of it must be in within http.headerTimeout */
+    int idle = keepalive && hc->hc_rbuf_len == 0;
+    if(idle)
+      tcp_set_read_deadline(hc->hc_ts, conf->keepalive_timeout ?
+                            now + conf->keepalive_timeout * 1000000LL : 0);
+    else
+      tcp_set_read_deadline(hc->hc_ts, conf->header_timeout ?
+                            (hc->hc_t_start ?: now) +
+                            conf->header_timeout * 1000000LL : 0);
+
+    r = tcp_read(hc->hc_ts, hc->hc_rbuf + hc->hc_rbuf_len,
+                 hc->hc_rbuf_size - hc->hc_rbuf_len);
+    if(r < 0 && errno == ETIMEDOUT) {
+      http_metrics_timeout(idle ? HTTP_TIMEOUT_IDLE : HTTP_TIMEOUT_HEADER);
+      return idle ? HTTP_ERROR_DISCONNECT : -HTTP_STATUS_REQUEST_TIMEOUT;
+    }
+    if(r < 1)
+      return HTTP_ERROR_DISCONNECT;
+    hc->hc_rbuf_len += r;
+    if(hc->hc_t_start == 0)
+      hc->hc_t_start = get_ts();
+  }
+
+  tcp_set_read_deadline(hc->hc_ts, 0);
+
+  if(r < 0)
+    return r;
+
+  hc->hc_rbuf_used = r;
+  hc->hc_bytes_in = r;
+  return 0;
+}
+
+
+/**
+ * Pick up command, path and headers from the parser
  */
 static void
-http_serve_requests(http_connection_t *hc)
+http_request_setup(http_connection_t *hc)
 {
-  char cmdline[1024];
-  char hdrline[1024];
-  char *argv[3], *c;
-  int n;
+  http_parser_t *hps = &hc->hc_parser;
+  int i;
+
+  hc->hc_cmd     = hps->hps_cmd;
+  hc->hc_version = hps->hps_version;
+  hc->hc_path    = hps->hps_path;
+
+  for(i = 0; i < hps->hps_num_headers; i++) {
+    http_arg_t *ra = &hc->hc_header_args[i];
+    ra->key = hps->hps_headers[i].hh_name;
+    ra->val = hps->hps_headers[i].hh_value;
+    http_arg_insert(&hc->hc_args, ra);
+  }
+}
 
 
-  htsbuf_queue_init(&hc->hc_reply, 0);
+/**
+ * Release everything allocated for a request
+ */
+static void
+http_request_cleanup(http_connection_t *hc)
+{
+  if(hc->hc_post_json != NULL) {
+    htsmsg_destroy(hc->hc_post_json);
+    hc->hc_post_json = NULL;
+  }
+  hc->hc_post_json_parsed = 0;
 
-  do {
-    talloc_cleanup();
+  free(hc->hc_post_data);
+  hc->hc_post_data = NULL;
+  hc->hc_post_len = 0;
+  hc->hc_body_remain = 0;
+
+  if(hc->hc_post_fd != -1) {
+    close(hc->hc_post_fd);
+    hc->hc_post_fd = -1;
+  }
 
-    cfg_root(cr);
-    int tracehttp = cfg_get_int(cr, CFG("http", "trace"), 0);
+  http_arg_flush(&hc->hc_args);
+  http_arg_flush(&hc->hc_req_args);
+  http_arg_flush(&hc->hc_response_headers);
 
-    hc->hc_no_output  = 0;
+  htsbuf_queue_flush(&hc->hc_reply);
 
-    if(tcp_read_line(hc->hc_ts, cmdline, sizeof(cmdline)) < 0) {
-      return;
-    }
+  hc->hc_username = NULL;
+  hc->hc_password = NULL;
 
-    if(tracehttp)
-      trace(LOG_DEBUG, "HTTP: %s", cmdline);
+  hc->hc_status = 0;
+  hc->hc_metrics_id = 0;
+  hc->hc_etag = 0;
+  http_qos_release(hc);
+  hc->hc_bytes_in = 0;
+  hc->hc_bytes_out = 0;
+  hc->hc_t_start = 0;
+  hc->hc_write_time = 0;
 
-    if((n = str_tokenize(cmdline, argv, 3, -1)) != 3) {
-      return;
-    }
+  arena_reset(&hc->hc_arena);
+}
 
-    if((hc->hc_cmd = str2val(argv[0], HTTP_cmdtab)) == -1) {
-      return;
-    }
 
-    hc->hc_path = argv[1];
-    if((hc->hc_version = str2val(argv[2], HTTP_versiontab)) == -1) {
-      return;
-    }
+/**
+ * Serve a request whose header has been parsed into hc_parser, either
+ * from the receive buffer or from a HTTP/2 HEADERS frame
+ *
+ * Returns non-zero if the connection should be closed
+ */
+int
+http_serve_request(http_connection_t *hc)
+{
+  const http_config_t *conf = http_config();
+  int i, r;
+
+  talloc_cleanup();
+
+  hc->hc_no_output = 0;
+  hc->hc_t_parsed = get_ts();
+  if(hc->hc_t_start == 0)
+    hc->hc_t_start = hc->hc_t_parsed;
+
+  http_request_setup(hc);
+
+  if(conf->trace) {
+    http_parser_t *hps = &hc->hc_parser;
+    trace(LOG_DEBUG, "HTTP: %s %s %s",
+          val2str(hc->hc_cmd, HTTP_cmdtab), hc->hc_path,
+          val2str(hc->hc_version, HTTP_versiontab));
+    for(i = 0; i < hps->hps_num_headers; i++)
+      trace(LOG_DEBUG, "HTTP: %s: %s",
+            hps->hps_headers[i].hh_name, hps->hps_headers[i].hh_value);
+  }
 
-    /* parse header */
-    while(1) {
-      if(tcp_read_line(hc->hc_ts, hdrline, sizeof(hdrline)) < 0) {
-	return;
-      }
+  r = process_request(hc);
 
-      if(tracehttp)
-	trace(LOG_DEBUG, "HTTP: %s", hdrline);
+  hc->hc_t_handled = get_ts() - hc->hc_write_time;
 
-      if(hdrline[0] == 0) {
-	break; /* header complete */
-      }
+  // Unless more requests are pipelined the reply goes out right away
+  if(hc->hc_h2 == NULL && hc->hc_rbuf_used == hc->hc_rbuf_len &&
+     http_output_flush(hc))
+    r = 1;
 
-      if((n = str_tokenize(hdrline, argv, 2, -1)) < 2)
-	continue;
+  http_accesslog(hc);
+  http_metrics_record(hc);
+  http_request_cleanup(hc);
+  return r;
+}
 
-      if((c = strrchr(argv[0], ':')) == NULL)
-	return;
 
-      *c = 0;
-      http_arg_set(&hc->hc_args, argv[0], argv[1]);
+/**
+ *
+ */
+static void
+http_serve_requests(http_connection_t *hc)
+{
+  int keepalive = 0;
+  int r;
+
+  do {
+    if((r = http_read_header(hc, keepalive)) != 0) {
+      if(r != HTTP_ERROR_DISCONNECT) {
+        hc->hc_keep_alive = 0;
+        http_error(hc, -r);
+      }
+      return;
     }
 
-    if(process_request(hc)) {
+    if(http_serve_request(hc))
       break;
-    }
 
+    /* Keep whatever the client sent beyond this request */
+    hc->hc_rbuf_len -= hc->hc_rbuf_used;
+    memmove(hc->hc_rbuf, hc->hc_rbuf + hc->hc_rbuf_used, hc->hc_rbuf_len);
+    hc->hc_rbuf_used = 0;
+    keepalive = 1;
 
-    if(hc->hc_post_message != NULL) {
-      htsmsg_destroy(hc->hc_post_message);
-      hc->hc_post_message = NULL;
-    }
+  } while(hc->hc_keep_alive);
+  
+}
 
-    free(hc->hc_post_data);
-    hc->hc_post_data = NULL;
 
-    http_arg_flush(&hc->hc_args);
-    http_arg_flush(&hc->hc_req_args);
-    http_arg_flush(&hc->hc_response_headers);
+/**
+ * When a connection with nothing in flight should be dropped
+ */
+int64_t
+http_idle_deadline(void)
+{
+  const http_config_t *conf = http_config();
+  if(conf->keepalive_timeout == 0)
+    return 0;
+  return get_ts() + conf->keepalive_timeout * 1000000LL;
+}
 
-    htsbuf_queue_flush(&hc->hc_reply);
 
-    free(hc->hc_username);
-    hc->hc_username = NULL;
+/**
+ * Set up a connection, or a HTTP/2 stream in which case ts is NULL
+ */
+void
+http_connection_init(http_connection_t *hc, tcp_stream_t *ts,
+                     struct sockaddr_in *peer, struct sockaddr_in *self)
+{
+  memset(hc, 0, sizeof(http_connection_t));
 
-    free(hc->hc_password);
-    hc->hc_password = NULL;
+  arena_init(&hc->hc_arena, 4096);
+  http_arg_list_init(&hc->hc_args, &hc->hc_arena);
+  http_arg_list_init(&hc->hc_req_args, &hc->hc_arena);
+  http_arg_list_init(&hc->hc_response_headers, &hc->hc_arena);
 
-  } while(hc->hc_keep_alive);
-  
+  hc->hc_ts = ts;
+  hc->hc_peer = peer;
+  hc->hc_self = self;
+  hc->hc_version = HTTP_VERSION_1_1;
+  hc->hc_post_fd = -1;
+
+  htsbuf_queue_init(&hc->hc_reply, 0);
+  htsbuf_queue_init(&hc->hc_output, 0);
+}
+
+
+/**
+ *
+ */
+void
+http_connection_destroy(http_connection_t *hc)
+{
+  http_output_flush(hc);
+  http_request_cleanup(hc);
+
+  free(hc->hc_rbuf);
+  htsbuf_queue_flush(&hc->hc_output);
+  arena_destroy(&hc->hc_arena);
+  if(hc->hc_ts != NULL)
+    tcp_close(hc->hc_ts);
 }
 
 
@@ -930,32 +3230,19 @@ static void
 http_serve(tcp_stream_t *ts, void *opaque, struct sockaddr_in *peer, 
 	   struct sockaddr_in *self)
 {
+  const http_config_t *conf = http_config();
   http_connection_t hc;
-  
-  memset(&hc, 0, sizeof(http_connection_t));
 
-  TAILQ_INIT(&hc.hc_args);
-  TAILQ_INIT(&hc.hc_req_args);
-  TAILQ_INIT(&hc.hc_response_headers);
+  http_connection_init(&hc, ts, peer, self);
 
-  hc.hc_ts = ts;
-  hc.hc_peer = peer;
-  hc.hc_self = self;
+  hc.hc_rbuf_size = conf->max_header_size;
+  hc.hc_rbuf = malloc(hc.hc_rbuf_size);
 
-  http_serve_requests(&hc);
-
-  free(hc.hc_post_data);
-  free(hc.hc_username);
-  free(hc.hc_password);
+  if(conf->send_timeout)
+    tcp_set_write_timeout(ts, conf->send_timeout * 1000);
 
-  if(hc.hc_post_message != NULL)
-    htsmsg_destroy(hc.hc_post_message);
-
-  http_arg_flush(&hc.hc_args);
-  http_arg_flush(&hc.hc_req_args);
-  http_arg_flush(&hc.hc_response_headers);
-  if(hc.hc_ts != NULL)
-    tcp_close(hc.hc_ts);
+  http_serve_requests(&hc);
+  http_connection_destroy(&hc);
 }
 
 
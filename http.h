@@ -20,15 +20,35 @@
 
 #include "htsbuf.h"
 #include "tcp.h"
+#include "arena.h"
+#include "http_parser.h"
 
-TAILQ_HEAD(http_arg_list, http_arg);
+#define HTTP_ARG_HASH_SIZE 16
+
+TAILQ_HEAD(http_arg_queue, http_arg);
 
 typedef struct http_arg {
   TAILQ_ENTRY(http_arg) link;
+  struct http_arg *hash_next;
+  unsigned int hash;
   char *key;
   char *val;
 } http_arg_t;
 
+/**
+ * Key/value list hashed on (case insensitive) key. If hal_arena is set
+ * all entries are allocated from it and released when it's reset
+ */
+struct http_arg_list {
+  struct http_arg_queue hal_args;
+  arena_t *hal_arena;
+  http_arg_t *hal_hash[HTTP_ARG_HASH_SIZE];
+};
+
+#define HTTP_ARG_FOREACH(ra, list) TAILQ_FOREACH(ra, &(list)->hal_args, link)
+
+#define HTTP_STATUS_CONTINUE     100
+#define HTTP_STATUS_SWITCHING_PROTOCOLS 101
 #define HTTP_STATUS_OK           200
 #define HTTP_STATUS_PARTIAL_CONTENT 206
 #define HTTP_STATUS_FOUND        302
@@ -37,7 +57,16 @@ typedef struct http_arg {
 #define HTTP_STATUS_BAD_REQUEST  400
 #define HTTP_STATUS_UNAUTHORIZED 401
 #define HTTP_STATUS_NOT_FOUND    404
+#define HTTP_STATUS_REQUEST_TIMEOUT 408
+#define HTTP_STATUS_PAYLOAD_TOO_LARGE 413
+#define HTTP_STATUS_URI_TOO_LONG 414
+#define HTTP_STATUS_RANGE_NOT_SATISFIABLE 416
+#define HTTP_STATUS_UPGRADE_REQUIRED 426
+#define HTTP_STATUS_TOO_MANY_REQUESTS 429
+#define HTTP_STATUS_HEADER_TOO_LARGE 431
 #define HTTP_STATUS_ISE          500
+#define HTTP_STATUS_NOT_IMPLEMENTED 501
+#define HTTP_STATUS_SERVICE_UNAVAILABLE 503
 
 
 typedef struct http_connection {
@@ -54,8 +83,21 @@ typedef struct http_connection {
   int hc_keep_alive;
 
   htsbuf_queue_t hc_reply;
+  htsbuf_queue_t hc_output; /* Written before we block on the socket */
+
+  arena_t hc_arena; /* Per request allocations, reset between requests */
+
+  /* Receive buffer, the request header is parsed in place in here */
+
+  char *hc_rbuf;
+  int hc_rbuf_size;
+  int hc_rbuf_len;   // Valid bytes in buffer
+  int hc_rbuf_used;  // Bytes consumed by current request
+
+  http_parser_t hc_parser;
 
-  struct http_arg_list hc_args;
+  struct http_arg_list hc_args; /* Request headers, read only */
+  http_arg_t hc_header_args[HTTP_MAX_HEADERS];
 
   struct http_arg_list hc_response_headers;
 
@@ -74,6 +116,7 @@ typedef struct http_connection {
     HTTP_CMD_POST,
     HTTP_CMD_PUT,
     HTTP_CMD_DELETE,
+    HTTP_CMD_PRI,      // HTTP/2 connection preface
     RTSP_CMD_DESCRIBE,
     RTSP_CMD_OPTIONS,
     RTSP_CMD_SETUP,
@@ -86,8 +129,11 @@ typedef struct http_connection {
     HTTP_VERSION_1_0,
     HTTP_VERSION_1_1,
     RTSP_VERSION_1_0,
+    HTTP_VERSION_2,
   } hc_version;
 
+  struct http2_session *hc_h2; /* Set when this is a HTTP/2 stream */
+
   char *hc_username;
   char *hc_password;
 
@@ -95,20 +141,62 @@ typedef struct http_connection {
 
   int hc_no_output;
 
+  enum {
+    HTTP_STREAM_NONE,
+    HTTP_STREAM_CHUNKED,
+    HTTP_STREAM_RAW,
+    HTTP_STREAM_ERROR,
+  } hc_streaming;
+
   /* Support for HTTP POST */
 
   const char *hc_content_type;
 
   char *hc_post_data;
-  unsigned int hc_post_len;
+  int64_t hc_post_len;
+
+  int hc_post_fd;            // Body spooled to an unlinked file, or -1
+  int64_t hc_body_remain;    // Body bytes not yet read off the socket
+
+  struct htsmsg *hc_post_json; // Private, use http_post_json()
+  int hc_post_json_parsed;
+
+  /* Set when the reply is to be stored in the route cache */
+
+  const struct http_route_cache *hc_cache;
+  char *hc_cache_key;
 
-  struct htsmsg *hc_post_message; // For application/json
+  struct http_flight *hc_flight; /* Leading coalesced identical requests */
+
+  int hc_etag;  // Route has HTTP_ROUTE_ETAG, see http_send_reply()
+  int hc_qos_class;  // Class + 1 while holding a slot in it, or 0
+
+  /* Accounting for the access log and metrics, times are from get_ts() */
+
+  int hc_status;
+  int hc_metrics_id;
+  int64_t hc_bytes_in;   // Request header, body is hc_post_len
+  int64_t hc_bytes_out;
+  int64_t hc_t_start;    // First byte of the request header seen
+  int64_t hc_t_parsed;   // Header parsed, request dispatched
+  int64_t hc_t_handled;  // Request done, not counting hc_write_time
+  int64_t hc_write_time; // Spent writing to the socket
 
 } http_connection_t;
 
 
+void http_arg_list_init(struct http_arg_list *list, arena_t *arena);
+
+const char *http_cmd2str(int cmd);
+
 void http_arg_flush(struct http_arg_list *list);
 
+static inline const char *
+http_header_get(http_connection_t *hc, http_header_id_t id)
+{
+  return hc->hc_parser.hps_known[id];
+}
+
 char *http_arg_get(struct http_arg_list *list, const char *name);
 
 int http_arg_get_int(struct http_arg_list *list, const char *name,
@@ -117,6 +205,14 @@ int http_arg_get_int(struct http_arg_list *list, const char *name,
 void http_arg_set(struct http_arg_list *list,
                   const char *key, const char *val);
 
+#define HTTP_ENCODING_IDENTITY 0
+#define HTTP_ENCODING_GZIP     1
+#define HTTP_ENCODING_DEFLATE  2
+
+int http_encoding_accepted(http_connection_t *hc, int encoding);
+
+int http_negotiate_encoding(http_connection_t *hc);
+
 void http_error(http_connection_t *hc, int error);
 
 int http_err(http_connection_t *hc, int error, const char *str);
@@ -129,11 +225,36 @@ void http_redirect(http_connection_t *hc, const char *location, int status);
 
 int http_send_100_continue(http_connection_t *hc);
 
+int http_output_flush(http_connection_t *hc);
+
+int http_detach(http_connection_t *hc);
+
+int http_send_data(http_connection_t *hc, const void *data, size_t len);
+
+int http_stream_begin(http_connection_t *hc, int rc, const char *content);
+
+int http_stream_write(http_connection_t *hc, const void *data, size_t len);
+
+int http_stream_printf(http_connection_t *hc, const char *fmt, ...)
+  __attribute__ ((format (printf, 2, 3)));
+
+int http_stream_end(http_connection_t *hc);
+
+int http_etag_match(http_connection_t *hc, const char *etag);
+
+int http_token_match(const char *list, const char *token);
+
 int http_send_header(http_connection_t *hc, int rc, const char *content,
                      int64_t contentlen, const char *encoding,
                      const char *location, int maxage, const char *range,
                      const char *disposition, const char *transfer_encoding);
 
+/**
+ * Callbacks return 0, a HTTP status code to reply with an error page or
+ * HTTP_ERROR_DISCONNECT to drop the connection
+ */
+#define HTTP_ERROR_DISCONNECT -1
+
 typedef int (http_callback_t)(http_connection_t *hc,
 			      const char *remain, void *opaque);
 
@@ -142,9 +263,119 @@ void http_path_add(const char *path, void *opaque, http_callback_t *callback);
 typedef int (http_callback2_t)(http_connection_t *hc, int argc, char **argv,
                                int flags);
 
+/**
+ * Route flags
+ *
+ * HTTP_ROUTE_STREAM_BODY - The body is not read before the callback is
+ *                          invoked, the callback pulls it with
+ *                          http_body_read()
+ *
+ * HTTP_ROUTE_SPILL_BODY  - Bodies larger than http.bodySpillSize are
+ *                          written to an unlinked file in http.tmpDir
+ *                          and passed as hc_post_fd (hc_post_data is NULL)
+ *
+ * HTTP_ROUTE_COALESCE    - Concurrent identical GET requests (same path,
+ *                          query args and content coding, or same cache
+ *                          key for cached routes) run the callback once
+ *                          and share the reply. Only replies sent in one
+ *                          go are shared, like for http_route_set_cache().
+ *                          Requests carrying Authorization or Cookie are
+ *                          never coalesced
+ *
+ * HTTP_ROUTE_ETAG        - 200 replies to GET and HEAD sent in one go get
+ *                          an ETag hashed from the body. If-None-Match
+ *                          holding it is answered with 304 and no body
+ *
+ * HTTP_ROUTE_CLASS(n)    - Put the route in class n (0 - 7, default 0).
+ *                          Each class has its own limit on concurrently
+ *                          running handlers and queued requests, set by
+ *                          http.class.<n>. Requests over it get 503
+ */
 #define HTTP_ROUTE_HANDLE_100_CONTINUE 0x1
+#define HTTP_ROUTE_STREAM_BODY         0x2
+#define HTTP_ROUTE_SPILL_BODY          0x4
+#define HTTP_ROUTE_COALESCE            0x8
+#define HTTP_ROUTE_ETAG                0x10
+#define HTTP_ROUTE_CLASS(n)            ((n) << 8)
+#define HTTP_ROUTE_CLASS_OF(flags)     (((flags) >> 8) & 7)
+#define HTTP_ROUTE_CLASSES             8
+
+typedef struct http_route http_route_t;
+
+/**
+ * A callback that returns 404 without having started a reply hands the
+ * request on to the http_path_add() handlers
+ */
+http_route_t *http_route_add(const char *path, http_callback2_t *callback,
+                             int flags);
 
-void http_route_add(const char *path, http_callback2_t *callback, int flags);
+void http_route_set_max_body(http_route_t *hr, int64_t bytes);
+
+/**
+ * Cache 200 replies to GET requests for ttl seconds. The key is the
+ * path plus the comma separated query args and request headers given
+ * (either may be NULL). After ttl the old reply is served for another
+ * stale seconds while one request recomputes it.
+ *
+ * Only replies sent in one go (http_output_content() and friends) are
+ * cached, streamed and file replies are not. Response headers are
+ * cached too, so routes that set per client headers (cookies) must not
+ * be cached unless they are part of the key. Memory is bounded by
+ * http.cacheSize
+ */
+void http_route_set_cache(http_route_t *hr, int ttl, int stale,
+                          const char *args, const char *headers);
+
+/**
+ * Rate limit keys
+ *
+ * HTTP_RATELIMIT_PEER  - One bucket per client address
+ * HTTP_RATELIMIT_USER  - One bucket per authenticated user, clients
+ *                        without credentials are keyed by address
+ * HTTP_RATELIMIT_ROUTE - One bucket shared by all clients
+ */
+#define HTTP_RATELIMIT_PEER  0
+#define HTTP_RATELIMIT_USER  1
+#define HTTP_RATELIMIT_ROUTE 2
+
+/**
+ * Let rate requests per second through, with bursts of up to burst
+ * requests, before answering 429 with Retry-After. The check is done
+ * before the body is read. This replaces the server wide limit
+ * (http.rateLimit.rate, .burst and .key, where key is "peer", "user"
+ * or "route") for the route, a rate of 0 exempts it
+ */
+void http_route_set_ratelimit(http_route_t *hr, int rate, int burst, int key);
+
+int http_body_read(http_connection_t *hc, void *buf, size_t len);
+
+/**
+ * Build a htsmsg tree from an application/json body on first call, it
+ * is kept until the request is done. Malformed bodies are answered
+ * with 400 before dispatch. Returns NULL if there is no JSON body
+ */
+struct htsmsg *http_post_json(http_connection_t *hc);
+
+/**
+ * Extract a single value from an application/json body without
+ * building the tree, path is as for json_find(). Strings are allocated
+ * from the request arena
+ */
+const char *http_post_json_str(http_connection_t *hc, const char *path);
+
+int64_t http_post_json_int(http_connection_t *hc, const char *path,
+                           int64_t def);
+
+void http_path_add_filebundle(const char *path, const char *prefix);
+
+void http_path_add_directory(const char *path, const char *root);
+
+/**
+ * Serve request counts, bytes, latency histograms per route and path,
+ * plus tcp_server and asyncio stats in the Prometheus text format.
+ * path is a route pattern, such as "/metrics$"
+ */
+http_route_t *http_route_add_metrics(const char *path);
 
 int http_server_init(int port, const char *bindaddr);
 
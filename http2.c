@@ -0,0 +1,1561 @@
+/*
+ *  HTTP/2 for the HTTP server
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+
+#include "http2.h"
+#include "hpack.h"
+#include "misc.h"
+#include "cfg.h"
+#include "http_metrics.h"
+
+/**
+ * HTTP/2 (RFC 7540) on top of the thread per connection server.
+ *
+ * Frames are read and written by the connection thread. Requests are
+ * collected per stream until complete and then served one at a time
+ * through the regular route/path dispatch, using a http_connection_t
+ * without a socket (h2_shc). While a response is blocked on flow
+ * control, incoming frames are still processed so other streams keep
+ * making progress and are queued to be served next.
+ */
+
+#define H2_FRAME_DATA           0x0
+#define H2_FRAME_HEADERS        0x1
+#define H2_FRAME_PRIORITY       0x2
+#define H2_FRAME_RST_STREAM     0x3
+#define H2_FRAME_SETTINGS       0x4
+#define H2_FRAME_PUSH_PROMISE   0x5
+#define H2_FRAME_PING           0x6
+#define H2_FRAME_GOAWAY         0x7
+#define H2_FRAME_WINDOW_UPDATE  0x8
+#define H2_FRAME_CONTINUATION   0x9
+
+#define H2_FLAG_END_STREAM      0x1
+#define H2_FLAG_ACK             0x1
+#define H2_FLAG_END_HEADERS     0x4
+#define H2_FLAG_PADDED          0x8
+#define H2_FLAG_PRIORITY        0x20
+
+#define H2_SETTINGS_HEADER_TABLE_SIZE      0x1
+#define H2_SETTINGS_ENABLE_PUSH            0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE         0x5
+#define H2_SETTINGS_MAX_HEADER_LIST_SIZE   0x6
+
+#define H2_NO_ERROR             0x0
+#define H2_PROTOCOL_ERROR       0x1
+#define H2_INTERNAL_ERROR       0x2
+#define H2_FLOW_CONTROL_ERROR   0x3
+#define H2_STREAM_CLOSED        0x5
+#define H2_FRAME_SIZE_ERROR     0x6
+#define H2_REFUSED_STREAM       0x7
+#define H2_COMPRESSION_ERROR    0x9
+#define H2_ENHANCE_YOUR_CALM    0xb
+
+#define H2_FRAME_HEADER_SIZE    9
+#define H2_FRAME_SIZE           16384   // Default max, never changed
+#define H2_DEFAULT_WINDOW       65535
+#define H2_MAX_WINDOW           0x7fffffff
+#define H2_RBUF_SIZE            65536
+#define H2_OUTPUT_FLUSH         65536
+
+static const char h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+#define H2_PREFACE_HTTP1_LEN 18 // Part parsed as a HTTP/1 request
+
+
+typedef struct http2_config {
+  int enabled;
+  int max_streams;
+  int window_size;
+  int max_header_list;
+} http2_config_t;
+
+static void
+http2_config_fill(void *opaque, cfg_t *cr)
+{
+  http2_config_t *c = opaque;
+  c->enabled = cfg_get_int(cr, CFG("http2", "enable"), 1);
+  c->max_streams =
+    MAX(cfg_get_int(cr, CFG("http2", "maxConcurrentStreams"), 100), 1);
+  c->window_size =
+    MAX(cfg_get_int(cr, CFG("http2", "windowSize"), 1024 * 1024),
+        H2_DEFAULT_WINDOW);
+  c->max_header_list =
+    MAX(cfg_get_int(cr, CFG("http", "maxHeaderSize"), 16384), 1024);
+}
+
+CFG_VIEW(http2_config_t, http2_config, http2_config_fill);
+
+
+LIST_HEAD(h2_stream_list, h2_stream);
+TAILQ_HEAD(h2_stream_queue, h2_stream);
+
+typedef struct h2_stream {
+  LIST_ENTRY(h2_stream) hs_link;
+  TAILQ_ENTRY(h2_stream) hs_ready_link;
+
+  uint32_t hs_id;
+
+  enum {
+    H2_STREAM_OPEN,    // Receiving request
+    H2_STREAM_READY,   // Queued on h2_ready, body may still be arriving
+    H2_STREAM_ACTIVE,  // Being served
+  } hs_state;
+
+  int hs_reset;        // Reset by peer while active
+  int hs_status;       // Answer with this status instead of dispatching
+  int hs_headers_sent;
+  int hs_end_stream;   // Peer has sent all of the request
+
+  int hs_flags;        // Of the route, resolved at HEADERS
+  int64_t hs_max_body;
+  int64_t hs_content_length; // -1 if not given
+  int64_t hs_body_len;       // Received so far
+
+  int64_t hs_send_window;
+  int hs_recv_window;  // What the peer may still send
+  int hs_recv_unacked; // Consumed but not yet given back to the peer
+
+  char *hs_hdrs;       // Decoded headers as NUL terminated name/value
+  int hs_hdrs_len;
+  int hs_hdrs_size;
+
+  htsbuf_queue_t hs_body;
+} h2_stream_t;
+
+
+typedef struct http2_session {
+  http_connection_t *h2_hc;   // Owns the socket
+  http_connection_t h2_shc;   // Request context for the stream served
+
+  uint8_t *h2_rbuf;
+  int h2_rbuf_off;
+  int h2_rbuf_len;
+
+  htsbuf_queue_t h2_out;
+
+  hpack_table_t h2_dec;
+  hpack_table_t h2_enc;
+
+  struct h2_stream_list h2_streams;
+  struct h2_stream_queue h2_ready;
+  int h2_num_streams;
+  uint32_t h2_last_id;
+  h2_stream_t *h2_active;
+
+  // HEADERS + CONTINUATION being collected
+  uint32_t h2_hblock_id;
+  int h2_hblock_end_stream;
+  uint8_t *h2_hblock;
+  int h2_hblock_len;
+  int h2_hblock_size;
+
+  int64_t h2_send_window;
+  int h2_peer_window;         // Peer's SETTINGS_INITIAL_WINDOW_SIZE
+  int h2_recv_unacked;
+
+  int h2_closed;
+  int h2_io_error;
+  int h2_error;               // Sent in GOAWAY
+  int h2_goaway;              // Peer sent GOAWAY
+
+  int h2_window;
+  int h2_max_streams;
+  int h2_max_header_list;
+} http2_session_t;
+
+
+static int h2_read_frame(http2_session_t *h2);
+
+
+/**
+ *
+ */
+static void
+h2_fail(http2_session_t *h2, int error)
+{
+  if(!h2->h2_closed)
+    h2->h2_error = error;
+  h2->h2_closed = 1;
+}
+
+
+/**
+ *
+ */
+static void
+h2_frame_header(htsbuf_queue_t *hq, int len, int type, int flags,
+                uint32_t id)
+{
+  uint8_t b[H2_FRAME_HEADER_SIZE] = {
+    len >> 16, len >> 8, len, type, flags,
+    (id >> 24) & 0x7f, id >> 16, id >> 8, id
+  };
+  htsbuf_append(hq, b, sizeof(b));
+}
+
+
+/**
+ *
+ */
+static void
+h2_send_frame(http2_session_t *h2, int type, int flags, uint32_t id,
+              const void *payload, int len)
+{
+  h2_frame_header(&h2->h2_out, len, type, flags, id);
+  htsbuf_append(&h2->h2_out, payload, len);
+}
+
+
+/**
+ *
+ */
+static void
+h2_send_u32(http2_session_t *h2, int type, uint32_t id, uint32_t v)
+{
+  uint8_t b[4] = {v >> 24, v >> 16, v >> 8, v};
+  h2_send_frame(h2, type, 0, id, b, 4);
+}
+
+
+/**
+ *
+ */
+static void
+h2_send_rst(http2_session_t *h2, uint32_t id, int error)
+{
+  h2_send_u32(h2, H2_FRAME_RST_STREAM, id, error);
+}
+
+
+/**
+ *
+ */
+static int
+h2_flush(http2_session_t *h2)
+{
+  if(h2->h2_io_error) {
+    htsbuf_queue_flush(&h2->h2_out);
+    return -1;
+  }
+
+  if(TAILQ_EMPTY(&h2->h2_out.hq_q))
+    return 0;
+
+  if(tcp_write_queue(h2->h2_hc->hc_ts, &h2->h2_out)) {
+    h2->h2_io_error = 1;
+    h2->h2_closed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * Move len bytes from hq to the output queue
+ */
+static void
+h2_output_move(http2_session_t *h2, htsbuf_queue_t *hq, int len)
+{
+  uint8_t buf[4096];
+
+  while(len > 0) {
+    int n = htsbuf_read(hq, buf, MIN(len, sizeof(buf)));
+    htsbuf_append(&h2->h2_out, buf, n);
+    len -= n;
+  }
+}
+
+
+/**
+ * Make sure len bytes are in the receive buffer. Pending output is
+ * written before we block
+ */
+static int
+h2_fill(http2_session_t *h2, int len)
+{
+  int r;
+
+  while(h2->h2_rbuf_len - h2->h2_rbuf_off < len) {
+
+    if(h2->h2_rbuf_off + len > H2_RBUF_SIZE) {
+      h2->h2_rbuf_len -= h2->h2_rbuf_off;
+      memmove(h2->h2_rbuf, h2->h2_rbuf + h2->h2_rbuf_off, h2->h2_rbuf_len);
+      h2->h2_rbuf_off = 0;
+    }
+
+    if(h2_flush(h2))
+      return -1;
+
+    tcp_set_read_deadline(h2->h2_hc->hc_ts, http_idle_deadline());
+    r = tcp_read(h2->h2_hc->hc_ts, h2->h2_rbuf + h2->h2_rbuf_len,
+                 H2_RBUF_SIZE - h2->h2_rbuf_len);
+    if(r < 1) {
+      if(r < 0 && errno == ETIMEDOUT)
+        http_metrics_timeout(HTTP_TIMEOUT_IDLE);
+      h2->h2_io_error = 1;
+      h2->h2_closed = 1;
+      return -1;
+    }
+    h2->h2_rbuf_len += r;
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static h2_stream_t *
+h2_stream_find(http2_session_t *h2, uint32_t id)
+{
+  h2_stream_t *hs;
+  LIST_FOREACH(hs, &h2->h2_streams, hs_link)
+    if(hs->hs_id == id)
+      return hs;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static h2_stream_t *
+h2_stream_create(http2_session_t *h2, uint32_t id)
+{
+  h2_stream_t *hs = calloc(1, sizeof(h2_stream_t));
+  hs->hs_id = id;
+  hs->hs_state = H2_STREAM_OPEN;
+  hs->hs_send_window = h2->h2_peer_window;
+  hs->hs_recv_window = h2->h2_window;
+  hs->hs_content_length = -1;
+  htsbuf_queue_init(&hs->hs_body, 0);
+  return hs;
+}
+
+
+/**
+ *
+ */
+static void
+h2_stream_free(h2_stream_t *hs)
+{
+  htsbuf_queue_flush(&hs->hs_body);
+  free(hs->hs_hdrs);
+  free(hs);
+}
+
+
+/**
+ *
+ */
+static void
+h2_stream_destroy(http2_session_t *h2, h2_stream_t *hs)
+{
+  if(hs->hs_state == H2_STREAM_READY)
+    TAILQ_REMOVE(&h2->h2_ready, hs, hs_ready_link);
+  LIST_REMOVE(hs, hs_link);
+  h2->h2_num_streams--;
+  h2_stream_free(hs);
+}
+
+
+/**
+ *
+ */
+static void
+h2_stream_ready(http2_session_t *h2, h2_stream_t *hs)
+{
+  hs->hs_state = H2_STREAM_READY;
+  TAILQ_INSERT_TAIL(&h2->h2_ready, hs, hs_ready_link);
+}
+
+
+/**
+ * Reset a stream, the active one is left for the handler to notice
+ */
+static void
+h2_stream_abort(http2_session_t *h2, h2_stream_t *hs, int error)
+{
+  h2_send_rst(h2, hs->hs_id, error);
+  if(hs == h2->h2_active)
+    hs->hs_reset = 1;
+  else
+    h2_stream_destroy(h2, hs);
+}
+
+
+/**
+ * Body has been consumed, give the peer room for that much more once
+ * half of the window is used up
+ */
+static void
+h2_stream_credit(http2_session_t *h2, h2_stream_t *hs, int len)
+{
+  hs->hs_recv_unacked += len;
+  if(hs->hs_end_stream || hs->hs_recv_unacked < h2->h2_window / 2)
+    return;
+  h2_send_u32(h2, H2_FRAME_WINDOW_UPDATE, hs->hs_id, hs->hs_recv_unacked);
+  hs->hs_recv_window += hs->hs_recv_unacked;
+  hs->hs_recv_unacked = 0;
+}
+
+
+/**
+ * Step to the next collected name/value pair. Returns -1 at the end
+ */
+static int
+h2_header_next(char **pp, char *end, char **name, char **value)
+{
+  char *p = *pp, *e;
+
+  if(p >= end || (e = memchr(p, 0, end - p)) == NULL)
+    return -1;
+  *name = p;
+  p = e + 1;
+  if((e = memchr(p, 0, end - p)) == NULL)
+    return -1;
+  *value = p;
+  *pp = e + 1;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static const char *
+h2_stream_header(const h2_stream_t *hs, const char *name)
+{
+  char *p = hs->hs_hdrs, *end = p + hs->hs_hdrs_len, *n, *v;
+
+  while(!h2_header_next(&p, end, &n, &v))
+    if(!strcmp(n, name))
+      return v;
+  return NULL;
+}
+
+
+/**
+ * Collect decoded headers for a stream. Oversized or malformed header
+ * sets are answered once the block is complete, decoding must go on
+ * to keep the HPACK state in sync
+ */
+static int
+h2_header_collect(void *opaque, const char *name, int name_len,
+                  const char *value, int value_len)
+{
+  h2_stream_t *hs = opaque;
+  int need = hs->hs_hdrs_len + name_len + value_len + 2;
+
+  if(hs->hs_status)
+    return 0;
+
+  if(need > http2_config()->max_header_list) {
+    hs->hs_status = HTTP_STATUS_HEADER_TOO_LARGE;
+    return 0;
+  }
+
+  for(int i = 0; i < name_len; i++) {
+    if(name[i] >= 'A' && name[i] <= 'Z') {
+      hs->hs_status = HTTP_STATUS_BAD_REQUEST; // RFC 7540 8.1.2
+      return 0;
+    }
+  }
+
+  // Headers are stored NUL terminated, and must not smuggle in more
+  // lines when handed on (RFC 7540 10.3)
+  if(memchr(name, 0, name_len) || memchr(name, '\r', name_len) ||
+     memchr(name, '\n', name_len) || memchr(value, 0, value_len) ||
+     memchr(value, '\r', value_len) || memchr(value, '\n', value_len)) {
+    hs->hs_status = HTTP_STATUS_BAD_REQUEST;
+    return 0;
+  }
+
+  if(need > hs->hs_hdrs_size) {
+    hs->hs_hdrs_size = MAX(need, hs->hs_hdrs_size * 2);
+    hs->hs_hdrs = realloc(hs->hs_hdrs, hs->hs_hdrs_size);
+  }
+
+  char *p = hs->hs_hdrs + hs->hs_hdrs_len;
+  memcpy(p, name, name_len);
+  p[name_len] = 0;
+  p += name_len + 1;
+  memcpy(p, value, value_len);
+  p[value_len] = 0;
+  hs->hs_hdrs_len = need;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+h2_header_ignore(void *opaque, const char *name, int name_len,
+                 const char *value, int value_len)
+{
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+h2_send_header_block(http2_session_t *h2, uint32_t id, htsbuf_queue_t *hq,
+                     int end_stream)
+{
+  int len = MIN(hq->hq_size, H2_FRAME_SIZE);
+  int type = H2_FRAME_HEADERS;
+  int flags = end_stream ? H2_FLAG_END_STREAM : 0;
+
+  while(1) {
+    if(len == hq->hq_size)
+      flags |= H2_FLAG_END_HEADERS;
+    h2_frame_header(&h2->h2_out, len, type, flags, id);
+    h2_output_move(h2, hq, len);
+    if(flags & H2_FLAG_END_HEADERS)
+      break;
+    len = MIN(hq->hq_size, H2_FRAME_SIZE);
+    type = H2_FRAME_CONTINUATION;
+    flags = 0;
+  }
+}
+
+
+/**
+ * Answer a request without involving any handler
+ */
+static void
+h2_send_status(http2_session_t *h2, h2_stream_t *hs, int status)
+{
+  htsbuf_queue_t hq;
+  char buf[16];
+
+  htsbuf_queue_init(&hq, 0);
+  snprintf(buf, sizeof(buf), "%d", status);
+  hpack_encode(&h2->h2_enc, &hq, ":status", buf, 0);
+  hpack_encode(&h2->h2_enc, &hq, "date", time_to_http_date(time(NULL)),
+               HPACK_NO_INDEX);
+  hpack_encode(&h2->h2_enc, &hq, "content-length", "0", 0);
+  h2_send_header_block(h2, hs->hs_id, &hq, 1);
+  hs->hs_headers_sent = 1;
+
+  // Tell the peer to stop sending the rest of the request
+  if(!hs->hs_end_stream)
+    h2_send_rst(h2, hs->hs_id, H2_NO_ERROR);
+}
+
+
+/**
+ * The route is resolved as soon as the headers are in, so its body
+ * limit applies before anything is buffered. Returns a status if the
+ * request must be refused
+ */
+static int
+h2_stream_route(h2_stream_t *hs)
+{
+  const char *path = h2_stream_header(hs, ":path");
+  const char *cl = h2_stream_header(hs, "content-length");
+  char *p, *end;
+
+  p = mystrdupa(path ?: "");
+  if((end = strchr(p, '?')) != NULL)
+    *end = 0;
+  hs->hs_max_body = http_route_body_limit(p, &hs->hs_flags);
+
+  if(cl == NULL)
+    return 0;
+
+  hs->hs_content_length = strtoll(cl, &end, 10);
+  if(end == cl || *end || hs->hs_content_length < 0 ||
+     (hs->hs_end_stream && hs->hs_content_length != 0))
+    return HTTP_STATUS_BAD_REQUEST; // RFC 7540 8.1.2.6
+  if(hs->hs_content_length > hs->hs_max_body)
+    return HTTP_STATUS_PAYLOAD_TOO_LARGE;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+h2_header_block_done(http2_session_t *h2)
+{
+  uint32_t id = h2->h2_hblock_id;
+  int end_stream = h2->h2_hblock_end_stream;
+  h2_stream_t *hs;
+
+  h2->h2_hblock_id = 0;
+
+  if((hs = h2_stream_find(h2, id)) != NULL) {
+    // Trailers, nothing we care about
+    if(hs->hs_end_stream || !end_stream) {
+      h2_fail(h2, H2_PROTOCOL_ERROR);
+      return;
+    }
+    if(hpack_decode(&h2->h2_dec, h2->h2_hblock, h2->h2_hblock_len,
+                    h2_header_ignore, NULL)) {
+      h2_fail(h2, H2_COMPRESSION_ERROR);
+      return;
+    }
+    hs->hs_end_stream = 1;
+    if(hs->hs_content_length >= 0 &&
+       hs->hs_body_len != hs->hs_content_length)
+      h2_stream_abort(h2, hs, H2_PROTOCOL_ERROR);
+    else if(hs->hs_state == H2_STREAM_OPEN)
+      h2_stream_ready(h2, hs);
+    return;
+  }
+
+  if(id <= h2->h2_last_id) {
+    h2_fail(h2, H2_PROTOCOL_ERROR);
+    return;
+  }
+  h2->h2_last_id = id;
+
+  hs = h2_stream_create(h2, id);
+  hs->hs_end_stream = end_stream;
+
+  if(hpack_decode(&h2->h2_dec, h2->h2_hblock, h2->h2_hblock_len,
+                  h2_header_collect, hs)) {
+    h2_stream_free(hs);
+    h2_fail(h2, H2_COMPRESSION_ERROR);
+    return;
+  }
+
+  if(h2->h2_num_streams >= h2->h2_max_streams) {
+    h2_stream_free(hs);
+    h2_send_rst(h2, id, H2_REFUSED_STREAM);
+    return;
+  }
+
+  LIST_INSERT_HEAD(&h2->h2_streams, hs, hs_link);
+  h2->h2_num_streams++;
+
+  if(!hs->hs_status)
+    hs->hs_status = h2_stream_route(hs);
+
+  if(hs->hs_status) {
+    h2_send_status(h2, hs, hs->hs_status);
+    h2_stream_destroy(h2, hs);
+    return;
+  }
+
+  // Streaming handlers are dispatched right away, as for HTTP/1
+  if(end_stream || (hs->hs_flags & HTTP_ROUTE_STREAM_BODY &&
+                    hs->hs_content_length >= 0))
+    h2_stream_ready(h2, hs);
+}
+
+
+/**
+ *
+ */
+static void
+h2_header_block_append(http2_session_t *h2, const uint8_t *p, int len)
+{
+  int need = h2->h2_hblock_len + len;
+
+  if(need > h2->h2_max_header_list * 4) {
+    h2_fail(h2, H2_ENHANCE_YOUR_CALM);
+    return;
+  }
+
+  if(need > h2->h2_hblock_size) {
+    h2->h2_hblock_size = MAX(need, h2->h2_hblock_size * 2);
+    h2->h2_hblock = realloc(h2->h2_hblock, h2->h2_hblock_size);
+  }
+  memcpy(h2->h2_hblock + h2->h2_hblock_len, p, len);
+  h2->h2_hblock_len = need;
+}
+
+
+/**
+ *
+ */
+static int
+h2_strip_padding(http2_session_t *h2, int flags, const uint8_t **p, int *len)
+{
+  int pad;
+
+  if(!(flags & H2_FLAG_PADDED))
+    return 0;
+
+  if(*len < 1 || (pad = **p) >= *len) {
+    h2_fail(h2, H2_PROTOCOL_ERROR);
+    return -1;
+  }
+  (*p)++;
+  *len -= pad + 1;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+h2_recv_headers(http2_session_t *h2, int flags, uint32_t id,
+                const uint8_t *p, int len)
+{
+  if(id == 0 || !(id & 1)) {
+    h2_fail(h2, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  if(h2_strip_padding(h2, flags, &p, &len))
+    return;
+
+  if(flags & H2_FLAG_PRIORITY) {
+    if(len < 5) {
+      h2_fail(h2, H2_FRAME_SIZE_ERROR);
+      return;
+    }
+    p += 5;
+    len -= 5;
+  }
+
+  h2->h2_hblock_id = id;
+  h2->h2_hblock_end_stream = flags & H2_FLAG_END_STREAM;
+  h2->h2_hblock_len = 0;
+  h2_header_block_append(h2, p, len);
+
+  if(flags & H2_FLAG_END_HEADERS && !h2->h2_closed)
+    h2_header_block_done(h2);
+}
+
+
+/**
+ * Flow control on the receiving side. The connection window is
+ * replenished as soon as half of it is used. Stream windows are only
+ * replenished as the body is consumed, so a stream that isn't being
+ * served holds at most http2.windowSize of body
+ */
+static void
+h2_recv_data(http2_session_t *h2, int flags, uint32_t id,
+             const uint8_t *p, int len)
+{
+  int flen = len;
+  h2_stream_t *hs;
+
+  if(id == 0) {
+    h2_fail(h2, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  if(h2_strip_padding(h2, flags, &p, &len))
+    return;
+
+  h2->h2_recv_unacked += flen;
+  if(h2->h2_recv_unacked >= h2->h2_window / 2) {
+    h2_send_u32(h2, H2_FRAME_WINDOW_UPDATE, 0, h2->h2_recv_unacked);
+    h2->h2_recv_unacked = 0;
+  }
+
+  hs = h2_stream_find(h2, id);
+  if(hs == NULL || hs->hs_end_stream) {
+    if(id > h2->h2_last_id)
+      h2_fail(h2, H2_PROTOCOL_ERROR);
+    else if(hs != NULL)
+      h2_stream_abort(h2, hs, H2_STREAM_CLOSED);
+    // else: stream we have reset, drop silently
+    return;
+  }
+
+  if(flen > hs->hs_recv_window) {
+    h2_stream_abort(h2, hs, H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+  hs->hs_recv_window -= flen;
+  hs->hs_body_len += len;
+  hs->hs_end_stream = flags & H2_FLAG_END_STREAM;
+
+  if(hs->hs_content_length >= 0 &&
+     (hs->hs_body_len > hs->hs_content_length ||
+      (hs->hs_end_stream && hs->hs_body_len != hs->hs_content_length))) {
+    h2_stream_abort(h2, hs, H2_PROTOCOL_ERROR); // RFC 7540 8.1.2.6
+    return;
+  }
+
+  // The stream being served checks the limit as it collects the body
+  if(hs != h2->h2_active && hs->hs_body_len > hs->hs_max_body) {
+    h2_send_status(h2, hs, HTTP_STATUS_PAYLOAD_TOO_LARGE);
+    h2_stream_destroy(h2, hs);
+    return;
+  }
+
+  htsbuf_append(&hs->hs_body, p, len);
+  h2_stream_credit(h2, hs, flen - len); // Padding is consumed right away
+
+  // Dispatch once the body is complete or the peer is out of window
+  if(hs->hs_state == H2_STREAM_OPEN &&
+     (hs->hs_end_stream || hs->hs_recv_window < H2_FRAME_SIZE))
+    h2_stream_ready(h2, hs);
+}
+
+
+/**
+ *
+ */
+static int
+h2_apply_settings(http2_session_t *h2, const uint8_t *p, int len)
+{
+  h2_stream_t *hs;
+
+  for(; len >= 6; p += 6, len -= 6) {
+    int id = p[0] << 8 | p[1];
+    uint32_t v = (uint32_t)p[2] << 24 | p[3] << 16 | p[4] << 8 | p[5];
+
+    switch(id) {
+    case H2_SETTINGS_HEADER_TABLE_SIZE:
+      hpack_table_set_limit(&h2->h2_enc, MIN(v, INT32_MAX));
+      break;
+
+    case H2_SETTINGS_ENABLE_PUSH:
+      if(v > 1)
+        return H2_PROTOCOL_ERROR;
+      break;
+
+    case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+      if(v > H2_MAX_WINDOW)
+        return H2_FLOW_CONTROL_ERROR;
+      LIST_FOREACH(hs, &h2->h2_streams, hs_link)
+        hs->hs_send_window += (int64_t)v - h2->h2_peer_window;
+      h2->h2_peer_window = v;
+      break;
+
+    case H2_SETTINGS_MAX_FRAME_SIZE:
+      // We never send frames larger than the default anyway
+      if(v < H2_FRAME_SIZE || v > 0xffffff)
+        return H2_PROTOCOL_ERROR;
+      break;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+h2_recv_settings(http2_session_t *h2, int flags, uint32_t id,
+                 const uint8_t *p, int len)
+{
+  int err;
+
+  if(id != 0) {
+    h2_fail(h2, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  if(flags & H2_FLAG_ACK) {
+    if(len != 0)
+      h2_fail(h2, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+
+  if(len % 6) {
+    h2_fail(h2, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+
+  if((err = h2_apply_settings(h2, p, len)) != 0) {
+    h2_fail(h2, err);
+    return;
+  }
+  h2_send_frame(h2, H2_FRAME_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+}
+
+
+/**
+ *
+ */
+static void
+h2_recv_window_update(http2_session_t *h2, uint32_t id,
+                      const uint8_t *p, int len)
+{
+  uint32_t inc;
+  h2_stream_t *hs;
+
+  if(len != 4) {
+    h2_fail(h2, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+
+  inc = ((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) & 0x7fffffff;
+
+  if(id == 0) {
+    h2->h2_send_window += inc;
+    if(inc == 0 || h2->h2_send_window > H2_MAX_WINDOW)
+      h2_fail(h2, inc ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  if((hs = h2_stream_find(h2, id)) == NULL)
+    return;
+
+  hs->hs_send_window += inc;
+  if(inc == 0 || hs->hs_send_window > H2_MAX_WINDOW)
+    h2_stream_abort(h2, hs, inc ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+}
+
+
+/**
+ *
+ */
+static void
+h2_recv_rst_stream(http2_session_t *h2, uint32_t id, int len)
+{
+  h2_stream_t *hs;
+
+  if(len != 4) {
+    h2_fail(h2, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+  if(id == 0) {
+    h2_fail(h2, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  if((hs = h2_stream_find(h2, id)) == NULL)
+    return;
+
+  if(hs == h2->h2_active)
+    hs->hs_reset = 1;  // Handler notices when it tries to send
+  else
+    h2_stream_destroy(h2, hs);
+}
+
+
+/**
+ * Read and process one frame
+ */
+static int
+h2_read_frame(http2_session_t *h2)
+{
+  const uint8_t *p;
+  int len, type, flags;
+  uint32_t id;
+
+  if(h2_fill(h2, H2_FRAME_HEADER_SIZE))
+    return -1;
+
+  p = h2->h2_rbuf + h2->h2_rbuf_off;
+  len   = p[0] << 16 | p[1] << 8 | p[2];
+  type  = p[3];
+  flags = p[4];
+  id    = (uint32_t)(p[5] & 0x7f) << 24 | p[6] << 16 | p[7] << 8 | p[8];
+
+  if(len > H2_FRAME_SIZE) {
+    h2_fail(h2, H2_FRAME_SIZE_ERROR);
+    return -1;
+  }
+
+  if(h2_fill(h2, H2_FRAME_HEADER_SIZE + len))
+    return -1;
+
+  p = h2->h2_rbuf + h2->h2_rbuf_off + H2_FRAME_HEADER_SIZE;
+  h2->h2_rbuf_off += H2_FRAME_HEADER_SIZE + len;
+
+  if(h2->h2_hblock_id != 0 &&
+     (type != H2_FRAME_CONTINUATION || id != h2->h2_hblock_id)) {
+    h2_fail(h2, H2_PROTOCOL_ERROR);
+    return -1;
+  }
+
+  switch(type) {
+  case H2_FRAME_DATA:
+    h2_recv_data(h2, flags, id, p, len);
+    break;
+
+  case H2_FRAME_HEADERS:
+    h2_recv_headers(h2, flags, id, p, len);
+    break;
+
+  case H2_FRAME_CONTINUATION:
+    if(h2->h2_hblock_id == 0) {
+      h2_fail(h2, H2_PROTOCOL_ERROR);
+      break;
+    }
+    h2_header_block_append(h2, p, len);
+    if(flags & H2_FLAG_END_HEADERS && !h2->h2_closed)
+      h2_header_block_done(h2);
+    break;
+
+  case H2_FRAME_PRIORITY:
+    if(len != 5)
+      h2_fail(h2, H2_FRAME_SIZE_ERROR);
+    break;
+
+  case H2_FRAME_RST_STREAM:
+    h2_recv_rst_stream(h2, id, len);
+    break;
+
+  case H2_FRAME_SETTINGS:
+    h2_recv_settings(h2, flags, id, p, len);
+    break;
+
+  case H2_FRAME_PUSH_PROMISE:
+    h2_fail(h2, H2_PROTOCOL_ERROR);
+    break;
+
+  case H2_FRAME_PING:
+    if(len != 8 || id != 0)
+      h2_fail(h2, len != 8 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+    else if(!(flags & H2_FLAG_ACK))
+      h2_send_frame(h2, H2_FRAME_PING, H2_FLAG_ACK, 0, p, 8);
+    break;
+
+  case H2_FRAME_GOAWAY:
+    if(len < 8 || id != 0)
+      h2_fail(h2, len < 8 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+    else
+      h2->h2_goaway = 1;
+    break;
+
+  case H2_FRAME_WINDOW_UPDATE:
+    h2_recv_window_update(h2, id, p, len);
+    break;
+
+  default:
+    break; // Unknown frames must be ignored
+  }
+
+  return h2->h2_closed ? -1 : 0;
+}
+
+
+/**
+ * Frame queued response body as DATA. If the peer's window is
+ * exhausted we keep reading frames until it opens up again
+ */
+static int
+h2_send_data(http2_session_t *h2, h2_stream_t *hs, htsbuf_queue_t *hq,
+             int end_stream)
+{
+  int64_t n;
+  int flags;
+
+  while(hq->hq_size > 0) {
+
+    if(hs->hs_reset || h2->h2_closed) {
+      htsbuf_queue_flush(hq);
+      return -1;
+    }
+
+    n = MIN(hq->hq_size, H2_FRAME_SIZE);
+    n = MIN(n, h2->h2_send_window);
+    n = MIN(n, hs->hs_send_window);
+
+    if(n <= 0) {
+      h2_read_frame(h2);
+      continue;
+    }
+
+    flags = end_stream && n == hq->hq_size ? H2_FLAG_END_STREAM : 0;
+    h2_frame_header(&h2->h2_out, n, H2_FRAME_DATA, flags, hs->hs_id);
+    h2_output_move(h2, hq, n);
+    h2->h2_send_window -= n;
+    hs->hs_send_window -= n;
+
+    if(h2->h2_out.hq_size >= H2_OUTPUT_FLUSH && h2_flush(h2))
+      return -1;
+
+    if(flags)
+      return 0;
+  }
+
+  if(end_stream)
+    h2_frame_header(&h2->h2_out, 0, H2_FRAME_DATA, H2_FLAG_END_STREAM,
+                    hs->hs_id);
+  return 0;
+}
+
+
+/**
+ * Called from http_output_flush() for a stream
+ */
+int
+http2_output_flush(http_connection_t *hc)
+{
+  http2_session_t *h2 = hc->hc_h2;
+  h2_stream_t *hs = h2->h2_active;
+
+  if(hs == NULL || hs->hs_reset || !hs->hs_headers_sent) {
+    htsbuf_queue_flush(&hc->hc_output);
+    return -1;
+  }
+
+  if(h2_send_data(h2, hs, &hc->hc_output, 0))
+    return -1;
+  return h2_flush(h2);
+}
+
+
+/**
+ * Lower case a header name into buf, returns NULL for headers that are
+ * specific to HTTP/1 connections (RFC 7540 8.1.2.2)
+ */
+static const char *
+h2_header_name(char *buf, size_t size, const char *name)
+{
+  size_t i;
+
+  for(i = 0; name[i] && i < size - 1; i++)
+    buf[i] = name[i] >= 'A' && name[i] <= 'Z' ? name[i] + 32 : name[i];
+  buf[i] = 0;
+
+  if(!strcmp(buf, "connection") || !strcmp(buf, "keep-alive") ||
+     !strcmp(buf, "proxy-connection") || !strcmp(buf, "transfer-encoding") ||
+     !strcmp(buf, "upgrade"))
+    return NULL;
+  return buf;
+}
+
+
+/**
+ * http_send_header() for streams, same set of headers as for HTTP/1
+ * minus the connection specific ones
+ */
+int
+http2_send_header(http_connection_t *hc, int rc, const char *content,
+                  int64_t contentlen, const char *encoding,
+                  const char *location, int maxage, const char *range,
+                  const char *disposition)
+{
+  http2_session_t *h2 = hc->hc_h2;
+  h2_stream_t *hs = h2->h2_active;
+  hpack_table_t *ht = &h2->h2_enc;
+  htsbuf_queue_t hq;
+  time_t now = time(NULL);
+  char buf[64];
+  http_arg_t *ra;
+
+  if(hs == NULL || hs->hs_reset || hs->hs_headers_sent)
+    return -1;
+
+  htsbuf_queue_init(&hq, 0);
+
+  snprintf(buf, sizeof(buf), "%d", rc);
+  hpack_encode(ht, &hq, ":status", buf, 0);
+  hpack_encode(ht, &hq, "server", "doozer2", 0);
+  hpack_encode(ht, &hq, "date", time_to_http_date(now), HPACK_NO_INDEX);
+
+  if(maxage == 0) {
+    hpack_encode(ht, &hq, "cache-control", "no-cache", 0);
+  } else {
+    hpack_encode(ht, &hq, "last-modified", time_to_http_date(now),
+                 HPACK_NO_INDEX);
+    hpack_encode(ht, &hq, "expires", time_to_http_date(now + maxage),
+                 HPACK_NO_INDEX);
+    snprintf(buf, sizeof(buf), "max-age=%d", maxage);
+    hpack_encode(ht, &hq, "cache-control", buf, 0);
+  }
+
+  if(rc == HTTP_STATUS_UNAUTHORIZED)
+    hpack_encode(ht, &hq, "www-authenticate", "Basic realm=\"doozer\"", 0);
+
+  if(rc != HTTP_STATUS_NOT_MODIFIED && contentlen >= 0) {
+    snprintf(buf, sizeof(buf), "%"PRId64, contentlen);
+    hpack_encode(ht, &hq, "content-length", buf, HPACK_NO_INDEX);
+  }
+
+  if(encoding != NULL)
+    hpack_encode(ht, &hq, "content-encoding", encoding, 0);
+
+  if(location != NULL)
+    hpack_encode(ht, &hq, "location", location, HPACK_NO_INDEX);
+
+  if(content != NULL)
+    hpack_encode(ht, &hq, "content-type", content, 0);
+
+  if(range) {
+    hpack_encode(ht, &hq, "accept-ranges", "bytes", 0);
+    hpack_encode(ht, &hq, "content-range", range, HPACK_NO_INDEX);
+  }
+
+  if(disposition != NULL)
+    hpack_encode(ht, &hq, "content-disposition", disposition, 0);
+
+  HTTP_ARG_FOREACH(ra, &hc->hc_response_headers) {
+    const char *name = h2_header_name(buf, sizeof(buf), ra->key);
+    if(name != NULL)
+      hpack_encode(ht, &hq, name, ra->val, 0);
+  }
+
+  h2_send_header_block(h2, hs->hs_id, &hq, 0);
+  hs->hs_headers_sent = 1;
+  return 0;
+}
+
+
+/**
+ * http_body_read() for streams. Frames are read off the connection
+ * until there is body for the stream being served, the peer gets
+ * window back as the handler consumes it
+ */
+int
+http2_body_read(http_connection_t *hc, void *buf, size_t len)
+{
+  http2_session_t *h2 = hc->hc_h2;
+  h2_stream_t *hs = h2->h2_active;
+  int n;
+
+  if(hs == NULL)
+    return -1;
+
+  while(hs->hs_body.hq_size == 0 && !hs->hs_end_stream &&
+        !hs->hs_reset && !h2->h2_closed)
+    h2_read_frame(h2);
+
+  if(hs->hs_reset || h2->h2_closed)
+    return -1;
+
+  n = htsbuf_read(&hs->hs_body, buf, MIN(len, INT_MAX));
+  h2_stream_credit(h2, hs, n);
+  return n;
+}
+
+
+/**
+ * Without a content-length the whole body must be in before the
+ * request is dispatched, so that one can be made up. It's collected
+ * here rather than while the stream waits, only the stream being
+ * served may hold more than a window of body. Returns a status if the
+ * route's limit is exceeded
+ */
+static int
+h2_stream_collect(http2_session_t *h2, h2_stream_t *hs)
+{
+  int64_t credited = 0;
+
+  while(!hs->hs_end_stream && !hs->hs_reset && !h2->h2_closed) {
+    if(hs->hs_body_len > hs->hs_max_body)
+      return HTTP_STATUS_PAYLOAD_TOO_LARGE;
+    h2_stream_credit(h2, hs, hs->hs_body_len - credited);
+    credited = hs->hs_body_len;
+    h2_read_frame(h2);
+  }
+  return hs->hs_body_len > hs->hs_max_body ?
+    HTTP_STATUS_PAYLOAD_TOO_LARGE : 0;
+}
+
+
+/**
+ * Hand a request to the regular dispatch, the body is read from the
+ * stream as the handler asks for it
+ */
+static void
+h2_stream_serve(http2_session_t *h2, h2_stream_t *hs)
+{
+  static char hdr_host[] = "host";
+  static char hdr_content_length[] = "content-length";
+  http_connection_t *hc = &h2->h2_shc;
+  http_parser_t *hps = &hc->hc_parser;
+  char *p, *end, *name, *value, *method = NULL, *path = NULL;
+  char clbuf[24];
+  int status = 0, r;
+
+  TAILQ_REMOVE(&h2->h2_ready, hs, hs_ready_link);
+  hs->hs_state = H2_STREAM_ACTIVE;
+  h2->h2_active = hs;
+
+  http_parser_init(hps);
+  hps->hps_version = HTTP_VERSION_2;
+
+  p = hs->hs_hdrs;
+  end = p + hs->hs_hdrs_len;
+  while(!h2_header_next(&p, end, &name, &value)) {
+    if(name[0] == ':') {
+      if(!strcmp(name, ":method"))
+        method = value;
+      else if(!strcmp(name, ":path"))
+        path = value;
+      else if(!strcmp(name, ":authority") &&
+              http_parser_add_header(hps, hdr_host, 4, value, strlen(value)))
+        status = HTTP_STATUS_HEADER_TOO_LARGE;
+      continue;
+    }
+    if(http_parser_add_header(hps, name, strlen(name), value, strlen(value)))
+      status = HTTP_STATUS_HEADER_TOO_LARGE;
+  }
+
+  if(method == NULL || path == NULL || *path == 0)
+    status = HTTP_STATUS_BAD_REQUEST;
+  else if((hps->hps_cmd = http_method_lookup(method, strlen(method))) == -1)
+    status = HTTP_STATUS_NOT_IMPLEMENTED;
+  hps->hps_path = path;
+
+  if(hs->hs_content_length < 0 && !status &&
+     (hps->hps_cmd == HTTP_CMD_POST || hps->hps_cmd == HTTP_CMD_PUT)) {
+    status = h2_stream_collect(h2, hs);
+    snprintf(clbuf, sizeof(clbuf), "%"PRId64, hs->hs_body_len);
+    if(!status && http_parser_add_header(hps, hdr_content_length, 14,
+                                         clbuf, strlen(clbuf)))
+      status = HTTP_STATUS_HEADER_TOO_LARGE;
+  }
+
+  if(hs->hs_reset || h2->h2_closed) {
+    // Gone while the body was collected
+  } else if(status) {
+    h2_send_status(h2, hs, status);
+  } else {
+    r = http_serve_request(hc);
+
+    if(hs->hs_reset || h2->h2_closed) {
+      htsbuf_queue_flush(&hc->hc_output);
+    } else if(r || !hs->hs_headers_sent) {
+      // Handler failed halfway or never replied
+      htsbuf_queue_flush(&hc->hc_output);
+      h2_send_rst(h2, hs->hs_id, H2_INTERNAL_ERROR);
+    } else if(!h2_send_data(h2, hs, &hc->hc_output, 1) &&
+              !hs->hs_end_stream) {
+      // Reply is complete, the rest of the body is not wanted
+      h2_send_rst(h2, hs->hs_id, H2_NO_ERROR);
+    }
+  }
+
+  h2->h2_active = NULL;
+  h2_stream_destroy(h2, hs);
+}
+
+
+/**
+ *
+ */
+static const char *
+h2_method_name(int cmd)
+{
+  switch(cmd) {
+  case HTTP_CMD_GET:    return "GET";
+  case HTTP_CMD_HEAD:   return "HEAD";
+  case HTTP_CMD_DELETE: return "DELETE";
+  default:              return NULL;
+  }
+}
+
+
+/**
+ * h2c upgrade (RFC 7540 3.2). Only for requests without a body, they
+ * would have to be read as HTTP/1 first
+ */
+int
+http2_upgrade_ok(http_connection_t *hc)
+{
+  const char *v = http_header_get(hc, HTTP_HDR_UPGRADE);
+
+  if(v == NULL || !http_token_match(v, "h2c") || !http2_config()->enabled)
+    return 0;
+
+  if(http_arg_get(&hc->hc_args, "HTTP2-Settings") == NULL ||
+     h2_method_name(hc->hc_cmd) == NULL)
+    return 0;
+
+  v = http_header_get(hc, HTTP_HDR_CONTENT_LENGTH);
+  if((v != NULL && strcmp(v, "0")) ||
+     http_header_get(hc, HTTP_HDR_TRANSFER_ENCODING) != NULL)
+    return 0;
+  return 1;
+}
+
+
+/**
+ * The request that asked for the upgrade is answered on stream 1
+ */
+static int
+h2_upgrade(http2_session_t *h2, http_connection_t *hc)
+{
+  http_parser_t *hps = &hc->hc_parser;
+  const char *method = h2_method_name(hc->hc_cmd);
+  char *s = mystrdupa(http_arg_get(&hc->hc_args, "HTTP2-Settings"));
+  uint8_t settings[256];
+  h2_stream_t *hs;
+  int i, len;
+
+  for(i = 0; s[i]; i++) {
+    if(s[i] == '-')
+      s[i] = '+';
+    else if(s[i] == '_')
+      s[i] = '/';
+  }
+
+  if((len = base64_decode(settings, s, sizeof(settings))) < 0 ||
+     len % 6 || h2_apply_settings(h2, settings, len))
+    return -1;
+
+  HTSBUF_APPEND_CONST(&h2->h2_out,
+                      "HTTP/1.1 101 Switching Protocols\r\n"
+                      "Connection: Upgrade\r\n"
+                      "Upgrade: h2c\r\n\r\n");
+
+  hs = h2_stream_create(h2, 1);
+  h2_header_collect(hs, ":method", 7, method, strlen(method));
+  h2_header_collect(hs, ":path", 5, hc->hc_path, strlen(hc->hc_path));
+
+  for(i = 0; i < hps->hps_num_headers; i++) {
+    const http_header_t *hh = &hps->hps_headers[i];
+    char name[64];
+
+    if(h2_header_name(name, sizeof(name), hh->hh_name) == NULL ||
+       !strcmp(name, "http2-settings"))
+      continue;
+    h2_header_collect(hs, name, strlen(name), hh->hh_value, hh->hh_value_len);
+  }
+
+  hs->hs_end_stream = 1;
+  LIST_INSERT_HEAD(&h2->h2_streams, hs, hs_link);
+  h2->h2_num_streams++;
+  h2->h2_last_id = 1;
+  h2_stream_ready(h2, hs);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+h2_send_settings(http2_session_t *h2)
+{
+  uint8_t b[18];
+  const uint32_t v[3][2] = {
+    { H2_SETTINGS_MAX_CONCURRENT_STREAMS, h2->h2_max_streams },
+    { H2_SETTINGS_INITIAL_WINDOW_SIZE,    h2->h2_window },
+    { H2_SETTINGS_MAX_HEADER_LIST_SIZE,   h2->h2_max_header_list },
+  };
+
+  for(int i = 0; i < 3; i++) {
+    b[i * 6 + 0] = v[i][0] >> 8;
+    b[i * 6 + 1] = v[i][0];
+    b[i * 6 + 2] = v[i][1] >> 24;
+    b[i * 6 + 3] = v[i][1] >> 16;
+    b[i * 6 + 4] = v[i][1] >> 8;
+    b[i * 6 + 5] = v[i][1];
+  }
+  h2_send_frame(h2, H2_FRAME_SETTINGS, 0, 0, b, sizeof(b));
+
+  // Connection window can only be raised with an update
+  if(h2->h2_window > H2_DEFAULT_WINDOW)
+    h2_send_u32(h2, H2_FRAME_WINDOW_UPDATE, 0,
+                h2->h2_window - H2_DEFAULT_WINDOW);
+}
+
+
+/**
+ *
+ */
+int
+http2_serve(http_connection_t *hc, int upgrade)
+{
+  const http2_config_t *conf = http2_config();
+  http2_session_t *h2;
+  h2_stream_t *hs;
+  const char *preface;
+  int len;
+
+  hc->hc_keep_alive = 0;
+
+  if(!conf->enabled || http_output_flush(hc))
+    return 1;
+
+  h2 = calloc(1, sizeof(http2_session_t));
+  h2->h2_hc = hc;
+  h2->h2_window = conf->window_size;
+  h2->h2_max_streams = conf->max_streams;
+  h2->h2_max_header_list = conf->max_header_list;
+  h2->h2_send_window = H2_DEFAULT_WINDOW;
+  h2->h2_peer_window = H2_DEFAULT_WINDOW;
+
+  htsbuf_queue_init(&h2->h2_out, 0);
+  hpack_table_init(&h2->h2_dec, HPACK_DEFAULT_TABLE_SIZE);
+  hpack_table_init(&h2->h2_enc, HPACK_DEFAULT_TABLE_SIZE);
+  LIST_INIT(&h2->h2_streams);
+  TAILQ_INIT(&h2->h2_ready);
+
+  http_connection_init(&h2->h2_shc, NULL, hc->hc_peer, hc->hc_self);
+  h2->h2_shc.hc_h2 = h2;
+
+  // Anything after the request in the receive buffer is ours
+  h2->h2_rbuf = malloc(H2_RBUF_SIZE);
+  len = hc->hc_rbuf_len - hc->hc_rbuf_used;
+  memcpy(h2->h2_rbuf, hc->hc_rbuf + hc->hc_rbuf_used, len);
+  h2->h2_rbuf_len = len;
+  hc->hc_rbuf_used = hc->hc_rbuf_len;
+
+  if(upgrade && h2_upgrade(h2, hc))
+    h2->h2_closed = 1;
+
+  h2_send_settings(h2);
+
+  preface = upgrade ? h2_preface : h2_preface + H2_PREFACE_HTTP1_LEN;
+  len = strlen(preface);
+  if(!h2->h2_closed) {
+    if(h2_fill(h2, len) || memcmp(h2->h2_rbuf + h2->h2_rbuf_off, preface, len))
+      h2_fail(h2, H2_PROTOCOL_ERROR);
+    else
+      h2->h2_rbuf_off += len;
+  }
+
+  while(!h2->h2_closed) {
+    if((hs = TAILQ_FIRST(&h2->h2_ready)) != NULL) {
+      h2_stream_serve(h2, hs);
+      continue;
+    }
+
+    if(h2->h2_goaway && h2->h2_num_streams == 0)
+      break;
+
+    h2_read_frame(h2);
+  }
+
+  if(!h2->h2_io_error) {
+    uint8_t b[8] = {
+      h2->h2_last_id >> 24, h2->h2_last_id >> 16,
+      h2->h2_last_id >> 8, h2->h2_last_id,
+      h2->h2_error >> 24, h2->h2_error >> 16, h2->h2_error >> 8, h2->h2_error
+    };
+    h2_send_frame(h2, H2_FRAME_GOAWAY, 0, 0, b, sizeof(b));
+    h2_flush(h2);
+  }
+
+  while((hs = LIST_FIRST(&h2->h2_streams)) != NULL)
+    h2_stream_destroy(h2, hs);
+
+  h2->h2_shc.hc_h2 = NULL;
+  http_connection_destroy(&h2->h2_shc);
+
+  htsbuf_queue_flush(&h2->h2_out);
+  hpack_table_destroy(&h2->h2_dec);
+  hpack_table_destroy(&h2->h2_enc);
+  free(h2->h2_hblock);
+  free(h2->h2_rbuf);
+  free(h2);
+  return 1;
+}
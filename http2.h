@@ -0,0 +1,60 @@
+/*
+ *  HTTP/2 for the HTTP server
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "http.h"
+
+/**
+ * Take over a connection. Entered either after "PRI * HTTP/2.0" has
+ * been parsed (prior knowledge) or with upgrade set, when the current
+ * request asked for h2c and becomes stream 1.
+ *
+ * Always returns 1, the connection is done when this returns
+ */
+int http2_serve(http_connection_t *hc, int upgrade);
+
+int http2_upgrade_ok(http_connection_t *hc);
+
+int http2_send_header(http_connection_t *hc, int rc, const char *content,
+                      int64_t contentlen, const char *encoding,
+                      const char *location, int maxage, const char *range,
+                      const char *disposition);
+
+int http2_output_flush(http_connection_t *hc);
+
+int http2_body_read(http_connection_t *hc, void *buf, size_t len);
+
+
+/**
+ * Provided by http.c, each stream is served as a request on a
+ * connection without a socket
+ */
+void http_connection_init(http_connection_t *hc, tcp_stream_t *ts,
+                          struct sockaddr_in *peer, struct sockaddr_in *self);
+
+void http_connection_destroy(http_connection_t *hc);
+
+int http_serve_request(http_connection_t *hc);
+
+int64_t http_idle_deadline(void);
+
+/**
+ * Body limit of the route for path, its flags are stored in *flags
+ */
+int64_t http_route_body_limit(const char *path, int *flags);
@@ -0,0 +1,428 @@
+/*
+ *  HTTP access log
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <arpa/inet.h>
+
+#include "queue.h"
+#include "misc.h"
+#include "trace.h"
+#include "cfg.h"
+#include "http_accesslog.h"
+
+/**
+ * Each thread that serves requests formats its log lines into a ring
+ * of its own. The ring has a single producer (the owning thread) and a
+ * single consumer (the writer thread) so neither side takes a lock.
+ * The writer wakes up every http.accessLog.flushInterval ms, moves
+ * whatever is in the rings to the file and rotates it when it grows
+ * past http.accessLog.maxSize. Lines that don't fit in a full ring are
+ * dropped and counted rather than stalling the request
+ *
+ * http.accessLog.sample = N logs one in N successful requests, client
+ * and server errors are always logged
+ */
+
+#define ACCESSLOG_RING_SIZE (64 * 1024) // Power of two
+#define ACCESSLOG_LINE_MAX  2048
+
+typedef struct accesslog_ring {
+  LIST_ENTRY(accesslog_ring) alr_link;
+  struct accesslog_ring *alr_next; // On accesslog_new
+  int alr_dead;                    // Owning thread has exited
+  unsigned int alr_seq;
+  unsigned int alr_dropped;
+  unsigned int alr_dropped_reported;
+  size_t alr_head;  // Written by producer
+  size_t alr_tail;  // Written by consumer
+  char alr_buf[ACCESSLOG_RING_SIZE];
+} accesslog_ring_t;
+
+typedef struct accesslog_config {
+  char path[256];
+  int sample;
+  int rotate;
+  int flush_interval;
+  int64_t max_size;
+} accesslog_config_t;
+
+static void
+accesslog_config_fill(void *opaque, cfg_t *cr)
+{
+  accesslog_config_t *c = opaque;
+  snprintf(c->path, sizeof(c->path), "%s",
+           cfg_get_str(cr, CFG("http", "accessLog", "path"), ""));
+  c->sample =
+    MAX(cfg_get_int(cr, CFG("http", "accessLog", "sample"), 1), 1);
+  c->rotate =
+    MAX(cfg_get_int(cr, CFG("http", "accessLog", "rotate"), 5), 0);
+  c->flush_interval =
+    MAX(cfg_get_int(cr, CFG("http", "accessLog", "flushInterval"), 250), 10);
+  c->max_size =
+    cfg_get_s64(cr, CFG("http", "accessLog", "maxSize"), 100 * 1024 * 1024);
+}
+
+CFG_VIEW(accesslog_config_t, accesslog_config, accesslog_config_fill);
+
+static pthread_once_t accesslog_once = PTHREAD_ONCE_INIT;
+static pthread_key_t accesslog_key;
+static __thread accesslog_ring_t *accesslog_ring;
+
+// Rings not yet picked up by the writer, pushed without locking
+static accesslog_ring_t *accesslog_new;
+
+// Only touched by the writer thread
+static LIST_HEAD(, accesslog_ring) accesslog_rings;
+static int accesslog_fd = -1;
+static char accesslog_path[PATH_MAX];
+static ino_t accesslog_ino;
+static int64_t accesslog_size;
+
+
+/**
+ *
+ */
+static void
+accesslog_open(const char *path)
+{
+  struct stat st;
+
+  if(accesslog_fd != -1)
+    close(accesslog_fd);
+
+  snprintf(accesslog_path, sizeof(accesslog_path), "%s", path);
+  accesslog_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if(accesslog_fd == -1 || fstat(accesslog_fd, &st)) {
+    trace(LOG_ERR, "accesslog: Unable to open %s -- %s",
+          path, strerror(errno));
+    accesslog_size = 0;
+    return;
+  }
+  accesslog_ino = st.st_ino;
+  accesslog_size = st.st_size;
+}
+
+
+/**
+ * path -> path.1 -> path.2 ... up to http.accessLog.rotate files
+ */
+static void
+accesslog_rotate(const accesslog_config_t *conf)
+{
+  char from[PATH_MAX], to[PATH_MAX];
+  int i;
+
+  if(conf->rotate == 0) {
+    if(accesslog_fd != -1 && ftruncate(accesslog_fd, 0) == 0)
+      accesslog_size = 0;
+    return;
+  }
+
+  for(i = conf->rotate - 1; i > 0; i--) {
+    snprintf(from, sizeof(from), "%s.%d", conf->path, i);
+    snprintf(to, sizeof(to), "%s.%d", conf->path, i + 1);
+    rename(from, to);
+  }
+  snprintf(to, sizeof(to), "%s.1", conf->path);
+  rename(conf->path, to);
+  accesslog_open(conf->path);
+}
+
+
+/**
+ *
+ */
+static void
+accesslog_write(const char *data, size_t len)
+{
+  ssize_t r;
+
+  while(len > 0 && accesslog_fd != -1) {
+    if((r = write(accesslog_fd, data, len)) < 0) {
+      if(errno == EINTR)
+        continue;
+      trace(LOG_ERR, "accesslog: Write to %s failed -- %s",
+            accesslog_path, strerror(errno));
+      return;
+    }
+    data += r;
+    len -= r;
+    accesslog_size += r;
+  }
+}
+
+
+/**
+ * Move everything in a ring to the file
+ */
+static void
+accesslog_drain(accesslog_ring_t *alr)
+{
+  size_t head = __atomic_load_n(&alr->alr_head, __ATOMIC_ACQUIRE);
+  size_t tail = alr->alr_tail;
+  size_t off = tail & (ACCESSLOG_RING_SIZE - 1);
+  size_t len = head - tail;
+  size_t n = MIN(len, ACCESSLOG_RING_SIZE - off);
+
+  if(len == 0)
+    return;
+
+  accesslog_write(alr->alr_buf + off, n);
+  accesslog_write(alr->alr_buf, len - n);
+  __atomic_store_n(&alr->alr_tail, head, __ATOMIC_RELEASE);
+}
+
+
+/**
+ *
+ */
+static void *
+accesslog_thread(void *aux)
+{
+  accesslog_ring_t *alr, *next;
+  unsigned int dropped;
+  struct stat st;
+
+  while(1) {
+    const accesslog_config_t *conf = accesslog_config();
+
+    usleep(conf->flush_interval * 1000);
+
+    alr = __atomic_exchange_n(&accesslog_new, NULL, __ATOMIC_ACQUIRE);
+    for(; alr != NULL; alr = next) {
+      next = alr->alr_next;
+      LIST_INSERT_HEAD(&accesslog_rings, alr, alr_link);
+    }
+
+    if(!conf->path[0]) {
+      // Turned off, rings are still drained so they can be freed
+      if(accesslog_fd != -1)
+        close(accesslog_fd);
+      accesslog_fd = -1;
+      accesslog_path[0] = 0;
+    } else if(strcmp(conf->path, accesslog_path) || accesslog_fd == -1 ||
+              stat(conf->path, &st) || st.st_ino != accesslog_ino) {
+      // Path changed or the file was moved away under us
+      accesslog_open(conf->path);
+    }
+
+    dropped = 0;
+    for(alr = LIST_FIRST(&accesslog_rings); alr != NULL; alr = next) {
+      next = LIST_NEXT(alr, alr_link);
+
+      int dead = __atomic_load_n(&alr->alr_dead, __ATOMIC_ACQUIRE);
+      unsigned int d = __atomic_load_n(&alr->alr_dropped, __ATOMIC_RELAXED);
+
+      dropped += d - alr->alr_dropped_reported;
+      alr->alr_dropped_reported = d;
+
+      accesslog_drain(alr);
+
+      if(dead) {
+        LIST_REMOVE(alr, alr_link);
+        free(alr);
+      }
+    }
+
+    if(dropped)
+      trace(LOG_WARNING, "accesslog: %u entries dropped, writer behind",
+            dropped);
+
+    if(accesslog_fd != -1 && conf->max_size > 0 &&
+       accesslog_size >= conf->max_size)
+      accesslog_rotate(conf);
+  }
+  return NULL;
+}
+
+
+/**
+ * Thread is exiting, the writer frees the ring once it's drained
+ */
+static void
+accesslog_ring_release(void *aux)
+{
+  accesslog_ring_t *alr = aux;
+  __atomic_store_n(&alr->alr_dead, 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ *
+ */
+static void
+accesslog_init(void)
+{
+  pthread_t tid;
+  pthread_attr_t attr;
+
+  pthread_key_create(&accesslog_key, accesslog_ring_release);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&tid, &attr, accesslog_thread, NULL);
+  pthread_attr_destroy(&attr);
+}
+
+
+/**
+ *
+ */
+static accesslog_ring_t *
+accesslog_ring_create(void)
+{
+  accesslog_ring_t *alr = calloc(1, sizeof(accesslog_ring_t));
+
+  pthread_once(&accesslog_once, accesslog_init);
+  pthread_setspecific(accesslog_key, alr);
+
+  alr->alr_next = __atomic_load_n(&accesslog_new, __ATOMIC_RELAXED);
+  while(!__atomic_compare_exchange_n(&accesslog_new, &alr->alr_next, alr,
+                                     1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  return accesslog_ring = alr;
+}
+
+
+/**
+ *
+ */
+static void
+accesslog_ring_put(accesslog_ring_t *alr, const char *data, size_t len)
+{
+  size_t head = alr->alr_head;
+  size_t tail = __atomic_load_n(&alr->alr_tail, __ATOMIC_ACQUIRE);
+  size_t off = head & (ACCESSLOG_RING_SIZE - 1);
+  size_t n = MIN(len, ACCESSLOG_RING_SIZE - off);
+
+  if(ACCESSLOG_RING_SIZE - (head - tail) < len) {
+    __atomic_store_n(&alr->alr_dropped, alr->alr_dropped + 1,
+                     __ATOMIC_RELAXED);
+    return;
+  }
+
+  memcpy(alr->alr_buf + off, data, n);
+  memcpy(alr->alr_buf, data + n, len - n);
+  __atomic_store_n(&alr->alr_head, head + len, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * JSON string contents, stops short of the end of the buffer
+ */
+static int
+accesslog_escape(char *dst, int size, const char *s)
+{
+  static const char hex[] = "0123456789abcdef";
+  int len = 0;
+
+  for(; *s && len < size - 6; s++) {
+    uint8_t c = *s;
+    if(c == '"' || c == '\\') {
+      dst[len++] = '\\';
+      dst[len++] = c;
+    } else if(c < 0x20 || c > 0x7e) {
+      memcpy(dst + len, "\\u00", 4);
+      dst[len + 4] = hex[c >> 4];
+      dst[len + 5] = hex[c & 0xf];
+      len += 6;
+    } else {
+      dst[len++] = c;
+    }
+  }
+  return len;
+}
+
+
+/**
+ * Timestamp prefix is only formatted once per second and thread
+ */
+static const char *
+accesslog_time(int64_t ts)
+{
+  static __thread char buf[32];
+  static __thread time_t last;
+  time_t sec = ts / 1000000;
+  struct tm tm;
+
+  if(sec != last) {
+    last = sec;
+    gmtime_r(&sec, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+  }
+  return buf;
+}
+
+
+/**
+ *
+ */
+void
+http_accesslog(http_connection_t *hc)
+{
+  const accesslog_config_t *conf = accesslog_config();
+  accesslog_ring_t *alr;
+  char line[ACCESSLOG_LINE_MAX];
+  char peer[INET_ADDRSTRLEN] = "-";
+  int64_t now;
+  int len;
+
+  if(!conf->path[0] || hc->hc_status == 0)
+    return;
+
+  if((alr = accesslog_ring) == NULL)
+    alr = accesslog_ring_create();
+
+  if(conf->sample > 1 && hc->hc_status < 400 &&
+     ++alr->alr_seq % conf->sample)
+    return;
+
+  now = get_ts();
+  if(hc->hc_peer != NULL)
+    inet_ntop(AF_INET, &hc->hc_peer->sin_addr, peer, sizeof(peer));
+
+  len = snprintf(line, sizeof(line),
+                 "{\"time\":\"%s.%03dZ\",\"peer\":\"%s\",\"method\":\"%s\","
+                 "\"path\":\"",
+                 accesslog_time(now), (int)(now % 1000000) / 1000, peer,
+                 http_cmd2str(hc->hc_cmd));
+
+  len += accesslog_escape(line + len, sizeof(line) - len - 256,
+                          hc->hc_path_orig ?: "");
+
+  len += snprintf(line + len, sizeof(line) - len,
+                  "\",\"status\":%d,\"bytes\":%"PRId64",\"parse_us\":%"PRId64
+                  ",\"handler_us\":%"PRId64",\"write_us\":%"PRId64"}\n",
+                  hc->hc_status, hc->hc_bytes_out + hc->hc_output.hq_size,
+                  hc->hc_t_parsed - hc->hc_t_start,
+                  hc->hc_t_handled - hc->hc_t_parsed,
+                  hc->hc_write_time);
+
+  accesslog_ring_put(alr, line, len);
+}
@@ -0,0 +1,893 @@
+/*
+ *  Asynchronous HTTP/1.1 client
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/param.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "queue.h"
+#include "asyncio.h"
+#include "htsmsg_json.h"
+#include "cfg.h"
+#include "http_client.h"
+
+/**
+ * Requests are handed to the asyncio thread through http_client_incoming
+ * and from then on everything runs there without locking.
+ *
+ * Each host has a queue of requests waiting for a connection and a list
+ * of connections. A request is assigned to a connection and written to
+ * it as soon as the connection is established, responses are parsed
+ * straight from af_recvq and matched to requests in order.
+ *
+ * GET and HEAD requests that were sent but got no response before the
+ * connection went away (typically a keep-alive connection closed by the
+ * server) are retried once on another connection
+ */
+
+#define HTTP_CLIENT_MAX_HEADER 65536
+
+TAILQ_HEAD(http_client_req_queue, http_client_req);
+LIST_HEAD(http_client_conn_list, http_client_conn);
+LIST_HEAD(http_client_host_list, http_client_host);
+
+typedef enum {
+  HCP_STATUS,
+  HCP_HEADERS,
+  HCP_BODY,
+  HCP_UNTIL_CLOSE,
+  HCP_CHUNK_SIZE,
+  HCP_CHUNK_DATA,
+  HCP_CHUNK_END,
+  HCP_TRAILERS,
+} hcp_state_t;
+
+typedef struct http_client_host {
+  LIST_ENTRY(http_client_host) hch_link;
+  char *hch_name;
+  int hch_port;
+  int hch_num_conns;
+  struct http_client_conn_list hch_conns;
+  struct http_client_req_queue hch_pending;
+} http_client_host_t;
+
+typedef struct http_client_conn {
+  LIST_ENTRY(http_client_conn) hcc_link;
+  http_client_host_t *hcc_host;
+  async_fd_t *hcc_af;
+  int hcc_connected;
+  int hcc_depth;
+  int hcc_exclusive;  // A request that may not be pipelined is assigned
+  struct http_client_req_queue hcc_reqs;
+  asyncio_timer_t hcc_idle_timer;
+
+  // Response parser, for the first request in hcc_reqs
+  hcp_state_t hcc_state;
+  int hcc_keep_alive;
+  int hcc_chunked;
+  int64_t hcc_remain;
+  size_t hcc_header_size;
+} http_client_conn_t;
+
+struct http_client_req {
+  TAILQ_ENTRY(http_client_req) hcq_link;
+  char *hcq_method;
+  char *hcq_host;
+  int hcq_port;
+  char *hcq_path;
+  const char *hcq_errmsg;  // URL did not parse
+  htsbuf_queue_t hcq_headers;
+  char *hcq_body;
+  size_t hcq_body_len;
+  int hcq_idempotent;
+
+  int hcq_flags;
+  int hcq_timeout;
+  http_client_cb_t *hcq_cb;
+  void *hcq_opaque;
+  asyncio_timer_t hcq_timer;
+
+  http_client_conn_t *hcq_conn;
+  int hcq_sent;
+  int hcq_started;  // Some of the response has arrived
+  int hcq_retried;
+
+  http_client_response_t hcq_response;
+  size_t hcq_body_size;
+};
+
+
+typedef struct http_client_config {
+  int max_connections;
+  int pipeline_depth;
+  int idle_timeout;
+  int64_t max_body_size;
+} http_client_config_t;
+
+static void
+http_client_config_fill(void *opaque, cfg_t *cr)
+{
+  http_client_config_t *c = opaque;
+  c->max_connections =
+    MAX(cfg_get_int(cr, CFG("http", "client", "maxConnections"), 8), 1);
+  c->pipeline_depth =
+    MAX(cfg_get_int(cr, CFG("http", "client", "pipelineDepth"), 4), 1);
+  c->idle_timeout =
+    MAX(cfg_get_int(cr, CFG("http", "client", "idleTimeout"), 30), 1);
+  c->max_body_size =
+    cfg_get_s64(cr, CFG("http", "client", "maxBodySize"), 64 * 1024 * 1024);
+}
+
+CFG_VIEW(http_client_config_t, http_client_config, http_client_config_fill);
+
+static pthread_once_t http_client_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t http_client_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct http_client_req_queue http_client_incoming;
+static int http_client_worker_id;
+
+// Only touched on the asyncio thread
+static struct http_client_host_list http_client_hosts;
+
+static void hcc_dispatch(http_client_host_t *hch);
+
+
+/**
+ *
+ */
+http_client_req_t *
+http_client_req(const char *method, const char *url)
+{
+  http_client_req_t *hcq = calloc(1, sizeof(http_client_req_t));
+  const char *host, *path;
+  size_t hostlen;
+
+  hcq->hcq_method = strdup(method);
+  hcq->hcq_idempotent = !strcmp(method, "GET") || !strcmp(method, "HEAD");
+  htsbuf_queue_init(&hcq->hcq_headers, 0);
+
+  if(strncasecmp(url, "http://", 7)) {
+    hcq->hcq_errmsg = "Only http:// URLs are supported";
+    return hcq;
+  }
+
+  host = url + 7;
+  hostlen = strcspn(host, ":/?");
+  path = host + hostlen;
+  hcq->hcq_port = 80;
+
+  if(*path == ':') {
+    hcq->hcq_port = atoi(path + 1);
+    path += strcspn(path, "/?");
+  }
+
+  if(hostlen == 0 || hcq->hcq_port <= 0 || hcq->hcq_port > 65535) {
+    hcq->hcq_errmsg = "Invalid URL";
+    return hcq;
+  }
+
+  hcq->hcq_host = strndup(host, hostlen);
+  if(*path == '/') {
+    hcq->hcq_path = strdup(path);
+  } else {
+    hcq->hcq_path = malloc(strlen(path) + 2);
+    sprintf(hcq->hcq_path, "/%s", path);
+  }
+  return hcq;
+}
+
+
+/**
+ *
+ */
+void
+http_client_req_header(http_client_req_t *hcq, const char *key,
+                       const char *value)
+{
+  htsbuf_qprintf(&hcq->hcq_headers, "%s: %s\r\n", key, value);
+}
+
+
+/**
+ *
+ */
+void
+http_client_req_body(http_client_req_t *hcq, const char *content_type,
+                     const void *data, size_t len)
+{
+  if(content_type != NULL)
+    http_client_req_header(hcq, "Content-Type", content_type);
+  free(hcq->hcq_body);
+  hcq->hcq_body = malloc(len);
+  memcpy(hcq->hcq_body, data, len);
+  hcq->hcq_body_len = len;
+}
+
+
+/**
+ *
+ */
+static void
+hcq_destroy(http_client_req_t *hcq)
+{
+  http_client_response_t *hcr = &hcq->hcq_response;
+
+  asyncio_timer_disarm(&hcq->hcq_timer);
+  free(hcq->hcq_method);
+  free(hcq->hcq_host);
+  free(hcq->hcq_path);
+  free(hcq->hcq_body);
+  htsbuf_queue_flush(&hcq->hcq_headers);
+  if(hcr->hcr_headers != NULL)
+    htsmsg_release(hcr->hcr_headers);
+  if(hcr->hcr_json != NULL)
+    htsmsg_release(hcr->hcr_json);
+  free(hcr->hcr_body);
+  free(hcq);
+}
+
+
+/**
+ * Hand the response (or errmsg) to the caller and free the request
+ */
+static void
+hcq_complete(http_client_req_t *hcq, const char *errmsg)
+{
+  http_client_response_t *hcr = &hcq->hcq_response;
+  char errbuf[256];
+
+  if(errmsg != NULL) {
+    hcr->hcr_status = 0;
+    hcr->hcr_errmsg = errmsg;
+  } else if(hcq->hcq_flags & HTTP_CLIENT_JSON) {
+    hcr->hcr_json = htsmsg_json_deserialize(hcr->hcr_body ?: "",
+                                            errbuf, sizeof(errbuf));
+    if(hcr->hcr_json == NULL)
+      hcr->hcr_errmsg = errbuf;
+  }
+
+  if(hcr->hcr_body == NULL)
+    hcr->hcr_body = strdup("");
+
+  hcq->hcq_cb(hcq->hcq_opaque, hcr);
+  hcq_destroy(hcq);
+}
+
+
+/**
+ *
+ */
+static void
+hcq_write(http_client_conn_t *hcc, http_client_req_t *hcq)
+{
+  htsbuf_queue_t q;
+  const int with_body =
+    hcq->hcq_body != NULL ||
+    !strcmp(hcq->hcq_method, "POST") || !strcmp(hcq->hcq_method, "PUT");
+
+  htsbuf_queue_init(&q, 0);
+  htsbuf_qprintf(&q, "%s %s HTTP/1.1\r\nHost: %s",
+                 hcq->hcq_method, hcq->hcq_path, hcq->hcq_host);
+  if(hcq->hcq_port != 80)
+    htsbuf_qprintf(&q, ":%d", hcq->hcq_port);
+  htsbuf_append(&q, "\r\n", 2);
+  htsbuf_appendq(&q, &hcq->hcq_headers);
+  if(with_body)
+    htsbuf_qprintf(&q, "Content-Length: %zu\r\n", hcq->hcq_body_len);
+  htsbuf_append(&q, "\r\n", 2);
+  if(hcq->hcq_body_len)
+    htsbuf_append(&q, hcq->hcq_body, hcq->hcq_body_len);
+
+  hcq->hcq_sent = 1;
+  asyncio_sendq(hcc->hcc_af, &q, 0);
+}
+
+
+/**
+ *
+ */
+static void
+hcc_parser_reset(http_client_conn_t *hcc)
+{
+  hcc->hcc_state = HCP_STATUS;
+  hcc->hcc_chunked = 0;
+  hcc->hcc_remain = 0;
+  hcc->hcc_header_size = 0;
+}
+
+
+/**
+ * Take a request off the connection, it's done or has failed
+ */
+static void
+hcc_unlink(http_client_conn_t *hcc, http_client_req_t *hcq)
+{
+  const http_client_config_t *conf = http_client_config();
+
+  TAILQ_REMOVE(&hcc->hcc_reqs, hcq, hcq_link);
+  hcq->hcq_conn = NULL;
+  hcc->hcc_depth--;
+  if(!hcq->hcq_idempotent)
+    hcc->hcc_exclusive = 0;
+
+  if(hcc->hcc_depth == 0)
+    asyncio_timer_arm(&hcc->hcc_idle_timer,
+                      asyncio_now() + conf->idle_timeout * 1000000LL);
+}
+
+
+/**
+ * Requests that never reached the server, or were idempotent and got no
+ * response, go back to the host queue. The rest fail
+ */
+static void
+hcc_destroy(http_client_conn_t *hcc, const char *errmsg, int retry)
+{
+  http_client_host_t *hch = hcc->hcc_host;
+  http_client_req_t *hcq;
+
+  if(hcc->hcc_af != NULL)
+    asyncio_close(hcc->hcc_af);
+
+  LIST_REMOVE(hcc, hcc_link);
+  hch->hch_num_conns--;
+
+  while((hcq = TAILQ_LAST(&hcc->hcc_reqs, http_client_req_queue)) != NULL) {
+    hcc_unlink(hcc, hcq);
+
+    if(retry && (!hcq->hcq_sent ||
+                 (hcq->hcq_idempotent && !hcq->hcq_started &&
+                  !hcq->hcq_retried))) {
+      hcq->hcq_retried |= hcq->hcq_sent;
+      hcq->hcq_sent = 0;
+      TAILQ_INSERT_HEAD(&hch->hch_pending, hcq, hcq_link);
+    } else {
+      hcq_complete(hcq, errmsg);
+    }
+  }
+
+  asyncio_timer_disarm(&hcc->hcc_idle_timer);
+  free(hcc);
+}
+
+
+/**
+ *
+ */
+static void
+hcc_idle_timeout(void *opaque)
+{
+  http_client_conn_t *hcc = opaque;
+  const http_client_config_t *conf = http_client_config();
+
+  if(!hcc->hcc_connected) {
+    // Can't abort a connect, it succeeds or fails within its timeout
+    asyncio_timer_arm(&hcc->hcc_idle_timer,
+                      asyncio_now() + conf->idle_timeout * 1000000LL);
+    return;
+  }
+  hcc_destroy(hcc, NULL, 0);
+}
+
+
+/**
+ *
+ */
+static int
+hcc_connected(void *opaque, const char *errmsg)
+{
+  http_client_conn_t *hcc = opaque;
+  http_client_host_t *hch = hcc->hcc_host;
+  http_client_req_t *hcq;
+
+  if(errmsg == NULL) {
+    hcc->hcc_connected = 1;
+    TAILQ_FOREACH(hcq, &hcc->hcc_reqs, hcq_link)
+      hcq_write(hcc, hcq);
+    return 0;
+  }
+
+  // The fd is released by asyncio when we return 0
+  hcc->hcc_af = NULL;
+  hcc_destroy(hcc, errmsg, 0);
+
+  // Don't let queued requests pile onto new connections that will fail
+  // the same way
+  while((hcq = TAILQ_FIRST(&hch->hch_pending)) != NULL) {
+    TAILQ_REMOVE(&hch->hch_pending, hcq, hcq_link);
+    hcq_complete(hcq, errmsg);
+  }
+  return 0;
+}
+
+
+/**
+ * Response to the first request is complete. Returns non-zero if the
+ * connection is gone
+ */
+static int
+hcc_response_done(http_client_conn_t *hcc)
+{
+  http_client_host_t *hch = hcc->hcc_host;
+  http_client_req_t *hcq = TAILQ_FIRST(&hcc->hcc_reqs);
+  const int keep_alive = hcc->hcc_keep_alive;
+
+  hcc_unlink(hcc, hcq);
+  hcc_parser_reset(hcc);
+  hcq_complete(hcq, NULL);
+
+  if(!keep_alive)
+    hcc_destroy(hcc, "Connection closed", 1);
+
+  hcc_dispatch(hch);
+  return !keep_alive;
+}
+
+
+/**
+ * Parse the status line or a header line. Returns -1 on errors
+ */
+static int
+hcc_parse_line(http_client_conn_t *hcc, http_client_req_t *hcq, char *line)
+{
+  http_client_response_t *hcr = &hcq->hcq_response;
+  char *v;
+
+  if(hcc->hcc_state == HCP_STATUS) {
+    if(strncmp(line, "HTTP/1.", 7) || strlen(line) < 12)
+      return -1;
+    hcr->hcr_status = atoi(line + 9);
+    hcc->hcc_keep_alive = line[7] == '1';
+    if(hcr->hcr_headers != NULL)
+      htsmsg_release(hcr->hcr_headers);
+    hcr->hcr_headers = htsmsg_create_map();
+    hcc->hcc_state = HCP_HEADERS;
+    return 0;
+  }
+
+  if((v = strchr(line, ':')) == NULL)
+    return -1;
+  *v++ = 0;
+  while(*v == ' ' || *v == '\t')
+    v++;
+  for(char *s = line; *s; s++)
+    *s = tolower((unsigned char)*s);
+
+  if(hcc->hcc_state == HCP_TRAILERS)
+    return 0;
+
+  htsmsg_add_str(hcr->hcr_headers, line, v);
+
+  if(!strcmp(line, "connection")) {
+    if(!strcasecmp(v, "close"))
+      hcc->hcc_keep_alive = 0;
+    else if(!strcasecmp(v, "keep-alive"))
+      hcc->hcc_keep_alive = 1;
+  } else if(!strcmp(line, "content-length")) {
+    hcc->hcc_remain = strtoll(v, NULL, 10);
+  } else if(!strcmp(line, "transfer-encoding")) {
+    // chunked is always the last coding
+    const size_t len = strlen(v);
+    hcc->hcc_chunked = len >= 7 && !strcasecmp(v + len - 7, "chunked");
+  }
+  return 0;
+}
+
+
+/**
+ * The empty line after the headers. Returns the state to continue in
+ */
+static hcp_state_t
+hcc_headers_done(http_client_conn_t *hcc, http_client_req_t *hcq)
+{
+  const int status = hcq->hcq_response.hcr_status;
+
+  if(status >= 100 && status < 200) {
+    // Interim response, the real one follows
+    hcc->hcc_remain = 0;
+    hcc->hcc_chunked = 0;
+    return HCP_STATUS;
+  }
+
+  if(!strcmp(hcq->hcq_method, "HEAD") || status == 204 || status == 304)
+    hcc->hcc_remain = 0;
+  else if(hcc->hcc_chunked)
+    return HCP_CHUNK_SIZE;
+  else if(htsmsg_get_str(hcq->hcq_response.hcr_headers,
+                         "content-length") == NULL) {
+    hcc->hcc_keep_alive = 0;
+    return HCP_UNTIL_CLOSE;
+  }
+  return HCP_BODY;
+}
+
+
+/**
+ * Move up to len bytes of body from the receive queue. Returns -1 if
+ * the body grows too large
+ */
+static int
+hcc_read_body(http_client_req_t *hcq, htsbuf_queue_t *q, size_t len)
+{
+  const http_client_config_t *conf = http_client_config();
+  http_client_response_t *hcr = &hcq->hcq_response;
+
+  len = MIN(len, q->hq_size);
+  if(hcr->hcr_body_len + len > conf->max_body_size)
+    return -1;
+
+  if(hcr->hcr_body_len + len + 1 > hcq->hcq_body_size) {
+    hcq->hcq_body_size = MAX(hcr->hcr_body_len + len + 1,
+                             hcq->hcq_body_size * 2);
+    hcr->hcr_body = realloc(hcr->hcr_body, hcq->hcq_body_size);
+  }
+  htsbuf_read(q, hcr->hcr_body + hcr->hcr_body_len, len);
+  hcr->hcr_body_len += len;
+  hcr->hcr_body[hcr->hcr_body_len] = 0;
+  return len;
+}
+
+
+/**
+ * Read a CRLF terminated line into buf. Returns 0 if it hasn't arrived
+ * yet, -1 if it's too long. Status, header and trailer lines together
+ * are bounded by HTTP_CLIENT_MAX_HEADER, chunk framing lines are not
+ */
+static int
+hcc_read_line(http_client_conn_t *hcc, htsbuf_queue_t *q,
+              char *buf, size_t size)
+{
+  int len = htsbuf_find(q, '\n');
+
+  if(len < 0)
+    return q->hq_size >= size ? -1 : 0;
+  if(len >= size)
+    return -1;
+
+  htsbuf_read(q, buf, len + 1);
+  if(len > 0 && buf[len - 1] == '\r')
+    len--;
+  buf[len] = 0;
+
+  if(hcc->hcc_state == HCP_CHUNK_SIZE || hcc->hcc_state == HCP_CHUNK_END)
+    return 1;
+
+  hcc->hcc_header_size += len;
+  if(hcc->hcc_header_size > HTTP_CLIENT_MAX_HEADER)
+    return -1;
+  return 1;
+}
+
+
+/**
+ *
+ */
+static void
+hcc_input(void *opaque, htsbuf_queue_t *q)
+{
+  http_client_conn_t *hcc = opaque;
+  http_client_host_t *hch = hcc->hcc_host;
+  http_client_req_t *hcq;
+  char line[8192];
+  int r;
+
+  while(q->hq_size > 0) {
+
+    if((hcq = TAILQ_FIRST(&hcc->hcc_reqs)) == NULL) {
+      hcc_destroy(hcc, NULL, 0);  // Nobody asked for this
+      return;
+    }
+    hcq->hcq_started = 1;
+
+    switch(hcc->hcc_state) {
+    case HCP_STATUS:
+    case HCP_HEADERS:
+    case HCP_TRAILERS:
+    case HCP_CHUNK_SIZE:
+    case HCP_CHUNK_END:
+      if((r = hcc_read_line(hcc, q, line, sizeof(line))) < 0)
+        goto bad;
+      if(r == 0)
+        return;
+
+      if(hcc->hcc_state == HCP_CHUNK_SIZE) {
+        char *end;
+        hcc->hcc_remain = strtoll(line, &end, 16);
+        if(end == line || hcc->hcc_remain < 0)
+          goto bad;
+        hcc->hcc_state = hcc->hcc_remain ? HCP_CHUNK_DATA : HCP_TRAILERS;
+      } else if(hcc->hcc_state == HCP_CHUNK_END) {
+        if(*line)
+          goto bad;
+        hcc->hcc_state = HCP_CHUNK_SIZE;
+      } else if(*line == 0 && hcc->hcc_state == HCP_HEADERS) {
+        hcc->hcc_state = hcc_headers_done(hcc, hcq);
+        if(hcc->hcc_state == HCP_BODY && hcc->hcc_remain == 0 &&
+           hcc_response_done(hcc))
+          return;
+      } else if(*line == 0 && hcc->hcc_state == HCP_TRAILERS) {
+        if(hcc_response_done(hcc))
+          return;
+      } else if(*line || hcc->hcc_state != HCP_STATUS) {
+        if(hcc_parse_line(hcc, hcq, line))
+          goto bad;
+      }
+      break;
+
+    case HCP_BODY:
+    case HCP_CHUNK_DATA:
+      if((r = hcc_read_body(hcq, q, hcc->hcc_remain)) < 0)
+        goto bad;
+      hcc->hcc_remain -= r;
+      if(hcc->hcc_remain > 0)
+        return;
+      if(hcc->hcc_state == HCP_CHUNK_DATA)
+        hcc->hcc_state = HCP_CHUNK_END;
+      else if(hcc_response_done(hcc))
+        return;
+      break;
+
+    case HCP_UNTIL_CLOSE:
+      if(hcc_read_body(hcq, q, q->hq_size) < 0)
+        goto bad;
+      return;
+    }
+  }
+  return;
+
+ bad:
+  hcc_destroy(hcc, "Bad response", 0);
+  hcc_dispatch(hch);
+}
+
+
+/**
+ *
+ */
+static void
+hcc_error(void *opaque, int error)
+{
+  http_client_conn_t *hcc = opaque;
+  http_client_host_t *hch = hcc->hcc_host;
+  http_client_req_t *hcq = TAILQ_FIRST(&hcc->hcc_reqs);
+
+  if(hcq != NULL && hcc->hcc_state == HCP_UNTIL_CLOSE) {
+    // Body delimited by close
+    hcc_response_done(hcc);
+    return;
+  }
+
+  hcc_destroy(hcc, strerror(error), 1);
+  hcc_dispatch(hch);
+}
+
+
+/**
+ *
+ */
+static http_client_conn_t *
+hcc_create(http_client_host_t *hch, int timeout)
+{
+  http_client_conn_t *hcc = calloc(1, sizeof(http_client_conn_t));
+
+  hcc->hcc_host = hch;
+  TAILQ_INIT(&hcc->hcc_reqs);
+  asyncio_timer_init(&hcc->hcc_idle_timer, hcc_idle_timeout, hcc);
+  LIST_INSERT_HEAD(&hch->hch_conns, hcc, hcc_link);
+  hch->hch_num_conns++;
+
+  hcc->hcc_af = asyncio_connect(hch->hch_name, hch->hch_port, timeout,
+                                hcc_connected, hcc_input, hcc_error, hcc);
+  return hcc;
+}
+
+
+/**
+ * Pick a connection for the request: an unused one, a new one, or one
+ * that can take another pipelined request
+ */
+static http_client_conn_t *
+hcc_select(http_client_host_t *hch, http_client_req_t *hcq)
+{
+  const http_client_config_t *conf = http_client_config();
+  http_client_conn_t *hcc, *best = NULL;
+
+  LIST_FOREACH(hcc, &hch->hch_conns, hcc_link) {
+    if(hcc->hcc_depth == 0)
+      return hcc;
+    if(hcq->hcq_idempotent && !hcc->hcc_exclusive &&
+       hcc->hcc_depth < conf->pipeline_depth &&
+       (best == NULL || hcc->hcc_depth < best->hcc_depth))
+      best = hcc;
+  }
+
+  if(hch->hch_num_conns < conf->max_connections) {
+    int64_t left = hcq->hcq_timer.at_expire - asyncio_now();
+    return hcc_create(hch, MAX(left / 1000, 1));
+  }
+  return best;
+}
+
+
+/**
+ *
+ */
+static void
+hcc_dispatch(http_client_host_t *hch)
+{
+  http_client_req_t *hcq;
+  http_client_conn_t *hcc;
+
+  while((hcq = TAILQ_FIRST(&hch->hch_pending)) != NULL) {
+    if((hcc = hcc_select(hch, hcq)) == NULL)
+      break;
+
+    TAILQ_REMOVE(&hch->hch_pending, hcq, hcq_link);
+    asyncio_timer_disarm(&hcc->hcc_idle_timer);
+    TAILQ_INSERT_TAIL(&hcc->hcc_reqs, hcq, hcq_link);
+    hcq->hcq_conn = hcc;
+    hcc->hcc_depth++;
+    if(!hcq->hcq_idempotent)
+      hcc->hcc_exclusive = 1;
+
+    if(hcc->hcc_connected)
+      hcq_write(hcc, hcq);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+hcq_timeout(void *opaque)
+{
+  http_client_req_t *hcq = opaque;
+  http_client_conn_t *hcc = hcq->hcq_conn;
+  http_client_host_t *hch;
+
+  if(hcc == NULL) {
+    LIST_FOREACH(hch, &http_client_hosts, hch_link)
+      if(hch->hch_port == hcq->hcq_port &&
+         !strcmp(hch->hch_name, hcq->hcq_host))
+        break;
+    TAILQ_REMOVE(&hch->hch_pending, hcq, hcq_link);
+    hcq_complete(hcq, "Request timed out");
+    return;
+  }
+
+  hch = hcc->hcc_host;
+
+  if(!hcq->hcq_sent) {
+    // Still connecting, nothing is written
+    hcc_unlink(hcc, hcq);
+    hcq_complete(hcq, "Request timed out");
+    return;
+  }
+
+  // Responses on this connection are stuck behind this one
+  hcc_unlink(hcc, hcq);
+  hcq_complete(hcq, "Request timed out");
+  hcc_destroy(hcc, "Request timed out", 1);
+  hcc_dispatch(hch);
+}
+
+
+/**
+ *
+ */
+static void
+http_client_start(http_client_req_t *hcq)
+{
+  http_client_host_t *hch;
+
+  if(hcq->hcq_errmsg != NULL) {
+    hcq_complete(hcq, hcq->hcq_errmsg);
+    return;
+  }
+
+  LIST_FOREACH(hch, &http_client_hosts, hch_link)
+    if(hch->hch_port == hcq->hcq_port && !strcmp(hch->hch_name, hcq->hcq_host))
+      break;
+
+  if(hch == NULL) {
+    hch = calloc(1, sizeof(http_client_host_t));
+    hch->hch_name = strdup(hcq->hcq_host);
+    hch->hch_port = hcq->hcq_port;
+    TAILQ_INIT(&hch->hch_pending);
+    LIST_INSERT_HEAD(&http_client_hosts, hch, hch_link);
+  }
+
+  asyncio_timer_init(&hcq->hcq_timer, hcq_timeout, hcq);
+  asyncio_timer_arm(&hcq->hcq_timer,
+                    asyncio_now() + hcq->hcq_timeout * 1000LL);
+  TAILQ_INSERT_TAIL(&hch->hch_pending, hcq, hcq_link);
+  hcc_dispatch(hch);
+}
+
+
+/**
+ * Runs on the asyncio thread
+ */
+static void
+http_client_worker(void)
+{
+  struct http_client_req_queue q;
+  http_client_req_t *hcq;
+
+  pthread_mutex_lock(&http_client_mutex);
+  TAILQ_MOVE(&q, &http_client_incoming, hcq_link);
+  pthread_mutex_unlock(&http_client_mutex);
+
+  while((hcq = TAILQ_FIRST(&q)) != NULL) {
+    TAILQ_REMOVE(&q, hcq, hcq_link);
+    http_client_start(hcq);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+http_client_init(void)
+{
+  TAILQ_INIT(&http_client_incoming);
+  http_client_worker_id = asyncio_add_worker(http_client_worker);
+}
+
+
+/**
+ *
+ */
+void
+http_client_send(http_client_req_t *hcq, int flags, int timeout,
+                 http_client_cb_t *cb, void *opaque)
+{
+  int wakeup;
+
+  pthread_once(&http_client_once, http_client_init);
+
+  hcq->hcq_flags = flags;
+  hcq->hcq_timeout = MAX(timeout, 1);
+  hcq->hcq_cb = cb;
+  hcq->hcq_opaque = opaque;
+
+  pthread_mutex_lock(&http_client_mutex);
+  wakeup = TAILQ_FIRST(&http_client_incoming) == NULL;
+  TAILQ_INSERT_TAIL(&http_client_incoming, hcq, hcq_link);
+  pthread_mutex_unlock(&http_client_mutex);
+
+  if(wakeup)
+    asyncio_wakeup_worker(http_client_worker_id);
+}
+
+
+/**
+ *
+ */
+void
+http_client_get(const char *url, int flags, int timeout,
+                http_client_cb_t *cb, void *opaque)
+{
+  http_client_send(http_client_req("GET", url), flags, timeout, cb, opaque);
+}
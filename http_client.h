@@ -0,0 +1,71 @@
+/*
+ *  Asynchronous HTTP/1.1 client
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "htsmsg.h"
+
+#define HTTP_CLIENT_JSON 0x1 // Parse the body into hcr_json
+
+typedef struct http_client_response {
+  int hcr_status;          // 0 if no response was received
+  const char *hcr_errmsg;  // Set if hcr_status is 0 or JSON didn't parse
+  htsmsg_t *hcr_headers;   // Names in lower case
+  char *hcr_body;          // NUL terminated
+  size_t hcr_body_len;
+  htsmsg_t *hcr_json;
+} http_client_response_t;
+
+/**
+ * Called on the asyncio thread. The response is freed when the callback
+ * returns, set hcr_json to NULL to keep it
+ */
+typedef void (http_client_cb_t)(void *opaque, http_client_response_t *hcr);
+
+typedef struct http_client_req http_client_req_t;
+
+/**
+ * Start building a request. Only http:// URLs are supported
+ */
+http_client_req_t *http_client_req(const char *method, const char *url);
+
+void http_client_req_header(http_client_req_t *hcq, const char *key,
+                            const char *value);
+
+void http_client_req_body(http_client_req_t *hcq, const char *content_type,
+                          const void *data, size_t len);
+
+/**
+ * Queue the request and return right away, hcq is owned by the client
+ * after this. Can be called from any thread. timeout (in ms) covers
+ * everything from connecting to the last byte of the response.
+ *
+ * Connections are kept alive and pooled per host. Up to
+ * http.client.maxConnections are opened to each host, after that GET
+ * and HEAD requests are pipelined, at most http.client.pipelineDepth
+ * on each connection, and the rest wait for a connection to free up.
+ *
+ * Requires asyncio_init()
+ */
+void http_client_send(http_client_req_t *hcq, int flags, int timeout,
+                      http_client_cb_t *cb, void *opaque);
+
+void http_client_get(const char *url, int flags, int timeout,
+                     http_client_cb_t *cb, void *opaque);
@@ -0,0 +1,430 @@
+/*
+ *  HTTP server metrics
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/param.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "queue.h"
+#include "misc.h"
+#include "tcp.h"
+#include "http_metrics.h"
+#include "http_qos.h"
+
+#ifdef WITH_ASYNCIO
+#include "asyncio.h"
+#endif
+
+/**
+ * Every thread that serves requests counts into a shard of its own, so
+ * recording is a handful of plain stores to memory no other thread
+ * writes. Shards are summed when scraped. When a thread exits its shard
+ * is folded into metrics_retired.
+ *
+ * Latencies go into log-linear buckets, two per power of two
+ * microseconds (2^n and 1.5 * 2^n), from 1us to about a minute
+ */
+
+#define METRICS_MAX_ROUTES 256
+#define METRICS_BUCKETS    52
+#define METRICS_FIRST_LE   11  // First exposed bucket is le 64us
+
+typedef struct metrics_route {
+  uint64_t mr_requests[6]; // By status / 100, [0] is no reply at all
+  uint64_t mr_bytes_in;
+  uint64_t mr_bytes_out;
+  uint64_t mr_usec;
+  uint64_t mr_hist[METRICS_BUCKETS];
+} metrics_route_t;
+
+typedef struct metrics_shard {
+  LIST_ENTRY(metrics_shard) ms_link;
+  metrics_route_t *ms_routes[METRICS_MAX_ROUTES];
+} metrics_shard_t;
+
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+static __thread metrics_shard_t *metrics_shard;
+
+static LIST_HEAD(, metrics_shard) metrics_shards;
+static metrics_route_t *metrics_retired[METRICS_MAX_ROUTES];
+static const char *metrics_names[METRICS_MAX_ROUTES] = { "" };
+static int metrics_num_names = 1;
+
+static uint64_t metrics_timeouts[HTTP_TIMEOUT_num];
+static const char *metrics_timeout_names[HTTP_TIMEOUT_num] = {
+  [HTTP_TIMEOUT_IDLE]   = "idle",
+  [HTTP_TIMEOUT_HEADER] = "header",
+  [HTTP_TIMEOUT_BODY]   = "body",
+  [HTTP_TIMEOUT_SEND]   = "send",
+};
+
+
+/**
+ *
+ */
+int
+http_metrics_register(const char *name)
+{
+  int id = 0;
+
+  pthread_mutex_lock(&metrics_mutex);
+  if(metrics_num_names < METRICS_MAX_ROUTES) {
+    id = metrics_num_names++;
+    metrics_names[id] = strdup(name);
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+  return id;
+}
+
+
+/**
+ *
+ */
+static void
+metrics_route_merge(metrics_route_t *dst, const metrics_route_t *src)
+{
+  int i;
+
+  for(i = 0; i < 6; i++)
+    dst->mr_requests[i] +=
+      __atomic_load_n(&src->mr_requests[i], __ATOMIC_RELAXED);
+  dst->mr_bytes_in  += __atomic_load_n(&src->mr_bytes_in, __ATOMIC_RELAXED);
+  dst->mr_bytes_out += __atomic_load_n(&src->mr_bytes_out, __ATOMIC_RELAXED);
+  dst->mr_usec      += __atomic_load_n(&src->mr_usec, __ATOMIC_RELAXED);
+  for(i = 0; i < METRICS_BUCKETS; i++)
+    dst->mr_hist[i] += __atomic_load_n(&src->mr_hist[i], __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Thread is exiting
+ */
+static void
+metrics_shard_release(void *aux)
+{
+  metrics_shard_t *ms = aux;
+  int i;
+
+  pthread_mutex_lock(&metrics_mutex);
+  LIST_REMOVE(ms, ms_link);
+  for(i = 0; i < METRICS_MAX_ROUTES; i++) {
+    if(ms->ms_routes[i] == NULL)
+      continue;
+    if(metrics_retired[i] == NULL)
+      metrics_retired[i] = calloc(1, sizeof(metrics_route_t));
+    metrics_route_merge(metrics_retired[i], ms->ms_routes[i]);
+    free(ms->ms_routes[i]);
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+  free(ms);
+}
+
+
+/**
+ *
+ */
+static void
+metrics_init(void)
+{
+  pthread_key_create(&metrics_key, metrics_shard_release);
+}
+
+
+/**
+ *
+ */
+static metrics_route_t *
+metrics_route_get(int id)
+{
+  metrics_shard_t *ms = metrics_shard;
+  metrics_route_t *mr;
+
+  if(ms == NULL) {
+    pthread_once(&metrics_once, metrics_init);
+    ms = metrics_shard = calloc(1, sizeof(metrics_shard_t));
+    pthread_setspecific(metrics_key, ms);
+    pthread_mutex_lock(&metrics_mutex);
+    LIST_INSERT_HEAD(&metrics_shards, ms, ms_link);
+    pthread_mutex_unlock(&metrics_mutex);
+  }
+
+  if((mr = ms->ms_routes[id]) == NULL) {
+    mr = calloc(1, sizeof(metrics_route_t));
+    __atomic_store_n(&ms->ms_routes[id], mr, __ATOMIC_RELEASE);
+  }
+  return mr;
+}
+
+
+/**
+ * Only the owning thread writes, so no need for a locked add
+ */
+static inline void
+metrics_add(uint64_t *p, uint64_t v)
+{
+  __atomic_store_n(p, *p + v, __ATOMIC_RELAXED);
+}
+
+
+/**
+ *
+ */
+static int
+metrics_bucket(uint64_t usec)
+{
+  int e;
+
+  if(usec < 2)
+    return usec;
+  e = 63 - __builtin_clzll(usec);
+  return MIN(2 * e + ((usec >> (e - 1)) & 1), METRICS_BUCKETS - 1);
+}
+
+
+/**
+ * Lowest duration that goes into a bucket, in microseconds
+ */
+static uint64_t
+metrics_bucket_lower(int b)
+{
+  if(b < 2)
+    return b;
+  return (uint64_t)(2 + (b & 1)) << (b / 2 - 1);
+}
+
+
+/**
+ * Upper bound of a bucket. Durations are truncated to whole
+ * microseconds, so everything in it is below the next bucket's lower
+ * bound
+ */
+static uint64_t
+metrics_bucket_le(int b)
+{
+  return metrics_bucket_lower(b + 1);
+}
+
+
+/**
+ *
+ */
+void
+http_metrics_record(http_connection_t *hc)
+{
+  metrics_route_t *mr = metrics_route_get(hc->hc_metrics_id);
+  uint64_t usec = get_ts() - hc->hc_t_start;
+  int class = hc->hc_status / 100;
+
+  metrics_add(&mr->mr_requests[class > 0 && class < 6 ? class : 0], 1);
+  metrics_add(&mr->mr_bytes_in,
+              hc->hc_bytes_in + hc->hc_post_len - hc->hc_body_remain);
+  metrics_add(&mr->mr_bytes_out, hc->hc_bytes_out + hc->hc_output.hq_size);
+  metrics_add(&mr->mr_usec, usec);
+  metrics_add(&mr->mr_hist[metrics_bucket(usec)], 1);
+}
+
+
+/**
+ * Rare enough that a shared counter is fine
+ */
+void
+http_metrics_timeout(int reason)
+{
+  __atomic_add_fetch(&metrics_timeouts[reason], 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Label values in the exposition format escape \, " and newline
+ */
+static void
+metrics_append_label(htsbuf_queue_t *q, const char *s)
+{
+  for(; *s; s++) {
+    if(*s == '\\' || *s == '"')
+      htsbuf_append(q, "\\", 1);
+    if(*s == '\n')
+      htsbuf_append(q, "\\n", 2);
+    else
+      htsbuf_append(q, s, 1);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+metrics_format_route(htsbuf_queue_t *q, const char *name,
+                     const metrics_route_t *mr)
+{
+  static const char *classes[6] = {"none", "1xx", "2xx", "3xx", "4xx", "5xx"};
+  uint64_t count = 0;
+  int i;
+
+  for(i = 0; i < 6; i++) {
+    if(mr->mr_requests[i] == 0)
+      continue;
+    htsbuf_append_str(q, "http_requests_total{route=\"");
+    metrics_append_label(q, name);
+    htsbuf_qprintf(q, "\",code=\"%s\"} %"PRIu64"\n",
+                   classes[i], mr->mr_requests[i]);
+  }
+
+  htsbuf_append_str(q, "http_received_bytes_total{route=\"");
+  metrics_append_label(q, name);
+  htsbuf_qprintf(q, "\"} %"PRIu64"\n", mr->mr_bytes_in);
+
+  htsbuf_append_str(q, "http_sent_bytes_total{route=\"");
+  metrics_append_label(q, name);
+  htsbuf_qprintf(q, "\"} %"PRIu64"\n", mr->mr_bytes_out);
+
+  // The last bucket also holds everything above it, so only +Inf for that
+  for(i = 0; i < METRICS_BUCKETS; i++) {
+    count += mr->mr_hist[i];
+    if(i < METRICS_FIRST_LE || i == METRICS_BUCKETS - 1)
+      continue;
+    htsbuf_append_str(q, "http_request_duration_seconds_bucket{route=\"");
+    metrics_append_label(q, name);
+    htsbuf_qprintf(q, "\",le=\"%.9g\"} %"PRIu64"\n",
+                   metrics_bucket_le(i) / 1e6, count);
+  }
+
+  htsbuf_append_str(q, "http_request_duration_seconds_bucket{route=\"");
+  metrics_append_label(q, name);
+  htsbuf_qprintf(q, "\",le=\"+Inf\"} %"PRIu64"\n", count);
+
+  htsbuf_append_str(q, "http_request_duration_seconds_sum{route=\"");
+  metrics_append_label(q, name);
+  htsbuf_qprintf(q, "\"} %g\n", mr->mr_usec / 1e6);
+
+  htsbuf_append_str(q, "http_request_duration_seconds_count{route=\"");
+  metrics_append_label(q, name);
+  htsbuf_qprintf(q, "\"} %"PRIu64"\n", count);
+}
+
+
+/**
+ * Prometheus text exposition format
+ */
+static int
+http_metrics_serve(http_connection_t *hc, int argc, char **argv, int flags)
+{
+  htsbuf_queue_t *q = &hc->hc_reply;
+  metrics_route_t *sum = calloc(METRICS_MAX_ROUTES, sizeof(metrics_route_t));
+  const metrics_shard_t *ms;
+  tcp_server_stats_t tss;
+  int i, j, n;
+
+  pthread_mutex_lock(&metrics_mutex);
+  n = metrics_num_names;
+  for(i = 0; i < n; i++) {
+    if(metrics_retired[i] != NULL)
+      metrics_route_merge(&sum[i], metrics_retired[i]);
+    LIST_FOREACH(ms, &metrics_shards, ms_link) {
+      const metrics_route_t *mr =
+        __atomic_load_n(&ms->ms_routes[i], __ATOMIC_ACQUIRE);
+      if(mr != NULL)
+        metrics_route_merge(&sum[i], mr);
+    }
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+
+  htsbuf_append_str(q,
+                    "# TYPE http_requests_total counter\n"
+                    "# TYPE http_received_bytes_total counter\n"
+                    "# TYPE http_sent_bytes_total counter\n"
+                    "# TYPE http_request_duration_seconds histogram\n");
+
+  for(i = 0; i < n; i++) {
+    uint64_t total = 0;
+    for(j = 0; j < 6; j++)
+      total += sum[i].mr_requests[j];
+    if(total > 0)
+      metrics_format_route(q, metrics_names[i], &sum[i]);
+  }
+  free(sum);
+
+  htsbuf_append_str(q, "# TYPE http_timeouts_total counter\n");
+  for(i = 0; i < HTTP_TIMEOUT_num; i++)
+    htsbuf_qprintf(q, "http_timeouts_total{reason=\"%s\"} %"PRIu64"\n",
+                   metrics_timeout_names[i],
+                   __atomic_load_n(&metrics_timeouts[i], __ATOMIC_RELAXED));
+
+  htsbuf_append_str(q,
+                    "# TYPE http_class_active gauge\n"
+                    "# TYPE http_class_queued gauge\n"
+                    "# TYPE http_class_rejected_total counter\n");
+  for(i = 0; i < HTTP_ROUTE_CLASSES; i++) {
+    http_qos_stats_t qs;
+    http_qos_get_stats(i, &qs);
+    if(qs.max_active == 0 && qs.rejected == 0)
+      continue;
+    htsbuf_qprintf(q,
+                   "http_class_active{class=\"%d\"} %d\n"
+                   "http_class_queued{class=\"%d\"} %d\n"
+                   "http_class_rejected_total{class=\"%d\"} %"PRIu64"\n",
+                   i, qs.active, i, qs.queued, i, qs.rejected);
+  }
+
+  tcp_server_get_stats(&tss);
+  htsbuf_qprintf(q,
+                 "# TYPE tcp_server_threads gauge\n"
+                 "tcp_server_threads{state=\"busy\"} %d\n"
+                 "tcp_server_threads{state=\"idle\"} %d\n"
+                 "# TYPE tcp_server_threads_max gauge\n"
+                 "tcp_server_threads_max %d\n"
+                 "# TYPE tcp_server_connections_total counter\n"
+                 "tcp_server_connections_total %"PRIu64"\n"
+                 "# TYPE tcp_server_pool_waits_total counter\n"
+                 "tcp_server_pool_waits_total %"PRIu64"\n",
+                 tss.threads - tss.idle_threads, tss.idle_threads,
+                 tss.max_threads, tss.connections, tss.pool_waits);
+
+#ifdef WITH_ASYNCIO
+  asyncio_stats_t as;
+  asyncio_get_stats(&as);
+  htsbuf_qprintf(q,
+                 "# TYPE asyncio_fds gauge\n"
+                 "asyncio_fds %d\n"
+                 "# TYPE asyncio_wakeups_total counter\n"
+                 "asyncio_wakeups_total %"PRIu64"\n"
+                 "# TYPE asyncio_events_total counter\n"
+                 "asyncio_events_total %"PRIu64"\n"
+                 "# TYPE asyncio_busy_seconds_total counter\n"
+                 "asyncio_busy_seconds_total %g\n",
+                 as.fds, as.wakeups, as.events, as.busy_usec / 1e6);
+#endif
+
+  return http_output_content(hc, "text/plain; version=0.0.4");
+}
+
+
+/**
+ *
+ */
+http_route_t *
+http_route_add_metrics(const char *path)
+{
+  return http_route_add(path, http_metrics_serve, 0);
+}
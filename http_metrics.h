@@ -0,0 +1,41 @@
+/*
+ *  HTTP server metrics
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "http.h"
+
+/**
+ * Returns the id to put in hc_metrics_id for requests handled by the
+ * named route or path. 0 is used for requests that matched nothing
+ * and for everything once the table is full
+ */
+int http_metrics_register(const char *name);
+
+void http_metrics_record(http_connection_t *hc);
+
+/**
+ * Reasons for dropping a connection that was too slow
+ */
+#define HTTP_TIMEOUT_IDLE   0 // No request on a kept alive connection
+#define HTTP_TIMEOUT_HEADER 1 // Request line and headers took too long
+#define HTTP_TIMEOUT_BODY   2 // Body arrived slower than http.bodyMinRate
+#define HTTP_TIMEOUT_SEND   3 // Client stopped reading the response
+#define HTTP_TIMEOUT_num    4
+
+void http_metrics_timeout(int reason);
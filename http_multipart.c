@@ -0,0 +1,477 @@
+/*
+ *  multipart/form-data request bodies
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "misc.h"
+#include "trace.h"
+#include "cfg.h"
+#include "http_multipart.h"
+
+/**
+ * The body is read into a fixed buffer and scanned for the delimiter
+ * ("\r\n--" boundary) with Boyer-Moore-Horspool. Everything but the
+ * last delimiter length - 1 bytes (which may be the start of a
+ * delimiter split across reads) is passed on as part data, so a part
+ * header block is the only thing that must fit in the buffer
+ */
+
+#define MULTIPART_BUFSIZE    65536
+#define MULTIPART_BOUNDARY_MAX 70  // RFC 2046
+
+typedef enum {
+  MP_PREAMBLE,
+  MP_DELIMITER,
+  MP_HEADERS,
+  MP_BODY,
+} mp_state_t;
+
+typedef struct multipart {
+  http_connection_t *mp_hc;
+  const http_multipart_handler_t *mp_handler;
+  void *mp_opaque;
+
+  char *mp_buf;
+  size_t mp_len;
+
+  char mp_delim[MULTIPART_BOUNDARY_MAX + 4];
+  size_t mp_dlen;
+  uint8_t mp_skip[256];
+
+  http_part_t mp_part;
+  int mp_in_part;
+  char *mp_name;
+  char *mp_filename;
+  size_t mp_size;  // Allocated size of hp_data
+
+  int64_t mp_spill_size;
+  char mp_tmp_dir[256];
+} multipart_t;
+
+
+typedef struct multipart_config {
+  int64_t spill_size;
+  char tmp_dir[256];
+} multipart_config_t;
+
+static void
+multipart_config_fill(void *opaque, cfg_t *cr)
+{
+  multipart_config_t *c = opaque;
+  c->spill_size =
+    cfg_get_s64(cr, CFG("http", "bodySpillSize"), 1024 * 1024);
+  snprintf(c->tmp_dir, sizeof(c->tmp_dir), "%s",
+           cfg_get_str(cr, CFG("http", "tmpDir"), "/tmp"));
+}
+
+CFG_VIEW(multipart_config_t, multipart_config, multipart_config_fill);
+
+
+/**
+ * Extract a parameter from a header value such as
+ * 'form-data; name="file"; filename="a.txt"'. Returns a malloced
+ * string or NULL
+ */
+static char *
+multipart_param(const char *s, const char *name)
+{
+  const size_t namelen = strlen(name);
+
+  while((s = strchr(s, ';')) != NULL) {
+    s++;
+    while(*s == ' ' || *s == '\t')
+      s++;
+
+    if(strncasecmp(s, name, namelen) || s[namelen] != '=')
+      continue;
+    s += namelen + 1;
+
+    if(*s != '"')
+      return strndup(s, strcspn(s, "; \t"));
+
+    char *r = malloc(strlen(s)), *d = r;
+    for(s++; *s && *s != '"'; s++) {
+      if(*s == '\\' && s[1])
+        s++;
+      *d++ = *s;
+    }
+    *d = 0;
+    return r;
+  }
+  return NULL;
+}
+
+
+/**
+ * Returns offset of the delimiter in the buffer or -1
+ */
+static ssize_t
+multipart_find(const multipart_t *mp)
+{
+  const uint8_t *buf = (const uint8_t *)mp->mp_buf;
+  const size_t dlen = mp->mp_dlen;
+  const uint8_t last = mp->mp_delim[dlen - 1];
+  size_t i = 0;
+
+  while(i + dlen <= mp->mp_len) {
+    const uint8_t c = buf[i + dlen - 1];
+    if(c == last && !memcmp(buf + i, mp->mp_delim, dlen - 1))
+      return i;
+    i += mp->mp_skip[c];
+  }
+  return -1;
+}
+
+
+/**
+ *
+ */
+static void
+multipart_consume(multipart_t *mp, size_t len)
+{
+  mp->mp_len -= len;
+  memmove(mp->mp_buf, mp->mp_buf + len, mp->mp_len);
+}
+
+
+/**
+ * Returns 0 if more data was read, otherwise an error to stop with
+ */
+static int
+multipart_fill(multipart_t *mp)
+{
+  int r;
+
+  if(mp->mp_len == MULTIPART_BUFSIZE)
+    return HTTP_STATUS_BAD_REQUEST;  // Part header block too large
+
+  r = http_body_read(mp->mp_hc, mp->mp_buf + mp->mp_len,
+                     MULTIPART_BUFSIZE - mp->mp_len);
+  if(r < 0)
+    return HTTP_ERROR_DISCONNECT;
+  if(r == 0)
+    return HTTP_STATUS_BAD_REQUEST;  // Body ended before last boundary
+  mp->mp_len += r;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+multipart_write(int fd, const char *buf, size_t len)
+{
+  while(len > 0) {
+    ssize_t w = write(fd, buf, len);
+    if(w < 0) {
+      if(errno == EINTR)
+        continue;
+      trace(LOG_ERR, "HTTP: Unable to spool multipart body -- %s",
+            strerror(errno));
+      return HTTP_STATUS_ISE;
+    }
+    buf += w;
+    len -= w;
+  }
+  return 0;
+}
+
+
+/**
+ * Pass part data to the handler, or collect it
+ */
+static int
+multipart_data(multipart_t *mp, const char *buf, size_t len)
+{
+  http_part_t *hp = &mp->mp_part;
+  int err;
+
+  if(len == 0)
+    return 0;
+
+  if(mp->mp_handler->data != NULL) {
+    hp->hp_len += len;
+    return mp->mp_handler->data(mp->mp_opaque, hp, buf, len);
+  }
+
+  if(hp->hp_fd == -1 && hp->hp_len + len > mp->mp_spill_size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/httppartXXXXXX", mp->mp_tmp_dir);
+    if((hp->hp_fd = mkstemp(path)) == -1) {
+      trace(LOG_ERR, "HTTP: Unable to create %s -- %s",
+            path, strerror(errno));
+      return HTTP_STATUS_ISE;
+    }
+    unlink(path);
+
+    err = multipart_write(hp->hp_fd, hp->hp_data, hp->hp_len);
+    free(hp->hp_data);
+    hp->hp_data = NULL;
+    mp->mp_size = 0;
+    if(err)
+      return err;
+  }
+
+  if(hp->hp_fd != -1) {
+    hp->hp_len += len;
+    return multipart_write(hp->hp_fd, buf, len);
+  }
+
+  if(hp->hp_len + len + 1 > mp->mp_size) {
+    mp->mp_size = MAX(hp->hp_len + len + 1, mp->mp_size * 2);
+    hp->hp_data = realloc(hp->hp_data, mp->mp_size);
+  }
+  memcpy(hp->hp_data + hp->hp_len, buf, len);
+  hp->hp_len += len;
+  return 0;
+}
+
+
+/**
+ * Parse a part header block (without the empty line that ends it)
+ */
+static int
+multipart_part_begin(multipart_t *mp, char *hdrs)
+{
+  http_part_t *hp = &mp->mp_part;
+  const char *v;
+  char *line, *next, *val;
+
+  mp->mp_in_part = 1;
+  http_arg_list_init(&hp->hp_headers, NULL);
+
+  for(line = hdrs; *line; line = next) {
+    if((next = strstr(line, "\r\n")) != NULL) {
+      *next = 0;
+      next += 2;
+    } else {
+      next = line + strlen(line);
+    }
+
+    if((val = strchr(line, ':')) == NULL)
+      continue;
+    *val++ = 0;
+    while(*val == ' ' || *val == '\t')
+      val++;
+    http_arg_set(&hp->hp_headers, line, val);
+  }
+
+  if((v = http_arg_get(&hp->hp_headers, "Content-Disposition")) != NULL) {
+    mp->mp_name = multipart_param(v, "name");
+    mp->mp_filename = multipart_param(v, "filename");
+  }
+
+  hp->hp_name = mp->mp_name ?: "";
+  hp->hp_filename = mp->mp_filename;
+  hp->hp_content_type = http_arg_get(&hp->hp_headers, "Content-Type") ?:
+    "text/plain";
+  hp->hp_len = 0;
+  hp->hp_data = NULL;
+  hp->hp_fd = -1;
+  mp->mp_size = 0;
+
+  if(mp->mp_handler->begin != NULL)
+    return mp->mp_handler->begin(mp->mp_opaque, hp);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+multipart_part_release(multipart_t *mp)
+{
+  http_part_t *hp = &mp->mp_part;
+
+  if(!mp->mp_in_part)
+    return;
+  mp->mp_in_part = 0;
+
+  http_arg_flush(&hp->hp_headers);
+  free(mp->mp_name);
+  free(mp->mp_filename);
+  mp->mp_name = mp->mp_filename = NULL;
+  free(hp->hp_data);
+  if(hp->hp_fd != -1)
+    close(hp->hp_fd);
+}
+
+
+/**
+ *
+ */
+static int
+multipart_part_end(multipart_t *mp)
+{
+  http_part_t *hp = &mp->mp_part;
+  int err = 0;
+
+  if(hp->hp_data != NULL)
+    hp->hp_data[hp->hp_len] = 0;
+  else if(hp->hp_fd == -1 && mp->mp_handler->data == NULL)
+    hp->hp_data = strdup("");
+
+  if(hp->hp_fd != -1)
+    lseek(hp->hp_fd, 0, SEEK_SET);
+
+  if(mp->mp_handler->end != NULL)
+    err = mp->mp_handler->end(mp->mp_opaque, hp);
+
+  multipart_part_release(mp);
+  return err;
+}
+
+
+/**
+ *
+ */
+static int
+multipart_run(multipart_t *mp)
+{
+  mp_state_t state = MP_PREAMBLE;
+  ssize_t pos;
+  char *end;
+  int err;
+
+  while(1) {
+    switch(state) {
+    case MP_PREAMBLE:
+    case MP_BODY:
+      if((pos = multipart_find(mp)) >= 0) {
+        if(state == MP_BODY) {
+          if((err = multipart_data(mp, mp->mp_buf, pos)) != 0 ||
+             (err = multipart_part_end(mp)) != 0)
+            return err;
+        }
+        multipart_consume(mp, pos + mp->mp_dlen);
+        state = MP_DELIMITER;
+        continue;
+      }
+
+      if(mp->mp_len >= mp->mp_dlen) {
+        // Keep what may be the start of a delimiter
+        const size_t len = mp->mp_len - (mp->mp_dlen - 1);
+        if(state == MP_BODY && (err = multipart_data(mp, mp->mp_buf, len)))
+          return err;
+        multipart_consume(mp, len);
+      }
+      break;
+
+    case MP_DELIMITER:
+      if(mp->mp_len >= 2 && !memcmp(mp->mp_buf, "--", 2))
+        return 0;  // Close delimiter, the epilogue is drained by http.c
+
+      // Skip transport padding
+      while(mp->mp_len > 0 &&
+            (mp->mp_buf[0] == ' ' || mp->mp_buf[0] == '\t'))
+        multipart_consume(mp, 1);
+
+      if(mp->mp_len >= 2) {
+        if(memcmp(mp->mp_buf, "\r\n", 2))
+          return HTTP_STATUS_BAD_REQUEST;
+        multipart_consume(mp, 2);
+        state = MP_HEADERS;
+        continue;
+      }
+      break;
+
+    case MP_HEADERS:
+      if(mp->mp_len >= 2 && !memcmp(mp->mp_buf, "\r\n", 2)) {
+        // No headers at all
+        mp->mp_buf[0] = 0;
+        err = multipart_part_begin(mp, mp->mp_buf);
+        multipart_consume(mp, 2);
+      } else if((end = memmem(mp->mp_buf, mp->mp_len,
+                              "\r\n\r\n", 4)) != NULL) {
+        *end = 0;
+        err = multipart_part_begin(mp, mp->mp_buf);
+        multipart_consume(mp, end + 4 - mp->mp_buf);
+      } else {
+        break;
+      }
+      if(err)
+        return err;
+      state = MP_BODY;
+      continue;
+    }
+
+    if((err = multipart_fill(mp)) != 0)
+      return err;
+  }
+}
+
+
+/**
+ *
+ */
+int
+http_multipart_read(http_connection_t *hc,
+                    const http_multipart_handler_t *h, void *opaque)
+{
+  const multipart_config_t *conf = multipart_config();
+  const char *ct = http_header_get(hc, HTTP_HDR_CONTENT_TYPE);
+  char *boundary;
+  multipart_t mp = {};
+  int err;
+
+  if(ct == NULL || strncasecmp(ct, "multipart/", 10) ||
+     (boundary = multipart_param(ct, "boundary")) == NULL)
+    return HTTP_STATUS_BAD_REQUEST;
+
+  if(!*boundary || strlen(boundary) > MULTIPART_BOUNDARY_MAX) {
+    free(boundary);
+    return HTTP_STATUS_BAD_REQUEST;
+  }
+
+  mp.mp_hc = hc;
+  mp.mp_handler = h;
+  mp.mp_opaque = opaque;
+  mp.mp_spill_size = conf->spill_size;
+  snprintf(mp.mp_tmp_dir, sizeof(mp.mp_tmp_dir), "%s", conf->tmp_dir);
+
+  mp.mp_dlen = snprintf(mp.mp_delim, sizeof(mp.mp_delim),
+                        "\r\n--%s", boundary);
+  free(boundary);
+
+  for(int i = 0; i < 256; i++)
+    mp.mp_skip[i] = mp.mp_dlen;
+  for(size_t i = 0; i < mp.mp_dlen - 1; i++)
+    mp.mp_skip[(uint8_t)mp.mp_delim[i]] = mp.mp_dlen - 1 - i;
+
+  // The first delimiter may come without a preceding CRLF
+  mp.mp_buf = malloc(MULTIPART_BUFSIZE);
+  memcpy(mp.mp_buf, "\r\n", 2);
+  mp.mp_len = 2;
+
+  err = multipart_run(&mp);
+
+  multipart_part_release(&mp);
+  free(mp.mp_buf);
+  return err;
+}
@@ -0,0 +1,56 @@
+/*
+ *  multipart/form-data request bodies
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "http.h"
+
+typedef struct http_part {
+  struct http_arg_list hp_headers;
+  const char *hp_name;          // From Content-Disposition, "" if missing
+  const char *hp_filename;      // NULL unless the part is a file
+  const char *hp_content_type;  // "text/plain" if missing
+  int64_t hp_len;
+
+  // Body collected by the parser when there is no data callback,
+  // valid until the end callback returns
+  char *hp_data;  // NUL terminated, NULL if spilled to disk
+  int hp_fd;      // Unlinked file at offset 0, -1 if in memory
+} http_part_t;
+
+/**
+ * Callbacks return 0 to go on or an HTTP status to stop parsing. Any of
+ * them may be NULL. Without a data callback the part body is collected
+ * and handed to the end callback, in memory up to http.bodySpillSize
+ * and in a file in http.tmpDir beyond that
+ */
+typedef struct http_multipart_handler {
+  int (*begin)(void *opaque, http_part_t *hp);
+  int (*data)(void *opaque, http_part_t *hp, const void *buf, size_t len);
+  int (*end)(void *opaque, http_part_t *hp);
+} http_multipart_handler_t;
+
+/**
+ * Parse a multipart/form-data body for a HTTP_ROUTE_STREAM_BODY route,
+ * delivering parts as they arrive. Memory use is bounded regardless of
+ * body size. Returns 0 when the closing boundary is reached, otherwise
+ * an HTTP status or HTTP_ERROR_DISCONNECT, suitable to return from the
+ * route callback
+ */
+int http_multipart_read(http_connection_t *hc,
+                        const http_multipart_handler_t *h, void *opaque);
@@ -0,0 +1,251 @@
+/*
+ *  HTTP request header parser
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <strings.h>
+
+#include "http.h"
+#include "http_parser.h"
+
+/**
+ * The parser works directly on the receive buffer. Lines are located
+ * with memchr() (which is vectorized in any libc worth using) and all
+ * tokens are NUL terminated in place, so nothing is ever copied.
+ *
+ * It can be called repeatedly as more data arrives, already scanned
+ * lines are never looked at again.
+ */
+
+static const struct {
+  const char *name;
+  int len;
+  int id;
+} known_headers[] = {
+  { "Accept-Encoding",   15, HTTP_HDR_ACCEPT_ENCODING },
+  { "Authorization",     13, HTTP_HDR_AUTHORIZATION },
+  { "Connection",        10, HTTP_HDR_CONNECTION },
+  { "Content-Length",    14, HTTP_HDR_CONTENT_LENGTH },
+  { "Content-Type",      12, HTTP_HDR_CONTENT_TYPE },
+  { "Expect",             6, HTTP_HDR_EXPECT },
+  { "Host",               4, HTTP_HDR_HOST },
+  { "If-Modified-Since", 17, HTTP_HDR_IF_MODIFIED_SINCE },
+  { "If-None-Match",     13, HTTP_HDR_IF_NONE_MATCH },
+  { "Range",              5, HTTP_HDR_RANGE },
+  { "Transfer-Encoding", 17, HTTP_HDR_TRANSFER_ENCODING },
+  { "Upgrade",            7, HTTP_HDR_UPGRADE },
+};
+
+
+/**
+ *
+ */
+void
+http_parser_init(http_parser_t *hps)
+{
+  hps->hps_state = HTTP_PARSE_REQUEST_LINE;
+  hps->hps_scan = 0;
+  hps->hps_path = NULL;
+  hps->hps_num_headers = 0;
+  memset(hps->hps_known, 0, sizeof(hps->hps_known));
+}
+
+
+/**
+ *
+ */
+static int
+http_header_lookup(const char *name, int len)
+{
+  int i;
+  for(i = 0; i < sizeof(known_headers) / sizeof(known_headers[0]); i++)
+    if(known_headers[i].len == len &&
+       !strncasecmp(known_headers[i].name, name, len))
+      return known_headers[i].id;
+  return HTTP_HDR_UNKNOWN;
+}
+
+
+/**
+ * Methods are case sensitive (RFC 7230 3.1.1)
+ */
+int
+http_method_lookup(const char *s, int len)
+{
+  switch(len) {
+  case 3:
+    if(!memcmp(s, "GET", 3))       return HTTP_CMD_GET;
+    if(!memcmp(s, "PUT", 3))       return HTTP_CMD_PUT;
+    if(!memcmp(s, "PRI", 3))       return HTTP_CMD_PRI;
+    break;
+  case 4:
+    if(!memcmp(s, "POST", 4))      return HTTP_CMD_POST;
+    if(!memcmp(s, "HEAD", 4))      return HTTP_CMD_HEAD;
+    if(!memcmp(s, "PLAY", 4))      return RTSP_CMD_PLAY;
+    break;
+  case 5:
+    if(!memcmp(s, "SETUP", 5))     return RTSP_CMD_SETUP;
+    if(!memcmp(s, "PAUSE", 5))     return RTSP_CMD_PAUSE;
+    break;
+  case 6:
+    if(!memcmp(s, "DELETE", 6))    return HTTP_CMD_DELETE;
+    break;
+  case 7:
+    if(!memcmp(s, "OPTIONS", 7))   return RTSP_CMD_OPTIONS;
+    break;
+  case 8:
+    if(!memcmp(s, "DESCRIBE", 8))  return RTSP_CMD_DESCRIBE;
+    if(!memcmp(s, "TEARDOWN", 8))  return RTSP_CMD_TEARDOWN;
+    break;
+  }
+  return -1;
+}
+
+
+/**
+ *
+ */
+static int
+http_parse_request_line(http_parser_t *hps, char *line, char *end)
+{
+  char *sp1, *sp2;
+
+  if((sp1 = memchr(line, ' ', end - line)) == NULL)
+    return -HTTP_STATUS_BAD_REQUEST;
+
+  if((sp2 = memchr(sp1 + 1, ' ', end - sp1 - 1)) == NULL ||
+     sp2 == sp1 + 1 || end - sp2 - 1 != 8)
+    return -HTTP_STATUS_BAD_REQUEST;
+
+  if(!memcmp(sp2 + 1, "HTTP/1.1", 8))
+    hps->hps_version = HTTP_VERSION_1_1;
+  else if(!memcmp(sp2 + 1, "HTTP/1.0", 8))
+    hps->hps_version = HTTP_VERSION_1_0;
+  else if(!memcmp(sp2 + 1, "RTSP/1.0", 8))
+    hps->hps_version = RTSP_VERSION_1_0;
+  else if(!memcmp(sp2 + 1, "HTTP/2.0", 8))
+    hps->hps_version = HTTP_VERSION_2; // Only valid in the h2 preface
+  else
+    return -HTTP_STATUS_BAD_REQUEST;
+
+  if((hps->hps_cmd = http_method_lookup(line, sp1 - line)) == -1)
+    return -HTTP_STATUS_NOT_IMPLEMENTED;
+
+  *sp2 = 0;
+  hps->hps_path = sp1 + 1;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+http_parse_header_line(http_parser_t *hps, char *line, char *end)
+{
+  char *colon, *v;
+
+  // Obsolete line folding (RFC 7230 3.2.4) and whitespace before colon
+  // are both rejected
+  if(*line == ' ' || *line == '\t')
+    return -HTTP_STATUS_BAD_REQUEST;
+
+  if((colon = memchr(line, ':', end - line)) == NULL || colon == line ||
+     colon[-1] == ' ' || colon[-1] == '\t')
+    return -HTTP_STATUS_BAD_REQUEST;
+
+  *colon = 0;
+
+  v = colon + 1;
+  while(v < end && (*v == ' ' || *v == '\t'))
+    v++;
+  while(end > v && (end[-1] == ' ' || end[-1] == '\t'))
+    end--;
+  *end = 0;
+
+  return http_parser_add_header(hps, line, colon - line, v, end - v);
+}
+
+
+/**
+ * Add a header that was not read from the buffer (HTTP/2). Name and
+ * value must be NUL terminated and stay around for the request
+ */
+int
+http_parser_add_header(http_parser_t *hps, char *name, int name_len,
+                       char *value, int value_len)
+{
+  http_header_t *hh;
+
+  if(hps->hps_num_headers == HTTP_MAX_HEADERS)
+    return -HTTP_STATUS_HEADER_TOO_LARGE;
+
+  hh = &hps->hps_headers[hps->hps_num_headers++];
+  hh->hh_name = name;
+  hh->hh_value = value;
+  hh->hh_value_len = value_len;
+  hh->hh_id = http_header_lookup(name, name_len);
+
+  if(hh->hh_id != HTTP_HDR_UNKNOWN && hps->hps_known[hh->hh_id] == NULL)
+    hps->hps_known[hh->hh_id] = value;
+  return 0;
+}
+
+
+/**
+ * Returns size of complete header (including the terminating empty line)
+ * 0 if more data is needed, or a negated HTTP status code on error
+ */
+int
+http_parser_parse(http_parser_t *hps, char *buf, int len)
+{
+  char *line, *lf, *end;
+  int r;
+
+  while(hps->hps_scan < len) {
+    line = buf + hps->hps_scan;
+    if((lf = memchr(line, '\n', len - hps->hps_scan)) == NULL)
+      return 0;
+
+    hps->hps_scan = lf + 1 - buf;
+
+    end = lf;
+    if(end > line && end[-1] == '\r')
+      end--;
+    *end = 0;
+
+    switch(hps->hps_state) {
+    case HTTP_PARSE_REQUEST_LINE:
+      if(end == line)
+        continue; // Be robust and ignore empty lines (RFC 7230 3.5)
+
+      if((r = http_parse_request_line(hps, line, end)) != 0)
+        return r;
+      hps->hps_state = HTTP_PARSE_HEADERS;
+      break;
+
+    case HTTP_PARSE_HEADERS:
+      if(end == line)
+        return hps->hps_scan;
+
+      if((r = http_parse_header_line(hps, line, end)) != 0)
+        return r;
+      break;
+    }
+  }
+  return 0;
+}
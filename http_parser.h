@@ -0,0 +1,85 @@
+/*
+ *  HTTP request header parser
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#define HTTP_MAX_HEADERS 64
+
+/**
+ * Headers the server itself cares about. These are resolved to an
+ * index while parsing so lookups never need to compare strings
+ */
+typedef enum {
+  HTTP_HDR_ACCEPT_ENCODING,
+  HTTP_HDR_AUTHORIZATION,
+  HTTP_HDR_CONNECTION,
+  HTTP_HDR_CONTENT_LENGTH,
+  HTTP_HDR_CONTENT_TYPE,
+  HTTP_HDR_EXPECT,
+  HTTP_HDR_HOST,
+  HTTP_HDR_IF_MODIFIED_SINCE,
+  HTTP_HDR_IF_NONE_MATCH,
+  HTTP_HDR_RANGE,
+  HTTP_HDR_TRANSFER_ENCODING,
+  HTTP_HDR_UPGRADE,
+  HTTP_HDR_num,
+} http_header_id_t;
+
+#define HTTP_HDR_UNKNOWN HTTP_HDR_num
+
+
+/**
+ * A header as found in the receive buffer. Name and value point
+ * straight into the buffer (NUL terminated in place)
+ */
+typedef struct http_header {
+  char *hh_name;
+  char *hh_value;
+  int hh_value_len;
+  int hh_id;
+} http_header_t;
+
+
+typedef struct http_parser {
+  enum {
+    HTTP_PARSE_REQUEST_LINE,
+    HTTP_PARSE_HEADERS,
+  } hps_state;
+
+  int hps_scan;  // Offset in buffer where scan for next LF resumes
+
+  int hps_cmd;
+  int hps_version;
+  char *hps_path;
+
+  int hps_num_headers;
+  http_header_t hps_headers[HTTP_MAX_HEADERS];
+
+  const char *hps_known[HTTP_HDR_num];
+
+} http_parser_t;
+
+
+void http_parser_init(http_parser_t *hps);
+
+int http_parser_parse(http_parser_t *hps, char *buf, int len);
+
+int http_parser_add_header(http_parser_t *hps, char *name, int name_len,
+                           char *value, int value_len);
+
+int http_method_lookup(const char *s, int len);
@@ -0,0 +1,194 @@
+/*
+ *  HTTP route classes
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/param.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "misc.h"
+#include "cfg.h"
+#include "http.h"
+#include "http_qos.h"
+
+/**
+ * Connections are served by a shared pool of threads, so a class can't
+ * get threads of its own. Instead each class bounds how many of its
+ * handlers run at once and how many requests may wait for one of those
+ * slots. A flood of requests to one class then holds at most
+ * maxActive + maxQueued threads and the rest of the pool stays
+ * available to the other classes. Anything beyond that is turned away
+ * right after routing, before the body is read.
+ *
+ * Configured as http.class.<n>.maxActive, maxQueued and queueTimeout
+ * (milliseconds). Classes without maxActive are not limited
+ */
+
+typedef struct qos_class_config {
+  int max_active;
+  int max_queued;
+  int queue_timeout;
+} qos_class_config_t;
+
+typedef struct qos_config {
+  qos_class_config_t classes[HTTP_ROUTE_CLASSES];
+} qos_config_t;
+
+typedef struct qos_lane {
+  pthread_mutex_t ql_mutex;
+  pthread_cond_t ql_cond;
+  int ql_active;
+  int ql_queued;
+  uint64_t ql_rejected;
+} __attribute__((aligned(64))) qos_lane_t;
+
+static qos_lane_t qos_lanes[HTTP_ROUTE_CLASSES];
+static pthread_once_t qos_once = PTHREAD_ONCE_INIT;
+
+
+static void
+qos_config_fill(void *opaque, cfg_t *cr)
+{
+  qos_config_t *c = opaque;
+  char id[8];
+
+  for(int i = 0; i < HTTP_ROUTE_CLASSES; i++) {
+    qos_class_config_t *qcc = &c->classes[i];
+    snprintf(id, sizeof(id), "%d", i);
+    qcc->max_active =
+      MAX(cfg_get_int(cr, CFG("http", "class", id, "maxActive"), 0), 0);
+    qcc->max_queued =
+      MAX(cfg_get_int(cr, CFG("http", "class", id, "maxQueued"),
+                      qcc->max_active), 0);
+    qcc->queue_timeout =
+      MAX(cfg_get_int(cr, CFG("http", "class", id, "queueTimeout"),
+                      5000), 0);
+  }
+}
+
+CFG_VIEW(qos_config_t, qos_config, qos_config_fill);
+
+
+/**
+ *
+ */
+static void
+qos_init(void)
+{
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+  for(int i = 0; i < HTTP_ROUTE_CLASSES; i++) {
+    pthread_mutex_init(&qos_lanes[i].ql_mutex, NULL);
+    pthread_cond_init(&qos_lanes[i].ql_cond, &attr);
+  }
+  pthread_condattr_destroy(&attr);
+}
+
+
+/**
+ *
+ */
+int
+http_qos_enter(int class)
+{
+  const qos_class_config_t *qcc = &qos_config()->classes[class];
+  qos_lane_t *ql = &qos_lanes[class];
+  struct timespec deadline;
+  int r = 0;
+
+  if(qcc->max_active == 0)
+    return 0;
+
+  pthread_once(&qos_once, qos_init);
+
+  pthread_mutex_lock(&ql->ql_mutex);
+
+  if(ql->ql_active < qcc->max_active) {
+    ql->ql_active++;
+    pthread_mutex_unlock(&ql->ql_mutex);
+    return 1;
+  }
+
+  if(ql->ql_queued >= qcc->max_queued) {
+    ql->ql_rejected++;
+    pthread_mutex_unlock(&ql->ql_mutex);
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec  += qcc->queue_timeout / 1000;
+  deadline.tv_nsec += (qcc->queue_timeout % 1000) * 1000000;
+  if(deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  ql->ql_queued++;
+  while(ql->ql_active >= qcc->max_active && r != ETIMEDOUT)
+    r = pthread_cond_timedwait(&ql->ql_cond, &ql->ql_mutex, &deadline);
+  ql->ql_queued--;
+
+  if(ql->ql_active >= qcc->max_active) {
+    ql->ql_rejected++;
+    r = -1;
+  } else {
+    ql->ql_active++;
+    r = 1;
+  }
+  pthread_mutex_unlock(&ql->ql_mutex);
+  return r;
+}
+
+
+/**
+ *
+ */
+void
+http_qos_leave(int class)
+{
+  qos_lane_t *ql = &qos_lanes[class];
+
+  pthread_mutex_lock(&ql->ql_mutex);
+  ql->ql_active--;
+  if(ql->ql_queued)
+    pthread_cond_signal(&ql->ql_cond);
+  pthread_mutex_unlock(&ql->ql_mutex);
+}
+
+
+/**
+ *
+ */
+void
+http_qos_get_stats(int class, http_qos_stats_t *stats)
+{
+  qos_lane_t *ql = &qos_lanes[class];
+
+  pthread_once(&qos_once, qos_init);
+
+  pthread_mutex_lock(&ql->ql_mutex);
+  stats->max_active = qos_config()->classes[class].max_active;
+  stats->active = ql->ql_active;
+  stats->queued = ql->ql_queued;
+  stats->rejected = ql->ql_rejected;
+  pthread_mutex_unlock(&ql->ql_mutex);
+}
@@ -0,0 +1,40 @@
+/*
+ *  HTTP route classes
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+typedef struct http_qos_stats {
+  int max_active;  // 0 if the class is not limited
+  int active;
+  int queued;
+  uint64_t rejected;
+} http_qos_stats_t;
+
+/**
+ * Take a slot in the class, waiting in its queue if all are busy.
+ * Returns 1 when a slot was taken, it is given back with
+ * http_qos_leave(). Returns 0 if the class is not limited and -1 if it
+ * is overloaded, the request should then be answered with 503
+ */
+int http_qos_enter(int class);
+
+void http_qos_leave(int class);
+
+void http_qos_get_stats(int class, http_qos_stats_t *stats);
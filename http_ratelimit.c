@@ -0,0 +1,202 @@
+/*
+ *  HTTP request rate limiting
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/param.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+
+#include "misc.h"
+#include "cfg.h"
+#include "http_ratelimit.h"
+
+/**
+ * Buckets live in a fixed size table split into shards, each with its
+ * own mutex which is only held to look up and update one slot. A
+ * bucket is stored as the time at which it will be full again, so a
+ * slot whose time has passed is as good as empty and can be reused
+ * without any separate expiry. When all slots a key may use are busy
+ * the one closest to full is taken over.
+ *
+ * Slots are matched on a 64 bit hash of scope and client only, a
+ * collision just makes two clients share a bucket
+ */
+
+#define RATELIMIT_SHARDS 64   // Power of two
+#define RATELIMIT_SLOTS  256  // Per shard, power of two
+#define RATELIMIT_PROBE  8
+
+typedef struct ratelimit_slot {
+  uint64_t key;
+  int64_t full;  // When the bucket has refilled, usec
+} ratelimit_slot_t;
+
+typedef struct ratelimit_shard {
+  pthread_mutex_t rs_mutex;
+  ratelimit_slot_t rs_slots[RATELIMIT_SLOTS];
+} __attribute__((aligned(64))) ratelimit_shard_t;
+
+static ratelimit_shard_t ratelimit_shards[RATELIMIT_SHARDS];
+static pthread_once_t ratelimit_once = PTHREAD_ONCE_INIT;
+
+
+static void
+ratelimit_config_fill(void *opaque, cfg_t *cr)
+{
+  http_ratelimit_t *c = opaque;
+  const char *key = cfg_get_str(cr, CFG("http", "rateLimit", "key"), "peer");
+
+  c->rate =
+    MIN(MAX(cfg_get_int(cr, CFG("http", "rateLimit", "rate"), 0), 0), 1000000);
+  c->burst =
+    MAX(cfg_get_int(cr, CFG("http", "rateLimit", "burst"), c->rate), 1);
+
+  if(!strcasecmp(key, "user"))
+    c->key = HTTP_RATELIMIT_USER;
+  else if(!strcasecmp(key, "route"))
+    c->key = HTTP_RATELIMIT_ROUTE;
+  else
+    c->key = HTTP_RATELIMIT_PEER;
+}
+
+CFG_VIEW(http_ratelimit_t, ratelimit_config, ratelimit_config_fill);
+
+
+/**
+ *
+ */
+const http_ratelimit_t *
+http_ratelimit_default(void)
+{
+  return ratelimit_config();
+}
+
+
+/**
+ *
+ */
+static void
+ratelimit_init(void)
+{
+  for(int i = 0; i < RATELIMIT_SHARDS; i++)
+    pthread_mutex_init(&ratelimit_shards[i].rs_mutex, NULL);
+}
+
+
+/**
+ * FNV-1a
+ */
+static uint64_t
+ratelimit_hash(uint64_t h, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  while(len--) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+
+/**
+ *
+ */
+static uint64_t
+ratelimit_key(http_connection_t *hc, const void *scope, int key)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  h = ratelimit_hash(h, &scope, sizeof(scope));
+
+  switch(key) {
+  case HTTP_RATELIMIT_USER:
+    if(hc->hc_username != NULL) {
+      h = ratelimit_hash(h, "u", 1);
+      return ratelimit_hash(h, hc->hc_username, strlen(hc->hc_username));
+    }
+    // FALLTHRU
+  case HTTP_RATELIMIT_PEER:
+    h = ratelimit_hash(h, "p", 1);
+    return ratelimit_hash(h, &hc->hc_peer->sin_addr,
+                          sizeof(hc->hc_peer->sin_addr));
+  default:
+    return h;
+  }
+}
+
+
+/**
+ * Find the slot for key, or claim one for it
+ */
+static ratelimit_slot_t *
+ratelimit_slot(ratelimit_shard_t *rs, uint64_t key, int64_t now)
+{
+  ratelimit_slot_t *free = NULL, *oldest = NULL;
+  const unsigned int start = key >> 32;
+
+  for(int i = 0; i < RATELIMIT_PROBE; i++) {
+    ratelimit_slot_t *s = &rs->rs_slots[(start + i) & (RATELIMIT_SLOTS - 1)];
+    if(s->key == key)
+      return s;
+    if(free == NULL && s->full <= now)
+      free = s;
+    if(oldest == NULL || s->full < oldest->full)
+      oldest = s;
+  }
+
+  if(free == NULL)
+    free = oldest;
+  free->key = key;
+  free->full = 0;
+  return free;
+}
+
+
+/**
+ *
+ */
+int
+http_ratelimit_check(http_connection_t *hc, const void *scope,
+                     const http_ratelimit_t *rl)
+{
+  if(rl->rate <= 0)
+    return 0;
+
+  pthread_once(&ratelimit_once, ratelimit_init);
+
+  const uint64_t key = ratelimit_key(hc, scope, rl->key);
+  ratelimit_shard_t *rs = &ratelimit_shards[key & (RATELIMIT_SHARDS - 1)];
+  const int64_t interval = 1000000 / rl->rate;
+  const int64_t window = interval * rl->burst;
+  const int64_t now = get_ts();
+  int64_t full, wait = 0;
+
+  pthread_mutex_lock(&rs->rs_mutex);
+  ratelimit_slot_t *s = ratelimit_slot(rs, key, now);
+  full = MAX(s->full, now) + interval;
+  if(full - now > window)
+    wait = full - now - window;
+  else
+    s->full = full;
+  pthread_mutex_unlock(&rs->rs_mutex);
+
+  return wait ? (wait + 999999) / 1000000 : 0;
+}
@@ -0,0 +1,40 @@
+/*
+ *  HTTP request rate limiting
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "http.h"
+
+typedef struct http_ratelimit {
+  int rate;   // Requests per second, 0 is unlimited
+  int burst;  // Requests let through back to back
+  int key;    // HTTP_RATELIMIT_*
+} http_ratelimit_t;
+
+/**
+ * Limit from http.rateLimit, used for routes without one of their own
+ */
+const http_ratelimit_t *http_ratelimit_default(void);
+
+/**
+ * Take a token from the bucket of the client (or route) within scope.
+ * Returns 0 if the request may proceed, otherwise the number of seconds
+ * until it would be let through
+ */
+int http_ratelimit_check(http_connection_t *hc, const void *scope,
+                         const http_ratelimit_t *rl);
@@ -0,0 +1,676 @@
+/*
+ *  Static content for the HTTP server
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <zlib.h>
+
+#include "http.h"
+#include "filebundle.h"
+#include "trace.h"
+#include "misc.h"
+#include "cfg.h"
+
+static pthread_mutex_t http_static_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static const struct {
+  const char *ext;
+  const char *type;
+} mimetypes[] = {
+  { "html",  "text/html; charset=UTF-8" },
+  { "htm",   "text/html; charset=UTF-8" },
+  { "css",   "text/css; charset=UTF-8" },
+  { "js",    "application/javascript; charset=UTF-8" },
+  { "json",  "application/json" },
+  { "map",   "application/json" },
+  { "txt",   "text/plain; charset=UTF-8" },
+  { "xml",   "application/xml" },
+  { "svg",   "image/svg+xml" },
+  { "png",   "image/png" },
+  { "jpg",   "image/jpeg" },
+  { "jpeg",  "image/jpeg" },
+  { "gif",   "image/gif" },
+  { "ico",   "image/x-icon" },
+  { "webp",  "image/webp" },
+  { "woff",  "font/woff" },
+  { "woff2", "font/woff2" },
+  { "ttf",   "font/ttf" },
+  { "wasm",  "application/wasm" },
+  { "pdf",   "application/pdf" },
+};
+
+
+/**
+ *
+ */
+static const char *
+http_static_content_type(const char *filename)
+{
+  const char *ext = strrchr(filename, '.');
+  if(ext != NULL) {
+    ext++;
+    for(int i = 0; i < sizeof(mimetypes) / sizeof(mimetypes[0]); i++)
+      if(!strcasecmp(ext, mimetypes[i].ext))
+        return mimetypes[i].type;
+  }
+  return "application/octet-stream";
+}
+
+
+/**
+ * FNV-1a
+ */
+static unsigned int
+http_static_hash(const char *s)
+{
+  unsigned int h = 2166136261u;
+  while(*s)
+    h = (h ^ (unsigned char)*s++) * 16777619u;
+  return h;
+}
+
+
+/**
+ * Filebundles
+ *
+ * Everything that can be is computed when the bundle is mounted so
+ * serving a file is a hash lookup followed by header generation
+ */
+typedef struct bundle_file {
+  struct bundle_file *bf_hash_next;
+  const struct filebundle_entry *bf_fe;
+  const char *bf_content_type;
+  char *bf_etag_gz;     // ETag of gzip'ed representation
+
+  const void *bf_plain; // Decompressed copy, created on first need
+  int bf_plain_len;
+} bundle_file_t;
+
+
+typedef struct bundle_mount {
+  unsigned int bm_hash_mask;
+  bundle_file_t **bm_hash;
+} bundle_mount_t;
+
+
+/**
+ *
+ */
+static const void *
+bundle_file_plain(bundle_file_t *bf)
+{
+  const struct filebundle_entry *fe = bf->bf_fe;
+  const void *r;
+
+  pthread_mutex_lock(&http_static_mutex);
+  if(bf->bf_plain == NULL) {
+    void *out = malloc(fe->original_size);
+    z_stream z;
+
+    memset(&z, 0, sizeof(z));
+    inflateInit2(&z, 15 + 16);
+    z.next_in = (void *)fe->data;
+    z.avail_in = fe->size;
+    z.next_out = out;
+    z.avail_out = fe->original_size;
+    if(inflate(&z, Z_FINISH) == Z_STREAM_END) {
+      bf->bf_plain = out;
+      bf->bf_plain_len = z.total_out;
+    } else {
+      trace(LOG_ERR, "HTTP: Unable to decompress bundled file %s",
+            fe->filename);
+      free(out);
+    }
+    inflateEnd(&z);
+  }
+  r = bf->bf_plain;
+  pthread_mutex_unlock(&http_static_mutex);
+  return r;
+}
+
+
+/**
+ *
+ */
+static int
+http_bundle_serve(http_connection_t *hc, const char *remain, void *opaque)
+{
+  bundle_mount_t *bm = opaque;
+  bundle_file_t *bf;
+  const char *encoding = NULL;
+  const char *etag;
+  const void *data;
+  int len;
+
+  if(remain == NULL)
+    remain = "index.html";
+
+  bf = bm->bm_hash[http_static_hash(remain) & bm->bm_hash_mask];
+  for(; bf != NULL; bf = bf->bf_hash_next)
+    if(!strcmp(bf->bf_fe->filename, remain))
+      break;
+
+  if(bf == NULL)
+    return 404;
+
+  const struct filebundle_entry *fe = bf->bf_fe;
+
+  if(fe->original_size == -1) {
+    data = fe->data;
+    len = fe->size;
+    etag = fe->etag;
+  } else {
+    http_arg_set(&hc->hc_response_headers, "Vary", "Accept-Encoding");
+
+    if(http_encoding_accepted(hc, HTTP_ENCODING_GZIP)) {
+      data = fe->data;
+      len = fe->size;
+      etag = bf->bf_etag_gz;
+      encoding = "gzip";
+    } else {
+      if((data = bundle_file_plain(bf)) == NULL)
+        return 500;
+      len = bf->bf_plain_len;
+      etag = fe->etag;
+    }
+  }
+
+  if(etag != NULL) {
+    http_arg_set(&hc->hc_response_headers, "ETag", etag);
+
+    if(http_etag_match(hc, etag))
+      return http_send_header(hc, HTTP_STATUS_NOT_MODIFIED, NULL, 0,
+                              NULL, NULL, 0, NULL, NULL, NULL) ? -1 : 0;
+  }
+
+  if(http_send_header(hc, HTTP_STATUS_OK, bf->bf_content_type, len,
+                      encoding, NULL, 0, NULL, NULL, NULL))
+    return -1;
+
+  return http_send_data(hc, data, len);
+}
+
+
+/**
+ * Serve the filebundle with the given prefix under path
+ */
+void
+http_path_add_filebundle(const char *path, const char *prefix)
+{
+  const struct filebundle *fb = filebundle_find(prefix);
+  const struct filebundle_entry *fe;
+  bundle_mount_t *bm;
+  int num = 0, size = 16;
+
+  if(fb == NULL) {
+    trace(LOG_ERR, "HTTP: No filebundle %s to serve on %s", prefix, path);
+    return;
+  }
+
+  for(fe = fb->entries; fe->filename != NULL; fe++)
+    num++;
+  while(size < num * 2)
+    size *= 2;
+
+  bm = calloc(1, sizeof(bundle_mount_t));
+  bm->bm_hash_mask = size - 1;
+  bm->bm_hash = calloc(size, sizeof(bundle_file_t *));
+
+  for(fe = fb->entries; fe->filename != NULL; fe++) {
+    bundle_file_t *bf = calloc(1, sizeof(bundle_file_t));
+    bf->bf_fe = fe;
+    bf->bf_content_type = http_static_content_type(fe->filename);
+
+    if(fe->etag != NULL && fe->original_size != -1) {
+      // "xxx" -> "xxx-gz"
+      int len = strlen(fe->etag);
+      bf->bf_etag_gz = malloc(len + 4);
+      memcpy(bf->bf_etag_gz, fe->etag, len - 1);
+      strcpy(bf->bf_etag_gz + len - 1, "-gz\"");
+    }
+
+    unsigned int h = http_static_hash(fe->filename) & bm->bm_hash_mask;
+    bf->bf_hash_next = bm->bm_hash[h];
+    bm->bm_hash[h] = bf;
+  }
+
+  http_path_add(path, bm, http_bundle_serve);
+}
+
+
+/**
+ * Files on disk
+ *
+ * Open files and their metadata are kept in a bounded cache. Entries
+ * are revalidated with stat() at most once per second and replaced if
+ * the file has changed. Bodies are sent with sendfile so nothing is
+ * buffered in memory
+ */
+
+#define FILE_CACHE_HASH_SIZE 256
+
+typedef struct file_cache_entry {
+  LIST_ENTRY(file_cache_entry) fce_hash_link;
+  TAILQ_ENTRY(file_cache_entry) fce_lru_link;
+  char *fce_path;
+  int fce_refcount;  // Cache holds one reference while linked
+
+  int fce_fd;
+  int64_t fce_size;
+  dev_t fce_dev;
+  ino_t fce_ino;
+  time_t fce_mtime;
+  time_t fce_checked;
+
+  const char *fce_content_type;
+  char fce_etag[64];
+  char fce_last_modified[32];
+} file_cache_entry_t;
+
+static LIST_HEAD(, file_cache_entry) file_cache_hash[FILE_CACHE_HASH_SIZE];
+static TAILQ_HEAD(file_cache_entry_queue, file_cache_entry) file_cache_lru =
+  TAILQ_HEAD_INITIALIZER(file_cache_lru);
+static int file_cache_entries;
+
+
+typedef struct http_static_config {
+  int file_cache_size;
+} http_static_config_t;
+
+static void
+http_static_config_fill(void *opaque, cfg_t *cr)
+{
+  http_static_config_t *c = opaque;
+  c->file_cache_size =
+    MAX(cfg_get_int(cr, CFG("http", "fileCacheSize"), 256), 1);
+}
+
+CFG_VIEW(http_static_config_t, http_static_config, http_static_config_fill);
+
+
+/**
+ * Must be called with http_static_mutex held
+ */
+static void
+file_cache_release_locked(file_cache_entry_t *fce)
+{
+  if(--fce->fce_refcount > 0)
+    return;
+  close(fce->fce_fd);
+  free(fce->fce_path);
+  free(fce);
+}
+
+
+/**
+ *
+ */
+static void
+file_cache_release(file_cache_entry_t *fce)
+{
+  pthread_mutex_lock(&http_static_mutex);
+  file_cache_release_locked(fce);
+  pthread_mutex_unlock(&http_static_mutex);
+}
+
+
+/**
+ * Must be called with http_static_mutex held
+ */
+static void
+file_cache_unlink(file_cache_entry_t *fce)
+{
+  LIST_REMOVE(fce, fce_hash_link);
+  TAILQ_REMOVE(&file_cache_lru, fce, fce_lru_link);
+  file_cache_entries--;
+  file_cache_release_locked(fce);
+}
+
+
+/**
+ * Must be called with http_static_mutex held
+ */
+static file_cache_entry_t *
+file_cache_find(const char *path, unsigned int hash)
+{
+  file_cache_entry_t *fce;
+
+  LIST_FOREACH(fce, &file_cache_hash[hash], fce_hash_link)
+    if(!strcmp(fce->fce_path, path))
+      break;
+  return fce;
+}
+
+
+/**
+ * Returns a referenced entry or NULL with errno set
+ */
+static file_cache_entry_t *
+file_cache_get(const char *path)
+{
+  unsigned int hash = http_static_hash(path) % FILE_CACHE_HASH_SIZE;
+  file_cache_entry_t *fce;
+  time_t now = time(NULL);
+  struct stat st;
+  int fd, found;
+
+  pthread_mutex_lock(&http_static_mutex);
+  fce = file_cache_find(path, hash);
+  if(fce != NULL && fce->fce_checked == now)
+    goto hit;
+  pthread_mutex_unlock(&http_static_mutex);
+
+  found = !stat(path, &st);
+
+  pthread_mutex_lock(&http_static_mutex);
+  fce = file_cache_find(path, hash);
+  if(fce != NULL) {
+    if(found && fce->fce_mtime == st.st_mtime &&
+       fce->fce_size == st.st_size && fce->fce_ino == st.st_ino &&
+       fce->fce_dev == st.st_dev) {
+      fce->fce_checked = now;
+      goto hit;
+    }
+    file_cache_unlink(fce);
+  }
+  pthread_mutex_unlock(&http_static_mutex);
+
+  if(!found)
+    return NULL;
+
+  if(!S_ISREG(st.st_mode)) {
+    errno = S_ISDIR(st.st_mode) ? EISDIR : ENOENT;
+    return NULL;
+  }
+
+  if((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    return NULL;
+
+  // Make sure the metadata describes what we actually opened
+  if(fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+    close(fd);
+    errno = ENOENT;
+    return NULL;
+  }
+
+  fce = calloc(1, sizeof(file_cache_entry_t));
+  fce->fce_path = strdup(path);
+  fce->fce_refcount = 2;
+  fce->fce_fd = fd;
+  fce->fce_size = st.st_size;
+  fce->fce_dev = st.st_dev;
+  fce->fce_ino = st.st_ino;
+  fce->fce_mtime = st.st_mtime;
+  fce->fce_checked = now;
+  fce->fce_content_type = http_static_content_type(path);
+  snprintf(fce->fce_etag, sizeof(fce->fce_etag),
+           "\"%"PRIx64"-%"PRIx64"-%"PRIx64"\"", (uint64_t)st.st_ino,
+           (uint64_t)st.st_size, (uint64_t)st.st_mtime);
+  snprintf(fce->fce_last_modified, sizeof(fce->fce_last_modified), "%s",
+           time_to_http_date(st.st_mtime));
+
+  int max = http_static_config()->file_cache_size;
+
+  pthread_mutex_lock(&http_static_mutex);
+  file_cache_entry_t *old = file_cache_find(path, hash);
+  if(old != NULL)
+    file_cache_unlink(old);
+
+  LIST_INSERT_HEAD(&file_cache_hash[hash], fce, fce_hash_link);
+  TAILQ_INSERT_HEAD(&file_cache_lru, fce, fce_lru_link);
+  file_cache_entries++;
+
+  while(file_cache_entries > max)
+    file_cache_unlink(TAILQ_LAST(&file_cache_lru, file_cache_entry_queue));
+
+  pthread_mutex_unlock(&http_static_mutex);
+  return fce;
+
+ hit:
+  fce->fce_refcount++;
+  TAILQ_REMOVE(&file_cache_lru, fce, fce_lru_link);
+  TAILQ_INSERT_HEAD(&file_cache_lru, fce, fce_lru_link);
+  pthread_mutex_unlock(&http_static_mutex);
+  return fce;
+}
+
+
+/**
+ * Parse a single byte range (RFC 7233 2.1)
+ *
+ * Returns 0 if range is valid, 1 if not satisfiable and -1 if the header
+ * should be ignored (syntax error or multiple ranges)
+ */
+static int
+http_parse_range(const char *s, int64_t size, int64_t *startp, int64_t *endp)
+{
+  int64_t start, end;
+  char *e;
+
+  if(strncmp(s, "bytes=", 6))
+    return -1;
+  s += 6;
+
+  if(strchr(s, ',') != NULL)
+    return -1;
+
+  if(*s == '-') {
+    // Suffix range
+    end = strtoll(s + 1, &e, 10);
+    if(e == s + 1 || *e)
+      return -1;
+    if(end == 0 || size == 0)
+      return 1;
+    *startp = end > size ? 0 : size - end;
+    *endp = size - 1;
+    return 0;
+  }
+
+  start = strtoll(s, &e, 10);
+  if(e == s || *e != '-' || start < 0)
+    return -1;
+  s = e + 1;
+
+  if(*s == 0) {
+    end = size - 1;
+  } else {
+    end = strtoll(s, &e, 10);
+    if(e == s || *e || end < start)
+      return -1;
+    if(end >= size)
+      end = size - 1;
+  }
+
+  if(start >= size)
+    return 1;
+
+  *startp = start;
+  *endp = end;
+  return 0;
+}
+
+
+/**
+ * HTTP/2 streams need the body framed, so no sendfile there
+ */
+static int
+file_send_framed(http_connection_t *hc, int fd, int64_t offset, int64_t len)
+{
+  char buf[16384];
+  ssize_t r;
+
+  while(len > 0) {
+    r = pread(fd, buf, MIN(len, sizeof(buf)), offset);
+    if(r <= 0)
+      return -1;
+    if(http_send_data(hc, buf, r))
+      return -1;
+    offset += r;
+    len -= r;
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+http_send_file(http_connection_t *hc, file_cache_entry_t *fce)
+{
+  const char *range = http_header_get(hc, HTTP_HDR_RANGE);
+  int64_t start = 0, end = fce->fce_size - 1;
+  char crange[80];
+  int rc = HTTP_STATUS_OK;
+
+  http_arg_set(&hc->hc_response_headers, "ETag", fce->fce_etag);
+  http_arg_set(&hc->hc_response_headers, "Last-Modified",
+               fce->fce_last_modified);
+
+  const char *inm = http_header_get(hc, HTTP_HDR_IF_NONE_MATCH);
+  const char *ims = http_header_get(hc, HTTP_HDR_IF_MODIFIED_SINCE);
+
+  if(inm != NULL ? http_etag_match(hc, fce->fce_etag) :
+     ims != NULL && !strcmp(ims, fce->fce_last_modified))
+    return http_send_header(hc, HTTP_STATUS_NOT_MODIFIED, NULL, 0,
+                            NULL, NULL, 0, NULL, NULL, NULL) ? -1 : 0;
+
+  if(range != NULL) {
+    // If-Range holding anything but our current validator means the
+    // client's partial copy is stale, send everything
+    const char *ifrange = http_arg_get(&hc->hc_args, "If-Range");
+    if(ifrange != NULL && strcmp(ifrange, fce->fce_etag) &&
+       strcmp(ifrange, fce->fce_last_modified))
+      range = NULL;
+  }
+
+  if(range != NULL) {
+    switch(http_parse_range(range, fce->fce_size, &start, &end)) {
+    case 0:
+      rc = HTTP_STATUS_PARTIAL_CONTENT;
+      snprintf(crange, sizeof(crange), "bytes %"PRId64"-%"PRId64"/%"PRId64,
+               start, end, fce->fce_size);
+      break;
+    case 1:
+      snprintf(crange, sizeof(crange), "bytes */%"PRId64, fce->fce_size);
+      return http_send_header(hc, HTTP_STATUS_RANGE_NOT_SATISFIABLE, NULL, 0,
+                              NULL, NULL, 0, crange, NULL, NULL) ? -1 : 0;
+    default:
+      range = NULL;
+      break;
+    }
+  }
+
+  if(range == NULL)
+    http_arg_set(&hc->hc_response_headers, "Accept-Ranges", "bytes");
+
+  if(http_send_header(hc, rc, fce->fce_content_type, end - start + 1,
+                      NULL, NULL, 0, range ? crange : NULL, NULL, NULL))
+    return -1;
+
+  if(hc->hc_no_output || end < start)
+    return 0;
+
+  if(hc->hc_h2 != NULL)
+    return file_send_framed(hc, fce->fce_fd, start, end - start + 1);
+
+  if(http_output_flush(hc))
+    return -1;
+
+  hc->hc_bytes_out += end - start + 1;
+  return tcp_sendfile_range(hc->hc_ts, fce->fce_fd, start, end - start + 1) ?
+    -1 : 0;
+}
+
+
+/**
+ * Reject anything that could escape the document root
+ */
+static int
+http_static_path_ok(const char *p)
+{
+  while(*p) {
+    const char *seg = p;
+    while(*p && *p != '/')
+      p++;
+    int len = p - seg;
+    if(len == 0 || (seg[0] == '.' && (len == 1 ||
+                                      (len == 2 && seg[1] == '.'))))
+      return 0;
+    if(memchr(seg, '\\', len))
+      return 0;
+    if(*p == '/')
+      p++;
+  }
+  return 1;
+}
+
+
+/**
+ *
+ */
+static int
+http_directory_serve(http_connection_t *hc, const char *remain, void *opaque)
+{
+  const char *root = opaque;
+  file_cache_entry_t *fce;
+  char *path;
+  int r;
+
+  if(remain == NULL)
+    remain = "";
+  else if(!http_static_path_ok(remain))
+    return 404;
+
+  path = alloca(strlen(root) + strlen(remain) + sizeof("//index.html"));
+  sprintf(path, "%s/%s", root, remain);
+
+  fce = file_cache_get(path);
+  if(fce == NULL && errno == EISDIR) {
+    strcat(path, "/index.html");
+    fce = file_cache_get(path);
+  }
+
+  if(fce == NULL)
+    return 404;
+
+  r = http_send_file(hc, fce);
+  file_cache_release(fce);
+  return r;
+}
+
+
+/**
+ * Serve files from a directory in the filesystem under path
+ */
+void
+http_path_add_directory(const char *path, const char *root)
+{
+  http_path_add(path, strdup(root), http_directory_serve);
+}
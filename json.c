@@ -465,3 +465,263 @@ json_deserialize(const char *src, const json_deserializer_t *jd, void *opaque,
   }
   return c;
 }
+
+
+/**
+ *
+ */
+static const char *
+json_skip_string(const char *s)
+{
+  if(*s != '"')
+    return NULL;
+
+  for(s++; *s != '"'; s++) {
+    if(*s == 0)
+      return NULL;
+    if(*s == '\\' && *++s == 0)
+      return NULL;
+  }
+  return s + 1;
+}
+
+
+/**
+ *
+ */
+static const char *
+json_skip_number(const char *s)
+{
+  const char *start;
+
+  if(*s == '-')
+    s++;
+  start = s;
+  while(*s >= '0' && *s <= '9')
+    s++;
+  if(s == start)
+    return NULL;
+
+  if(*s == '.') {
+    start = ++s;
+    while(*s >= '0' && *s <= '9')
+      s++;
+    if(s == start)
+      return NULL;
+  }
+
+  if(*s == 'e' || *s == 'E') {
+    s++;
+    if(*s == '+' || *s == '-')
+      s++;
+    start = s;
+    while(*s >= '0' && *s <= '9')
+      s++;
+    if(s == start)
+      return NULL;
+  }
+  return s;
+}
+
+
+/**
+ *
+ */
+static const char *
+json_skip(const char *s, int depth)
+{
+  s = skip_ws(s, NULL, NULL, NULL);
+
+  const char end = *s == '{' ? '}' : ']';
+
+  switch(*s) {
+  case '"':
+    return json_skip_string(s);
+
+  case '{':
+  case '[':
+    if(depth == 512)
+      return NULL;
+
+    s = skip_ws(s + 1, NULL, NULL, NULL);
+    if(*s == end)
+      return s + 1;
+
+    while(1) {
+      if(end == '}') {
+        if((s = json_skip_string(skip_ws(s, NULL, NULL, NULL))) == NULL)
+          return NULL;
+        s = skip_ws(s, NULL, NULL, NULL);
+        if(*s++ != ':')
+          return NULL;
+      }
+
+      if((s = json_skip(s, depth + 1)) == NULL)
+        return NULL;
+
+      s = skip_ws(s, NULL, NULL, NULL);
+      if(*s == end)
+        return s + 1;
+      if(*s++ != ',')
+        return NULL;
+    }
+
+  case 't':
+    return strncmp(s, "true", 4) ? NULL : s + 4;
+  case 'f':
+    return strncmp(s, "false", 5) ? NULL : s + 5;
+  case 'n':
+    return strncmp(s, "null", 4) ? NULL : s + 4;
+  default:
+    return json_skip_number(s);
+  }
+}
+
+
+/**
+ *
+ */
+const char *
+json_skip_value(const char *s)
+{
+  return json_skip(s, 0);
+}
+
+
+/**
+ * Returns the value for the key in the map at s
+ */
+static const char *
+json_find_key(const char *s, const char *key, size_t keylen)
+{
+  const char *k, *e, *fp, *fm;
+  char *name;
+  int match;
+
+  s = skip_ws(s + 1, NULL, NULL, NULL);
+  if(*s == '}')
+    return NULL;
+
+  while(1) {
+    k = skip_ws(s, NULL, NULL, NULL);
+    if((e = json_skip_string(k)) == NULL)
+      return NULL;
+
+    if(memchr(k, '\\', e - k) == NULL) {
+      match = e - k - 2 == keylen && !memcmp(k + 1, key, keylen);
+    } else {
+      // Escaped key, decode before comparing
+      name = json_parse_string(k, &e, &fp, &fm);
+      if(name == NULL)
+        return NULL;
+      match = strlen(name) == keylen && !memcmp(name, key, keylen);
+      free(name);
+    }
+
+    s = skip_ws(e, NULL, NULL, NULL);
+    if(*s++ != ':')
+      return NULL;
+    if(match)
+      return s;
+
+    if((s = json_skip_value(s)) == NULL)
+      return NULL;
+    s = skip_ws(s, NULL, NULL, NULL);
+    if(*s++ != ',')
+      return NULL;
+  }
+}
+
+
+/**
+ * Returns the value at index in the list at s
+ */
+static const char *
+json_find_index(const char *s, int index)
+{
+  s = skip_ws(s + 1, NULL, NULL, NULL);
+  if(*s == ']')
+    return NULL;
+
+  for(; index > 0; index--) {
+    if((s = json_skip_value(s)) == NULL)
+      return NULL;
+    s = skip_ws(s, NULL, NULL, NULL);
+    if(*s++ != ',')
+      return NULL;
+  }
+  return s;
+}
+
+
+/**
+ *
+ */
+const char *
+json_find(const char *s, const char *path)
+{
+  while(1) {
+    s = skip_ws(s, NULL, NULL, NULL);
+    if(*path == 0)
+      return s;
+
+    const size_t len = strcspn(path, ".");
+
+    if(*s == '{') {
+      s = json_find_key(s, path, len);
+    } else if(*s == '[') {
+      char *end;
+      long index = strtol(path, &end, 10);
+      if(end != path + len || index < 0 || index > INT_MAX)
+        return NULL;
+      s = json_find_index(s, index);
+    } else {
+      return NULL;
+    }
+
+    if(s == NULL)
+      return NULL;
+
+    path += len;
+    if(*path == '.')
+      path++;
+  }
+}
+
+
+/**
+ *
+ */
+char *
+json_get_str(const char *src, const char *path)
+{
+  const char *s = json_find(src, path);
+  const char *end, *failp, *failmsg;
+  char *r;
+
+  if(s == NULL)
+    return NULL;
+
+  r = json_parse_string(s, &end, &failp, &failmsg);
+  return r == NOT_THIS_TYPE ? NULL : r;
+}
+
+
+/**
+ *
+ */
+int
+json_get_int64(const char *src, const char *path, int64_t *v)
+{
+  const char *s = json_find(src, path);
+  char *end;
+
+  if(s == NULL || json_skip_number(s) == NULL)
+    return -1;
+
+  long long l = strtoll(s, &end, 10);
+  if(*end == '.' || *end == 'e' || *end == 'E' || end == s)
+    return -1;
+  *v = l;
+  return 0;
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 typedef struct json_deserializer {
   void *(*jd_create_map)(void *jd_opaque);
   void *(*jd_create_list)(void *jd_opaque);
@@ -32,3 +34,27 @@ typedef struct json_deserializer {
 
 void *json_deserialize(const char *src, const json_deserializer_t *jd,
 		       void *opaque, char *errbuf, size_t errlen);
+
+/**
+ * Returns the end of the JSON value at s, or NULL if it is malformed.
+ * Nothing is allocated
+ */
+const char *json_skip_value(const char *s);
+
+/**
+ * Locate a value in a JSON document without parsing the rest of it.
+ * path is a '.' separated list of map keys and list indices, such as
+ * "items.0.name". Returns the start of the raw value or NULL
+ */
+const char *json_find(const char *src, const char *path);
+
+/**
+ * Returns a malloced copy of the string at path, NULL if it's missing
+ * or not a string
+ */
+char *json_get_str(const char *src, const char *path);
+
+/**
+ * Returns 0 if the value at path is an integer (stored in *v)
+ */
+int json_get_int64(const char *src, const char *path, int64_t *v);
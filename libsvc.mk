@@ -23,6 +23,7 @@ SRCS += \
 	libsvc/cfg.c \
 	libsvc/cmd.c \
 	libsvc/talloc.c \
+	libsvc/arena.c \
 	libsvc/filebundle.c \
 	libsvc/memstream.c \
 
@@ -60,6 +61,16 @@ endif
 
 ifeq (${WITH_HTTP_SERVER},yes)
 SRCS    +=  libsvc/http.c
+SRCS    +=  libsvc/http_parser.c
+SRCS    +=  libsvc/http_static.c
+SRCS    +=  libsvc/http_accesslog.c
+SRCS    +=  libsvc/http_metrics.c
+SRCS    +=  libsvc/http_ratelimit.c
+SRCS    +=  libsvc/http_qos.c
+SRCS    +=  libsvc/http_multipart.c
+SRCS    +=  libsvc/http2.c
+SRCS    +=  libsvc/hpack.c
+LDFLAGS +=  -lz
 WITH_TCP_SERVER := yes
 CFLAGS += -DWITH_HTTP_SERVER
 endif
@@ -78,7 +89,13 @@ endif
 ##############################################################
 
 ifeq (${WITH_ASYNCIO},yes)
+CFLAGS += -DWITH_ASYNCIO
 SRCS +=  libsvc/asyncio.c
+SRCS +=  libsvc/http_client.c
+ifeq (${WITH_HTTP_SERVER},yes)
+SRCS +=  libsvc/websocket.c
+SRCS +=  libsvc/sse.c
+endif
 endif
 
 ##############################################################
@@ -135,7 +152,7 @@ $(BUILDDIR)/bundles/%.o: $(BUILDDIR)/bundles/%.c $(ALLDEPS)
 
 $(BUILDDIR)/bundles/%.c: % $(CURDIR)/libsvc/mkbundle $(ALLDEPS)
 	@mkdir -p $(dir $@)
-	$(MKBUNDLE) -o $@ -s $< -d  ${BUILDDIR}/bundles/$<.d -p $<
+	$(MKBUNDLE) ${MKBUNDLE_FLAGS} -o $@ -s $< -d  ${BUILDDIR}/bundles/$<.d -p $<
 
 # File bundles
 BUNDLES += $(sort $(BUNDLES-yes))
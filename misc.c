@@ -526,6 +526,65 @@ static const char *months[12] = {
 };
 
 
+/**
+ * Formatted timestamps are cached per thread. Two slots so that
+ * alternating between 'now' and some other time (Date vs. Expires)
+ * doesn't thrash
+ */
+typedef struct datecache {
+  time_t dc_time;
+  char dc_str[32]; // "Sun, 06 Nov 1994 08:49:37 GMT"
+} datecache_t;
+
+static __thread datecache_t datecache[2];
+static __thread int datecache_next;
+
+static inline char *
+fmt2(char *p, int v)
+{
+  p[0] = '0' + v / 10;
+  p[1] = '0' + v % 10;
+  return p + 2;
+}
+
+static const datecache_t *
+datecache_get(time_t t)
+{
+  datecache_t *dc;
+  struct tm tm0, *tm;
+  char *p;
+
+  if(datecache[0].dc_time == t && datecache[0].dc_str[0])
+    return &datecache[0];
+  if(datecache[1].dc_time == t && datecache[1].dc_str[0])
+    return &datecache[1];
+
+  dc = &datecache[datecache_next];
+  datecache_next ^= 1;
+
+  tm = gmtime_r(&t, &tm0);
+  p = dc->dc_str;
+  memcpy(p, days[tm->tm_wday], 3);
+  p[3] = ',';
+  p[4] = ' ';
+  p = fmt2(p + 5, tm->tm_mday);
+  *p++ = ' ';
+  memcpy(p, months[tm->tm_mon], 3);
+  p[3] = ' ';
+  p = fmt2(p + 4, (tm->tm_year + 1900) / 100);
+  p = fmt2(p, (tm->tm_year + 1900) % 100);
+  *p++ = ' ';
+  p = fmt2(p, tm->tm_hour);
+  *p++ = ':';
+  p = fmt2(p, tm->tm_min);
+  *p++ = ':';
+  p = fmt2(p, tm->tm_sec);
+  memcpy(p, " GMT", 5);
+  dc->dc_time = t;
+  return dc;
+}
+
+
 /**
  *
  */
@@ -533,14 +592,19 @@ const char *
 time_to_RFC_1123(time_t t)
 {
   static __thread char rbuf[64];
-  struct tm tm0, *tm;
-
-  tm = gmtime_r(&t, &tm0);
-  snprintf(rbuf, sizeof(rbuf),
-           "%s, %02d %s %02d %02d:%02d:%02d +0000",
-           days[tm->tm_wday], tm->tm_mday,
-           months[tm->tm_mon], tm->tm_year + 1900,
-           tm->tm_hour, tm->tm_min, tm->tm_sec);
+  const datecache_t *dc = datecache_get(t);
 
+  memcpy(rbuf, dc->dc_str, 25);
+  memcpy(rbuf + 25, " +0000", 7);
   return rbuf;
 }
+
+
+/**
+ * IMF-fixdate as used in HTTP headers (RFC 7231 7.1.1.1)
+ */
+const char *
+time_to_http_date(time_t t)
+{
+  return datecache_get(t)->dc_str;
+}
@@ -66,3 +66,5 @@ int hex2bin(uint8_t *buf, size_t buflen, const char *str);
 void bin2hex(char *dst, size_t dstlen, const uint8_t *src, size_t srclen);
 
 const char *time_to_RFC_1123(time_t t);
+
+const char *time_to_http_date(time_t t);
@@ -0,0 +1,558 @@
+/*
+ *  Server-Sent Events
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sse.h"
+#include "asyncio.h"
+#include "htsmsg_json.h"
+#include "cfg.h"
+
+/**
+ * Subscribed connections are detached from the HTTP server and parked
+ * on asyncio.
+ *
+ * A published event is formatted once into a sse_event_t and appended
+ * to the channel's event list. Each subscriber has a cursor into that
+ * list and writes straight from the shared buffers, so publishing
+ * costs one allocation regardless of the number of subscribers. An
+ * event is freed once every cursor has moved past it.
+ *
+ * Subscribers that can't keep up (more than sse.maxBacklog bytes
+ * behind) are disconnected.
+ *
+ * All state is protected by sse_mutex. Sockets are only written from
+ * the asyncio thread.
+ */
+
+#define SSE_IOV_MAX 16
+
+typedef struct sse_config {
+  int max_backlog;
+  int keepalive_interval;
+} sse_config_t;
+
+static void
+sse_config_fill(void *opaque, cfg_t *cr)
+{
+  sse_config_t *c = opaque;
+  c->max_backlog =
+    cfg_get_int(cr, CFG("sse", "maxBacklog"), 1024 * 1024);
+  c->keepalive_interval =
+    cfg_get_int(cr, CFG("sse", "keepaliveInterval"), 30);
+}
+
+CFG_VIEW(sse_config_t, sse_config, sse_config_fill);
+
+
+TAILQ_HEAD(sse_event_queue, sse_event);
+LIST_HEAD(sse_subscriber_list, sse_subscriber);
+LIST_HEAD(sse_channel_list, sse_channel);
+TAILQ_HEAD(sse_channel_queue, sse_channel);
+
+typedef struct sse_event {
+  TAILQ_ENTRY(sse_event) se_link;
+  int se_refcount;     // Cursors pointing here
+  int64_t se_offset;   // Position in channel byte stream
+  int se_len;
+  char se_data[0];
+} sse_event_t;
+
+
+typedef struct sse_channel {
+  LIST_ENTRY(sse_channel) sc_link;
+  TAILQ_ENTRY(sse_channel) sc_dirty_link;
+  int sc_dirty;
+  char *sc_name;
+  struct sse_event_queue sc_events;
+  struct sse_subscriber_list sc_subscribers;
+  int sc_num_subscribers;
+  int64_t sc_bytes;
+  int sc_seq;
+} sse_channel_t;
+
+
+typedef struct sse_subscriber {
+  LIST_ENTRY(sse_subscriber) ss_link;
+  sse_channel_t *ss_channel;
+  char *ss_channel_name;   // Until attached
+  int ss_fd;
+  async_fd_t *ss_af;
+  sse_event_t *ss_cursor;  // Next event to write, NULL if caught up
+  int ss_offset;           // Bytes of ss_cursor already written
+  int ss_blocked;          // Waiting for POLLOUT
+  int ss_dead;             // Shut down, waiting for read side to fail
+} sse_subscriber_t;
+
+
+static pthread_mutex_t sse_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct sse_channel_list sse_channels;
+static struct sse_channel_queue sse_dirty;
+static struct sse_subscriber_list sse_attach;
+static int sse_wakeup_pending;
+static int sse_worker_id;
+static pthread_once_t sse_once = PTHREAD_ONCE_INIT;
+static asyncio_timer_t sse_keepalive_timer;
+
+
+/**
+ *
+ */
+static sse_channel_t *
+sse_channel_find(const char *name)
+{
+  sse_channel_t *sc;
+  LIST_FOREACH(sc, &sse_channels, sc_link)
+    if(!strcmp(sc->sc_name, name))
+      return sc;
+  return NULL;
+}
+
+
+/**
+ * Free events no cursor can reach anymore
+ */
+static void
+sse_channel_trim(sse_channel_t *sc)
+{
+  sse_event_t *se;
+
+  while((se = TAILQ_FIRST(&sc->sc_events)) != NULL && !se->se_refcount) {
+    TAILQ_REMOVE(&sc->sc_events, se, se_link);
+    free(se);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+sse_schedule(sse_channel_t *sc)
+{
+  if(!sc->sc_dirty) {
+    sc->sc_dirty = 1;
+    TAILQ_INSERT_TAIL(&sse_dirty, sc, sc_dirty_link);
+  }
+
+  if(!sse_wakeup_pending) {
+    sse_wakeup_pending = 1;
+    asyncio_wakeup_worker(sse_worker_id);
+  }
+}
+
+
+/**
+ * Queue a formatted event, sse_mutex held
+ */
+static void
+sse_channel_append(sse_channel_t *sc, sse_event_t *se)
+{
+  sse_subscriber_t *ss;
+
+  se->se_offset = sc->sc_bytes;
+  sc->sc_bytes += se->se_len;
+  TAILQ_INSERT_TAIL(&sc->sc_events, se, se_link);
+
+  LIST_FOREACH(ss, &sc->sc_subscribers, ss_link) {
+    if(ss->ss_cursor == NULL && !ss->ss_dead) {
+      ss->ss_cursor = se;
+      se->se_refcount++;
+    }
+  }
+
+  sse_channel_trim(sc); // In case there are no subscribers
+  sse_schedule(sc);
+}
+
+
+/**
+ *
+ */
+static sse_event_t *
+sse_event_create(const char *str, int len)
+{
+  sse_event_t *se = malloc(sizeof(sse_event_t) + len);
+  se->se_refcount = 0;
+  se->se_len = len;
+  memcpy(se->se_data, str, len);
+  return se;
+}
+
+
+/**
+ *
+ */
+void
+sse_publish(const char *channel, const char *event, const char *data)
+{
+  sse_channel_t *sc;
+  htsbuf_queue_t hq;
+  const char *s;
+  char *str;
+  int len;
+
+  pthread_mutex_lock(&sse_mutex);
+
+  if((sc = sse_channel_find(channel)) != NULL) {
+    htsbuf_queue_init(&hq, 0);
+    htsbuf_qprintf(&hq, "id: %d\n", ++sc->sc_seq);
+    if(event != NULL)
+      htsbuf_qprintf(&hq, "event: %s\n", event);
+
+    do {
+      s = strchr(data, '\n');
+      len = s ? s - data : strlen(data);
+      HTSBUF_APPEND_CONST(&hq, "data: ");
+      htsbuf_append(&hq, data, len);
+      HTSBUF_APPEND_CONST(&hq, "\n");
+      data = s + 1;
+    } while(s != NULL);
+    HTSBUF_APPEND_CONST(&hq, "\n");
+
+    len = hq.hq_size;
+    str = htsbuf_to_string(&hq);
+    sse_channel_append(sc, sse_event_create(str, len));
+    free(str);
+  }
+
+  pthread_mutex_unlock(&sse_mutex);
+}
+
+
+/**
+ *
+ */
+void
+sse_publish_json(const char *channel, const char *event, htsmsg_t *msg)
+{
+  char *json = htsmsg_json_serialize_to_str(msg, 0);
+  sse_publish(channel, event, json);
+  free(json);
+}
+
+
+/**
+ *
+ */
+int
+sse_subscribers(const char *channel)
+{
+  sse_channel_t *sc;
+  int r;
+
+  pthread_mutex_lock(&sse_mutex);
+  sc = sse_channel_find(channel);
+  r = sc ? sc->sc_num_subscribers : 0;
+  pthread_mutex_unlock(&sse_mutex);
+  return r;
+}
+
+
+/**
+ * Stop writing and shut the socket down. The subscriber is freed when
+ * the read side reports the error, as asyncio may still have events
+ * pending for it
+ */
+static void
+sse_kill(sse_subscriber_t *ss)
+{
+  if(ss->ss_dead)
+    return;
+  ss->ss_dead = 1;
+
+  if(ss->ss_cursor != NULL) {
+    ss->ss_cursor->se_refcount--;
+    ss->ss_cursor = NULL;
+  }
+  if(ss->ss_blocked)
+    asyncio_pollout(ss->ss_af, 0);
+  shutdown(ss->ss_fd, SHUT_RDWR);
+}
+
+
+/**
+ * Write as much as the socket takes, sse_mutex held
+ */
+static void
+sse_write(sse_subscriber_t *ss)
+{
+  struct iovec iov[SSE_IOV_MAX];
+  struct msghdr msg = {.msg_iov = iov};
+  sse_event_t *se, *next;
+  int off, n;
+  ssize_t r;
+
+  while((se = ss->ss_cursor) != NULL) {
+
+    off = ss->ss_offset;
+    for(n = 0; se != NULL && n < SSE_IOV_MAX; n++) {
+      iov[n].iov_base = se->se_data + off;
+      iov[n].iov_len = se->se_len - off;
+      off = 0;
+      se = TAILQ_NEXT(se, se_link);
+    }
+    msg.msg_iovlen = n;
+
+    r = sendmsg(ss->ss_fd, &msg, MSG_NOSIGNAL);
+    if(r == -1) {
+      if(errno == EINTR)
+        continue;
+
+      if(errno == EAGAIN) {
+        if(!ss->ss_blocked) {
+          ss->ss_blocked = 1;
+          asyncio_pollout(ss->ss_af, 1);
+        }
+        return;
+      }
+      sse_kill(ss);
+      break;
+    }
+
+    while(r > 0) {
+      se = ss->ss_cursor;
+      if(r < se->se_len - ss->ss_offset) {
+        ss->ss_offset += r;
+        break;
+      }
+      r -= se->se_len - ss->ss_offset;
+      next = TAILQ_NEXT(se, se_link);
+      se->se_refcount--;
+      if(next != NULL)
+        next->se_refcount++;
+      ss->ss_cursor = next;
+      ss->ss_offset = 0;
+    }
+  }
+
+  if(ss->ss_blocked && ss->ss_cursor == NULL) {
+    ss->ss_blocked = 0;
+    if(!ss->ss_dead)
+      asyncio_pollout(ss->ss_af, 0);
+  }
+  sse_channel_trim(ss->ss_channel);
+}
+
+
+/**
+ *
+ */
+static void
+sse_pollout(async_fd_t *af)
+{
+  sse_subscriber_t *ss = af->af_opaque;
+
+  pthread_mutex_lock(&sse_mutex);
+  if(!ss->ss_dead)
+    sse_write(ss);
+  pthread_mutex_unlock(&sse_mutex);
+}
+
+
+/**
+ * Nothing is expected from the client, this is only how we learn that
+ * it went away
+ */
+static void
+sse_read(void *opaque, htsbuf_queue_t *hq)
+{
+  htsbuf_queue_flush(hq);
+}
+
+
+/**
+ *
+ */
+static void
+sse_error(void *opaque, int error)
+{
+  sse_subscriber_t *ss = opaque;
+  sse_channel_t *sc = ss->ss_channel;
+
+  pthread_mutex_lock(&sse_mutex);
+
+  sse_kill(ss);
+  LIST_REMOVE(ss, ss_link);
+  sse_channel_trim(sc);
+
+  if(--sc->sc_num_subscribers == 0) {
+    // Nothing can be queued without subscribers
+    assert(TAILQ_FIRST(&sc->sc_events) == NULL);
+    if(sc->sc_dirty)
+      TAILQ_REMOVE(&sse_dirty, sc, sc_dirty_link);
+    LIST_REMOVE(sc, sc_link);
+    free(sc->sc_name);
+    free(sc);
+  }
+
+  pthread_mutex_unlock(&sse_mutex);
+
+  asyncio_close(ss->ss_af);
+  free(ss);
+}
+
+
+/**
+ * Comment lines keep proxies from timing out idle streams and make us
+ * notice dead peers
+ */
+static void
+sse_keepalive(void *opaque)
+{
+  static const char comment[] = ":\n\n";
+  int interval = sse_config()->keepalive_interval;
+  sse_channel_t *sc;
+
+  pthread_mutex_lock(&sse_mutex);
+  LIST_FOREACH(sc, &sse_channels, sc_link)
+    sse_channel_append(sc, sse_event_create(comment, sizeof(comment) - 1));
+  pthread_mutex_unlock(&sse_mutex);
+
+  asyncio_timer_arm(&sse_keepalive_timer,
+                    asyncio_now() + MAX(interval, 1) * 1000000LL);
+}
+
+
+/**
+ *
+ */
+static void
+sse_attach_subscriber(sse_subscriber_t *ss)
+{
+  sse_channel_t *sc = sse_channel_find(ss->ss_channel_name);
+
+  if(sc == NULL) {
+    sc = calloc(1, sizeof(sse_channel_t));
+    sc->sc_name = ss->ss_channel_name;
+    TAILQ_INIT(&sc->sc_events);
+    LIST_INIT(&sc->sc_subscribers);
+    LIST_INSERT_HEAD(&sse_channels, sc, sc_link);
+  } else {
+    free(ss->ss_channel_name);
+  }
+  ss->ss_channel_name = NULL;
+  ss->ss_channel = sc;
+
+  LIST_INSERT_HEAD(&sc->sc_subscribers, ss, ss_link);
+  sc->sc_num_subscribers++;
+
+  ss->ss_af = asyncio_stream(ss->ss_fd, sse_read, sse_error, ss);
+  ss->ss_af->af_pollout = sse_pollout;
+}
+
+
+/**
+ * Runs on the asyncio thread
+ */
+static void
+sse_worker(void)
+{
+  const sse_config_t *conf = sse_config();
+  sse_subscriber_t *ss;
+  sse_channel_t *sc;
+
+  pthread_mutex_lock(&sse_mutex);
+  sse_wakeup_pending = 0;
+
+  if(!sse_keepalive_timer.at_expire) {
+    asyncio_timer_init(&sse_keepalive_timer, sse_keepalive, NULL);
+    asyncio_timer_arm(&sse_keepalive_timer,
+                      asyncio_now() + conf->keepalive_interval * 1000000LL);
+  }
+
+  while((ss = LIST_FIRST(&sse_attach)) != NULL) {
+    LIST_REMOVE(ss, ss_link);
+    sse_attach_subscriber(ss);
+  }
+
+  while((sc = TAILQ_FIRST(&sse_dirty)) != NULL) {
+    TAILQ_REMOVE(&sse_dirty, sc, sc_dirty_link);
+    sc->sc_dirty = 0;
+
+    LIST_FOREACH(ss, &sc->sc_subscribers, ss_link) {
+      if(ss->ss_dead || ss->ss_cursor == NULL)
+        continue;
+
+      if(!ss->ss_blocked) {
+        sse_write(ss);
+      } else if(sc->sc_bytes - ss->ss_cursor->se_offset - ss->ss_offset >
+                conf->max_backlog) {
+        sse_kill(ss);
+      }
+    }
+    sse_channel_trim(sc);
+  }
+
+  pthread_mutex_unlock(&sse_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+sse_init(void)
+{
+  TAILQ_INIT(&sse_dirty);
+  sse_worker_id = asyncio_add_worker(sse_worker);
+}
+
+
+/**
+ *
+ */
+int
+sse_subscribe(http_connection_t *hc, const char *channel)
+{
+  sse_subscriber_t *ss;
+  int fd;
+
+  if(hc->hc_h2 != NULL)
+    return HTTP_STATUS_BAD_REQUEST; // Can't detach a stream
+
+  if(http_send_header(hc, HTTP_STATUS_OK, "text/event-stream", -1,
+                      NULL, NULL, 0, NULL, NULL, NULL))
+    return HTTP_ERROR_DISCONNECT;
+
+  if((fd = http_detach(hc)) == -1)
+    return HTTP_ERROR_DISCONNECT;
+
+  pthread_once(&sse_once, sse_init);
+
+  ss = calloc(1, sizeof(sse_subscriber_t));
+  ss->ss_fd = fd;
+  ss->ss_channel_name = strdup(channel);
+
+  pthread_mutex_lock(&sse_mutex);
+  LIST_INSERT_HEAD(&sse_attach, ss, ss_link);
+  if(!sse_wakeup_pending) {
+    sse_wakeup_pending = 1;
+    asyncio_wakeup_worker(sse_worker_id);
+  }
+  pthread_mutex_unlock(&sse_mutex);
+  return 0;
+}
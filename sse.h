@@ -0,0 +1,42 @@
+/*
+ *  Server-Sent Events
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "http.h"
+#include "htsmsg.h"
+
+/**
+ * Reply with a text/event-stream and subscribe the connection to the
+ * named channel. The connection is moved to asyncio, the return value
+ * should be returned from the route/path callback as is.
+ *
+ * Requires asyncio_init()
+ */
+int sse_subscribe(http_connection_t *hc, const char *channel);
+
+/**
+ * Publish an event to all subscribers of a channel. event may be NULL
+ * (clients see it as "message"), data is split into one "data:" line
+ * per line. Safe to call from any thread, no-op if nobody listens
+ */
+void sse_publish(const char *channel, const char *event, const char *data);
+
+void sse_publish_json(const char *channel, const char *event, htsmsg_t *msg);
+
+int sse_subscribers(const char *channel);
@@ -17,6 +17,7 @@
 
 #ifdef linux
 #include <sys/sendfile.h>
+#include <sys/uio.h>
 #endif
 
 #include <sys/param.h>
@@ -40,6 +41,9 @@
 
 #include "tcp.h"
 #include "trace.h"
+#include "misc.h"
+
+#define TCP_WRITEV_MAX 64
 
 static SSL_CTX *ssl_ctx;
 static pthread_mutex_t *ssl_locks;
@@ -61,6 +65,7 @@ struct tcp_stream {
   int ts_read_status;
   int ts_write_status;
 
+  int64_t ts_read_deadline;
 };
 
 
@@ -97,6 +102,25 @@ tcp_close(tcp_stream_t *ts)
 }
 
 
+/**
+ * Free the stream but keep the socket open. Fails (returning -1) if
+ * the stream is SSL or has buffered data
+ */
+int
+tcp_steal_fd(tcp_stream_t *ts)
+{
+  int fd = ts->ts_fd;
+
+  if(ts->ts_ssl != NULL || ts->ts_spill.hq_size || ts->ts_sendq.hq_size)
+    return -1;
+
+  htsbuf_queue_flush(&ts->ts_spill);
+  htsbuf_queue_flush(&ts->ts_sendq);
+  free(ts);
+  return fd;
+}
+
+
 /**
  *
  */
@@ -137,7 +161,36 @@ os_write_try(tcp_stream_t *ts)
 static int
 os_read(struct tcp_stream *ts, void *data, int len, int waitall)
 {
-  return recv(ts->ts_fd, data, len, waitall ? MSG_WAITALL : 0);
+  struct pollfd pfd;
+  int64_t left;
+  int r, got = 0;
+
+  if(ts->ts_read_deadline == 0 || ts->ts_nonblock)
+    return recv(ts->ts_fd, data, len, waitall ? MSG_WAITALL : 0);
+
+  while(got < len) {
+    left = ts->ts_read_deadline - get_ts();
+    if(left <= 0) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+
+    pfd.fd = ts->ts_fd;
+    pfd.events = POLLIN;
+    r = poll(&pfd, 1, (left + 999) / 1000);
+    if(r == 0 || (r == -1 && errno == EINTR))
+      continue;
+
+    r = recv(ts->ts_fd, (char *)data + got, len - got, MSG_DONTWAIT);
+    if(r == -1 && (errno == EAGAIN || errno == EINTR))
+      continue;
+    if(r < 1)
+      return got ?: r;
+    got += r;
+    if(!waitall)
+      break;
+  }
+  return got;
 }
 
 
@@ -395,6 +448,61 @@ tcp_sendfile(tcp_stream_t *ts, int fd, int64_t bytes)
 }
 
 
+/**
+ * Send part of a file without touching the file position, so the same
+ * fd can be used by several threads at once.
+ *
+ * SSL and non-blocking streams go via a bounce buffer
+ */
+int
+tcp_sendfile_range(tcp_stream_t *ts, int fd, int64_t offset, int64_t bytes)
+{
+  if(ts->ts_ssl == NULL && !ts->ts_nonblock) {
+#if defined(__APPLE__)
+    while(bytes > 0) {
+      off_t len = bytes;
+      if(sendfile(fd, ts->ts_fd, offset, &len, NULL, 0) && len == 0 &&
+         errno != EINTR)
+        return -1;
+      offset += len;
+      bytes -= len;
+    }
+    return 0;
+#elif defined(linux)
+    off_t off = offset;
+    while(bytes > 0) {
+      int chunk = MIN(1024 * 1024 * 1024, bytes);
+      int r = sendfile(ts->ts_fd, fd, &off, chunk);
+      if(r < 0 && errno == EINTR)
+        continue;
+      if(r < 1)
+        return -1;
+      bytes -= r;
+    }
+    return 0;
+#endif
+  }
+
+  char buf[16384];
+  while(bytes > 0) {
+    int r = pread(fd, buf, MIN(sizeof(buf), bytes), offset);
+    if(r < 0 && errno == EINTR)
+      continue;
+    if(r < 1)
+      return -1;
+    offset += r;
+    bytes -= r;
+    for(int o = 0; o < r; ) {
+      int w = tcp_write(ts, buf + o, r - o);
+      if(w < 1)
+        return -1;
+      o += w;
+    }
+  }
+  return 0;
+}
+
+
 /**
  *
  */
@@ -424,6 +532,52 @@ tcp_nonblock(tcp_stream_t *ts, int on)
 
 
 
+/**
+ * Write a whole queue on a blocking plain socket, gathering up to
+ * TCP_WRITEV_MAX buffers per syscall
+ */
+static int
+os_write_queue(tcp_stream_t *ts, htsbuf_queue_t *q)
+{
+  struct iovec iov[TCP_WRITEV_MAX];
+  htsbuf_data_t *hd;
+  ssize_t r;
+  size_t l;
+  int i, err = 0;
+
+  while(!TAILQ_EMPTY(&q->hq_q)) {
+    i = 0;
+    TAILQ_FOREACH(hd, &q->hq_q, hd_link) {
+      if(i == TCP_WRITEV_MAX)
+        break;
+      iov[i].iov_base = hd->hd_data + hd->hd_data_off;
+      iov[i].iov_len  = hd->hd_data_len - hd->hd_data_off;
+      i++;
+    }
+
+    r = writev(ts->ts_fd, iov, i);
+    if(r < 0 && errno == EINTR)
+      continue;
+    if(r < 0) {
+      err = 1;
+      break;
+    }
+
+    while((hd = TAILQ_FIRST(&q->hq_q)) != NULL) {
+      l = hd->hd_data_len - hd->hd_data_off;
+      if(l > r) {
+        hd->hd_data_off += r;
+        break;
+      }
+      r -= l;
+      htsbuf_data_free(q, hd);
+    }
+  }
+  htsbuf_queue_flush(q);
+  return err;
+}
+
+
 /**
  *
  */
@@ -433,6 +587,9 @@ tcp_write_queue(tcp_stream_t *ts, htsbuf_queue_t *q)
   htsbuf_data_t *hd;
   int l, err = 0;
 
+  if(ts->ts_ssl == NULL && !ts->ts_nonblock)
+    return os_write_queue(ts, q);
+
   while((hd = TAILQ_FIRST(&q->hq_q)) != NULL) {
     TAILQ_REMOVE(&q->hq_q, hd, hd_link);
 
@@ -550,6 +707,27 @@ tcp_read_data(tcp_stream_t *ts, char *buf, const size_t bufsize)
 }
 
 
+/**
+ *
+ */
+void
+tcp_set_read_deadline(tcp_stream_t *ts, int64_t deadline)
+{
+  ts->ts_read_deadline = deadline;
+}
+
+
+/**
+ *
+ */
+void
+tcp_set_write_timeout(tcp_stream_t *ts, int ms)
+{
+  struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+  setsockopt(ts->ts_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+
 /**
  *
  */
@@ -36,18 +36,41 @@ typedef void (tcp_server_callback_t)(tcp_stream_t *ts, void *opaque,
 void *tcp_server_create(int port, const char *bindaddr,
                         tcp_server_callback_t *start, void *opaque);
 
+typedef struct tcp_server_stats {
+  int threads;      // Started, serving or idle
+  int idle_threads;
+  int max_threads;
+  uint64_t connections;
+  uint64_t pool_waits; // Times a connection had to wait for a thread
+} tcp_server_stats_t;
+
+void tcp_server_get_stats(tcp_server_stats_t *tss);
+
 tcp_stream_t *tcp_stream_create_from_fd(int fd);
 
 tcp_stream_t *tcp_stream_create_ssl_from_fd(int fd);
 
 void tcp_close(tcp_stream_t *ts);
 
+int tcp_steal_fd(tcp_stream_t *ts);
+
 int tcp_read(tcp_stream_t *ts, void *buf, size_t len);
 
 int tcp_read_line(tcp_stream_t *ts, char *buf, const size_t bufsize);
 
 int tcp_read_data(tcp_stream_t *ts, char *buf, const size_t bufsize);
 
+/**
+ * Make reads on a plain (non SSL) stream fail with ETIMEDOUT once the
+ * deadline, a get_ts() timestamp, has passed. 0 disables
+ */
+void tcp_set_read_deadline(tcp_stream_t *ts, int64_t deadline);
+
+/**
+ * Fail blocking writes that make no progress for ms milliseconds
+ */
+void tcp_set_write_timeout(tcp_stream_t *ts, int ms);
+
 int tcp_write_queue(tcp_stream_t *ts, htsbuf_queue_t *q);
 
 int tcp_write(tcp_stream_t *ts, const void *buf, const size_t bufsize);
@@ -56,6 +79,9 @@ void tcp_nonblock(tcp_stream_t *ts, int on);
 
 int tcp_sendfile(tcp_stream_t *ts, int fd, int64_t bytes);
 
+int tcp_sendfile_range(tcp_stream_t *ts, int fd, int64_t offset,
+                       int64_t bytes);
+
 void tcp_prepare_poll(tcp_stream_t *ts, struct pollfd *pfd);
 
 int tcp_can_read(tcp_stream_t *ts, struct pollfd *pfd);
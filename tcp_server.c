@@ -68,6 +68,8 @@ LIST_HEAD(tcp_thread_list, tcp_thread);
 
 static int tcp_num_idle_threads;
 static int tcp_num_active_threads;
+static uint64_t tcp_num_connections;
+static uint64_t tcp_num_pool_waits;
 static pthread_mutex_t tcp_thread_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t tcp_thread_cond = PTHREAD_COND_INITIALIZER;
 static struct tcp_thread_list tcp_idle_threads;
@@ -158,6 +160,8 @@ tcp_server_start(tcp_server_launch_t *tsl)
 
   tcp_thread_t *tt;
 
+  tcp_num_connections++;
+
   while(1) {
     talloc_cleanup();
 
@@ -174,6 +178,7 @@ tcp_server_start(tcp_server_launch_t *tsl)
     assert(tcp_num_idle_threads == 0);
 
     if(tcp_num_active_threads >= MAX_ACTIVE_THREADS) {
+      tcp_num_pool_waits++;
       pthread_cond_wait(&tcp_thread_cond, &tcp_thread_mutex);
       continue;
     }
@@ -195,6 +200,22 @@ tcp_server_start(tcp_server_launch_t *tsl)
 }
 
 
+/**
+ *
+ */
+void
+tcp_server_get_stats(tcp_server_stats_t *tss)
+{
+  pthread_mutex_lock(&tcp_thread_mutex);
+  tss->threads      = tcp_num_active_threads;
+  tss->idle_threads = tcp_num_idle_threads;
+  tss->max_threads  = MAX_ACTIVE_THREADS;
+  tss->connections  = tcp_num_connections;
+  tss->pool_waits   = tcp_num_pool_waits;
+  pthread_mutex_unlock(&tcp_thread_mutex);
+}
+
+
 
 
 
@@ -0,0 +1,874 @@
+/*
+ *  WebSocket server (RFC 6455)
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/param.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <openssl/sha.h>
+
+#include "websocket.h"
+#include "asyncio.h"
+#include "htsmsg_json.h"
+#include "threading.h"
+#include "utf8.h"
+#include "misc.h"
+#include "cfg.h"
+#include "trace.h"
+
+/**
+ * The handshake is done on the HTTP connection thread, after that the
+ * socket is handed to asyncio so an idle WebSocket costs a file
+ * descriptor and a few hundred bytes rather than a thread.
+ *
+ * Everything touching the socket runs on the asyncio thread. Other
+ * threads queue output on the session (under ws_mutex) and wake the
+ * asyncio worker which moves it to the socket.
+ */
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define WS_MSG_KEEP_SIZE 65536  // Keep message buffers up to this size
+
+typedef struct websocket_config {
+  int max_message_size;
+  int max_send_queue;
+  int ping_interval;
+} websocket_config_t;
+
+static void
+websocket_config_fill(void *opaque, cfg_t *cr)
+{
+  websocket_config_t *c = opaque;
+  c->max_message_size =
+    MIN(MAX(cfg_get_int(cr, CFG("websocket", "maxMessageSize"), 1024 * 1024),
+            0), INT_MAX - 1);
+  c->max_send_queue =
+    cfg_get_int(cr, CFG("websocket", "maxSendQueue"), 4 * 1024 * 1024);
+  c->ping_interval =
+    cfg_get_int(cr, CFG("websocket", "pingInterval"), 30);
+}
+
+CFG_VIEW(websocket_config_t, websocket_config, websocket_config_fill);
+
+
+TAILQ_HEAD(websocket_session_queue, websocket_session);
+LIST_HEAD(websocket_member_list, websocket_member);
+
+/**
+ * Group membership, protected by ws_mutex
+ */
+typedef struct websocket_member {
+  LIST_ENTRY(websocket_member) wm_group_link;
+  LIST_ENTRY(websocket_member) wm_session_link;
+  websocket_group_t *wm_group;
+  websocket_session_t *wm_session;
+} websocket_member_t;
+
+struct websocket_group {
+  struct websocket_member_list wg_members;
+  int wg_size;
+};
+
+
+struct websocket_session {
+  int ws_refcount;
+
+  // Protected by ws_mutex
+  enum {
+    WS_STATE_ATTACHING,
+    WS_STATE_OPEN,
+    WS_STATE_CLOSED,
+  } ws_state;
+
+  TAILQ_ENTRY(websocket_session) ws_work_link;
+  int ws_on_work;
+  htsbuf_queue_t ws_pending;
+  int ws_close_status;
+  struct websocket_member_list ws_groups;
+
+  // Set at creation
+  const websocket_callbacks_t *ws_cb;
+  void *ws_opaque;
+  int ws_max_message_size;
+  int ws_max_send_queue;
+  int ws_ping_interval;
+
+  // asyncio thread only
+  int ws_fd;
+  async_fd_t *ws_af;
+  htsbuf_queue_t ws_initial;   // Received along with the handshake
+  asyncio_timer_t ws_timer;
+  int64_t ws_last_rx;
+
+  uint8_t *ws_msg;             // Message being reassembled
+  int ws_msg_len;
+  int ws_msg_size;
+  int ws_msg_opcode;
+};
+
+
+static pthread_mutex_t ws_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct websocket_session_queue ws_work;
+static int ws_wakeup_pending;
+static int ws_worker_id;
+static pthread_once_t ws_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ *
+ */
+void
+websocket_retain(websocket_session_t *ws)
+{
+  atomic_add(&ws->ws_refcount, 1);
+}
+
+
+/**
+ *
+ */
+void
+websocket_release(websocket_session_t *ws)
+{
+  if(atomic_add(&ws->ws_refcount, -1) > 1)
+    return;
+
+  htsbuf_queue_flush(&ws->ws_pending);
+  htsbuf_queue_flush(&ws->ws_initial);
+  free(ws->ws_msg);
+  free(ws);
+}
+
+
+/**
+ * Put session on the work queue for the asyncio thread. ws_mutex held
+ */
+static void
+ws_schedule(websocket_session_t *ws)
+{
+  if(!ws->ws_on_work) {
+    ws->ws_on_work = 1;
+    websocket_retain(ws);
+    TAILQ_INSERT_TAIL(&ws_work, ws, ws_work_link);
+  }
+
+  if(!ws_wakeup_pending) {
+    ws_wakeup_pending = 1;
+    asyncio_wakeup_worker(ws_worker_id);
+  }
+}
+
+
+/**
+ *
+ */
+static int
+ws_frame_header(uint8_t *hdr, int opcode, size_t len)
+{
+  hdr[0] = 0x80 | opcode;
+
+  if(len < 126) {
+    hdr[1] = len;
+    return 2;
+  }
+
+  if(len < 65536) {
+    hdr[1] = 126;
+    hdr[2] = len >> 8;
+    hdr[3] = len;
+    return 4;
+  }
+
+  hdr[1] = 127;
+  for(int i = 0; i < 8; i++)
+    hdr[2 + i] = (uint64_t)len >> (56 - i * 8);
+  return 10;
+}
+
+
+/**
+ * Frame a message into a single buffer that can be copied to any
+ * number of sessions
+ */
+static uint8_t *
+ws_frame(int opcode, const void *data, size_t len, size_t *framelen)
+{
+  uint8_t hdr[10];
+  int hlen = ws_frame_header(hdr, opcode, len);
+  uint8_t *buf = malloc(hlen + len);
+
+  memcpy(buf, hdr, hlen);
+  memcpy(buf + hlen, data, len);
+  *framelen = hlen + len;
+  return buf;
+}
+
+
+/**
+ *
+ */
+static void
+ws_enqueue(websocket_session_t *ws, const void *frame, size_t len)
+{
+  if(ws->ws_state == WS_STATE_CLOSED)
+    return;
+  htsbuf_append(&ws->ws_pending, frame, len);
+  ws_schedule(ws);
+}
+
+
+/**
+ *
+ */
+void
+websocket_send(websocket_session_t *ws, int opcode,
+               const void *data, size_t len)
+{
+  size_t framelen;
+  uint8_t *frame = ws_frame(opcode, data, len, &framelen);
+
+  pthread_mutex_lock(&ws_mutex);
+  ws_enqueue(ws, frame, framelen);
+  pthread_mutex_unlock(&ws_mutex);
+  free(frame);
+}
+
+
+/**
+ *
+ */
+void
+websocket_send_json(websocket_session_t *ws, htsmsg_t *msg)
+{
+  char *json = htsmsg_json_serialize_to_str(msg, 0);
+  websocket_send(ws, WS_OPCODE_TEXT, json, strlen(json));
+  free(json);
+}
+
+
+/**
+ *
+ */
+void
+websocket_close(websocket_session_t *ws, int status)
+{
+  pthread_mutex_lock(&ws_mutex);
+  if(ws->ws_state != WS_STATE_CLOSED && !ws->ws_close_status) {
+    ws->ws_close_status = status;
+    ws_schedule(ws);
+  }
+  pthread_mutex_unlock(&ws_mutex);
+}
+
+
+/**
+ * Send directly, asyncio thread only
+ */
+static void
+ws_send_now(websocket_session_t *ws, int opcode, const void *data, int len)
+{
+  uint8_t hdr[10];
+  int hlen = ws_frame_header(hdr, opcode, len);
+
+  asyncio_send(ws->ws_af, hdr, hlen, 1);
+  asyncio_send(ws->ws_af, data, len, 0);
+}
+
+
+/**
+ *
+ */
+static void
+ws_send_close(websocket_session_t *ws, int status)
+{
+  uint8_t b[2] = {status >> 8, status};
+  ws_send_now(ws, WS_OPCODE_CLOSE, b, sizeof(b));
+}
+
+
+/**
+ * Tear down the session. The close frame (if any) must already be
+ * queued, the kernel delivers it after close()
+ */
+static void
+ws_terminate(websocket_session_t *ws, int error)
+{
+  websocket_member_t *wm;
+
+  if(ws->ws_af == NULL)
+    return;
+
+  pthread_mutex_lock(&ws_mutex);
+  ws->ws_state = WS_STATE_CLOSED;
+  htsbuf_queue_flush(&ws->ws_pending);
+  while((wm = LIST_FIRST(&ws->ws_groups)) != NULL) {
+    LIST_REMOVE(wm, wm_group_link);
+    LIST_REMOVE(wm, wm_session_link);
+    wm->wm_group->wg_size--;
+    free(wm);
+  }
+  pthread_mutex_unlock(&ws_mutex);
+
+  asyncio_timer_disarm(&ws->ws_timer);
+  asyncio_close(ws->ws_af);
+  ws->ws_af = NULL;
+
+  free(ws->ws_msg);
+  ws->ws_msg = NULL;
+  ws->ws_msg_size = ws->ws_msg_len = 0;
+
+  ws->ws_cb->disconnected(ws->ws_opaque, error);
+  websocket_release(ws); // Reference held by asyncio side
+}
+
+
+/**
+ *
+ */
+static void
+ws_fail(websocket_session_t *ws, int status)
+{
+  ws_send_close(ws, status);
+  ws_terminate(ws, status == WS_STATUS_TOO_BIG ? EMSGSIZE : EPROTO);
+}
+
+
+/**
+ * Text messages must be valid UTF-8 (RFC 6455 8.1). Buffer is NUL
+ * terminated so utf8_get() can't read past the end
+ */
+static int
+ws_utf8_valid(const uint8_t *buf, int len)
+{
+  const char *s = (const char *)buf;
+  const char *end = s + len;
+
+  while(s < end) {
+    const char *start = s;
+    if(utf8_get(&s) == 0xfffd &&
+       (s - start != 3 || memcmp(start, "\xef\xbf\xbd", 3)))
+      return 0;
+  }
+  return 1;
+}
+
+
+/**
+ *
+ */
+static void
+ws_control(websocket_session_t *ws, int opcode, const uint8_t *p, int len)
+{
+  int status;
+
+  switch(opcode) {
+  case WS_OPCODE_PING:
+    ws_send_now(ws, WS_OPCODE_PONG, p, len);
+    break;
+
+  case WS_OPCODE_PONG:
+    break;
+
+  case WS_OPCODE_CLOSE:
+    if(len == 1) {
+      ws_fail(ws, WS_STATUS_PROTOCOL);
+      break;
+    }
+    status = len >= 2 ? p[0] << 8 | p[1] : WS_STATUS_NORMAL;
+    ws_send_close(ws, status);
+    ws_terminate(ws, 0);
+    break;
+
+  default:
+    ws_fail(ws, WS_STATUS_PROTOCOL);
+    break;
+  }
+}
+
+
+/**
+ *
+ */
+static void
+ws_data(websocket_session_t *ws, int opcode, int fin)
+{
+  if(opcode == WS_OPCODE_CONTINUATION) {
+    if(ws->ws_msg_opcode == 0) {
+      ws_fail(ws, WS_STATUS_PROTOCOL);
+      return;
+    }
+  } else if(opcode == WS_OPCODE_TEXT || opcode == WS_OPCODE_BINARY) {
+    if(ws->ws_msg_opcode != 0) {
+      ws_fail(ws, WS_STATUS_PROTOCOL);
+      return;
+    }
+    ws->ws_msg_opcode = opcode;
+  } else {
+    ws_fail(ws, WS_STATUS_PROTOCOL);
+    return;
+  }
+
+  if(!fin)
+    return;
+
+  ws->ws_msg[ws->ws_msg_len] = 0;
+  if(ws->ws_msg_opcode == WS_OPCODE_TEXT &&
+     !ws_utf8_valid(ws->ws_msg, ws->ws_msg_len)) {
+    ws_fail(ws, WS_STATUS_INVALID_DATA);
+    return;
+  }
+
+  opcode = ws->ws_msg_opcode;
+  ws->ws_msg_opcode = 0;
+  ws->ws_cb->message(ws->ws_opaque, opcode, ws->ws_msg, ws->ws_msg_len);
+
+  if(ws->ws_af == NULL)
+    return;
+
+  ws->ws_msg_len = 0;
+  if(ws->ws_msg_size > WS_MSG_KEEP_SIZE) {
+    free(ws->ws_msg);
+    ws->ws_msg = NULL;
+    ws->ws_msg_size = 0;
+  }
+}
+
+
+/**
+ * Parse as many complete frames as there are in hq
+ */
+static void
+ws_read(void *opaque, htsbuf_queue_t *hq)
+{
+  websocket_session_t *ws = opaque;
+  uint8_t hdr[14], ctrl[125], *p;
+  int avail, hlen, opcode, fin;
+  uint64_t len;
+
+  ws->ws_last_rx = asyncio_now();
+  websocket_retain(ws);
+
+  while(ws->ws_af != NULL) {
+    avail = htsbuf_peek(hq, hdr, sizeof(hdr));
+    if(avail < 2)
+      break;
+
+    // No extensions are negotiated, clients must mask (RFC 6455 5.1)
+    if(hdr[0] & 0x70 || !(hdr[1] & 0x80)) {
+      ws_fail(ws, WS_STATUS_PROTOCOL);
+      break;
+    }
+
+    fin    = hdr[0] & 0x80;
+    opcode = hdr[0] & 0xf;
+    len    = hdr[1] & 0x7f;
+    hlen   = 2;
+
+    if(len == 126) {
+      hlen = 4;
+      len = hdr[2] << 8 | hdr[3];
+    } else if(len == 127) {
+      hlen = 10;
+      len = 0;
+      for(int i = 0; i < 8; i++)
+        len = len << 8 | hdr[2 + i];
+    }
+    hlen += 4; // Mask
+
+    if(avail < hlen)
+      break;
+
+    // The most significant bit of a 64 bit length must be 0 (RFC 6455 5.2)
+    if(len >> 63) {
+      ws_fail(ws, WS_STATUS_PROTOCOL);
+      break;
+    }
+
+    if(opcode & 0x8) {
+      if(!fin || len > 125) {
+        ws_fail(ws, WS_STATUS_PROTOCOL);
+        break;
+      }
+    } else if(len > ws->ws_max_message_size - ws->ws_msg_len) {
+      ws_fail(ws, WS_STATUS_TOO_BIG);
+      break;
+    }
+
+    if(hq->hq_size < hlen + len)
+      break;
+
+    htsbuf_drop(hq, hlen);
+
+    if(opcode & 0x8) {
+      p = ctrl;
+    } else {
+      if(ws->ws_msg_len + len + 1 > ws->ws_msg_size) {
+        ws->ws_msg_size = ws->ws_msg_len + len + 1;
+        ws->ws_msg = realloc(ws->ws_msg, ws->ws_msg_size);
+      }
+      p = ws->ws_msg + ws->ws_msg_len;
+    }
+
+    htsbuf_read(hq, p, len);
+    for(size_t i = 0; i < len; i++)
+      p[i] ^= hdr[hlen - 4 + (i & 3)];
+
+    if(opcode & 0x8) {
+      ws_control(ws, opcode, ctrl, len);
+    } else {
+      ws->ws_msg_len += len;
+      ws_data(ws, opcode, fin);
+    }
+  }
+
+  websocket_release(ws);
+}
+
+
+/**
+ *
+ */
+static void
+ws_error(void *opaque, int error)
+{
+  ws_terminate(opaque, error);
+}
+
+
+/**
+ * Ping idle sessions, drop those that haven't said anything for two
+ * intervals
+ */
+static void
+ws_timer_cb(void *opaque)
+{
+  websocket_session_t *ws = opaque;
+  int64_t now = asyncio_now();
+  int64_t interval = ws->ws_ping_interval * 1000000LL;
+
+  if(now - ws->ws_last_rx > interval * 2) {
+    ws_fail(ws, WS_STATUS_GOING_AWAY);
+    return;
+  }
+
+  ws_send_now(ws, WS_OPCODE_PING, NULL, 0);
+  asyncio_timer_arm(&ws->ws_timer, now + interval);
+}
+
+
+/**
+ *
+ */
+static void
+ws_attach(websocket_session_t *ws)
+{
+  ws->ws_af = asyncio_stream(ws->ws_fd, ws_read, ws_error, ws);
+  ws->ws_last_rx = asyncio_now();
+
+  if(ws->ws_ping_interval > 0) {
+    asyncio_timer_init(&ws->ws_timer, ws_timer_cb, ws);
+    asyncio_timer_arm(&ws->ws_timer,
+                      ws->ws_last_rx + ws->ws_ping_interval * 1000000LL);
+  }
+
+  ws->ws_cb->connected(ws->ws_opaque, ws);
+
+  if(ws->ws_af != NULL && ws->ws_initial.hq_size) {
+    htsbuf_appendq(&ws->ws_af->af_recvq, &ws->ws_initial);
+    ws_read(ws, &ws->ws_af->af_recvq);
+  }
+}
+
+
+/**
+ * Runs on the asyncio thread when sessions have been scheduled
+ */
+static void
+ws_worker(void)
+{
+  websocket_session_t *ws;
+  htsbuf_queue_t hq;
+  int attach, close_status;
+
+  htsbuf_queue_init(&hq, 0);
+
+  pthread_mutex_lock(&ws_mutex);
+  ws_wakeup_pending = 0;
+
+  while((ws = TAILQ_FIRST(&ws_work)) != NULL) {
+    TAILQ_REMOVE(&ws_work, ws, ws_work_link);
+    ws->ws_on_work = 0;
+
+    attach = ws->ws_state == WS_STATE_ATTACHING;
+    if(attach)
+      ws->ws_state = WS_STATE_OPEN;
+    htsbuf_appendq(&hq, &ws->ws_pending);
+    close_status = ws->ws_close_status;
+    pthread_mutex_unlock(&ws_mutex);
+
+    if(attach)
+      ws_attach(ws);
+
+    if(ws->ws_af != NULL && hq.hq_size) {
+      if(ws->ws_af->af_sendq.hq_size + hq.hq_size > ws->ws_max_send_queue) {
+        // Peer is not keeping up
+        htsbuf_queue_flush(&hq);
+        ws_fail(ws, WS_STATUS_POLICY);
+      } else {
+        asyncio_sendq(ws->ws_af, &hq, 0);
+      }
+    }
+    htsbuf_queue_flush(&hq);
+
+    if(ws->ws_af != NULL && close_status) {
+      ws_send_close(ws, close_status);
+      ws_terminate(ws, 0);
+    }
+
+    websocket_release(ws); // Reference held by work queue
+    pthread_mutex_lock(&ws_mutex);
+  }
+  pthread_mutex_unlock(&ws_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+ws_init(void)
+{
+  TAILQ_INIT(&ws_work);
+  ws_worker_id = asyncio_add_worker(ws_worker);
+}
+
+
+/**
+ *
+ */
+int
+websocket_upgrade(http_connection_t *hc,
+                  const websocket_callbacks_t *callbacks, void *opaque)
+{
+  const websocket_config_t *conf = websocket_config();
+  const char *v, *key;
+  char accept[32], *str;
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  http_arg_t *ra;
+  websocket_session_t *ws;
+  htsbuf_queue_t hq;
+  int fd;
+
+  if(hc->hc_cmd != HTTP_CMD_GET || hc->hc_h2 != NULL)
+    return HTTP_STATUS_BAD_REQUEST;
+
+  v = http_header_get(hc, HTTP_HDR_UPGRADE);
+  if(v == NULL || !http_token_match(v, "websocket"))
+    return HTTP_STATUS_BAD_REQUEST;
+
+  v = http_header_get(hc, HTTP_HDR_CONNECTION);
+  if(v == NULL || !http_token_match(v, "upgrade"))
+    return HTTP_STATUS_BAD_REQUEST;
+
+  v = http_arg_get(&hc->hc_args, "Sec-WebSocket-Version");
+  if(v == NULL || strcmp(v, "13")) {
+    http_arg_set(&hc->hc_response_headers, "Sec-WebSocket-Version", "13");
+    return HTTP_STATUS_UPGRADE_REQUIRED;
+  }
+
+  key = http_arg_get(&hc->hc_args, "Sec-WebSocket-Key");
+  if(key == NULL || strlen(key) != 24)
+    return HTTP_STATUS_BAD_REQUEST;
+
+  str = alloca(strlen(key) + sizeof(WS_GUID));
+  strcpy(str, key);
+  strcat(str, WS_GUID);
+  SHA1((const uint8_t *)str, strlen(str), digest);
+  base64_encode(accept, sizeof(accept), digest, sizeof(digest));
+
+  htsbuf_queue_init(&hq, 0);
+  htsbuf_qprintf(&hq,
+                 "HTTP/1.1 101 Switching Protocols\r\n"
+                 "Upgrade: websocket\r\n"
+                 "Connection: Upgrade\r\n"
+                 "Sec-WebSocket-Accept: %s\r\n", accept);
+  HTTP_ARG_FOREACH(ra, &hc->hc_response_headers)
+    htsbuf_qprintf(&hq, "%s: %s\r\n", ra->key, ra->val);
+  HTSBUF_APPEND_CONST(&hq, "\r\n");
+  htsbuf_appendq(&hc->hc_output, &hq);
+
+  pthread_once(&ws_once, ws_init);
+
+  ws = calloc(1, sizeof(websocket_session_t));
+  ws->ws_refcount = 1; // Released in ws_terminate()
+  ws->ws_state = WS_STATE_ATTACHING;
+  ws->ws_cb = callbacks;
+  ws->ws_opaque = opaque;
+  ws->ws_max_message_size = conf->max_message_size;
+  ws->ws_max_send_queue = conf->max_send_queue;
+  ws->ws_ping_interval = conf->ping_interval;
+  LIST_INIT(&ws->ws_groups);
+  htsbuf_queue_init(&ws->ws_pending, 0);
+  htsbuf_queue_init(&ws->ws_initial, 0);
+
+  // Frames sent right behind the handshake
+  htsbuf_append(&ws->ws_initial, hc->hc_rbuf + hc->hc_rbuf_used,
+                hc->hc_rbuf_len - hc->hc_rbuf_used);
+  hc->hc_rbuf_used = hc->hc_rbuf_len;
+
+  if((fd = http_detach(hc)) == -1) {
+    websocket_release(ws);
+    return HTTP_ERROR_DISCONNECT;
+  }
+  ws->ws_fd = fd;
+
+  pthread_mutex_lock(&ws_mutex);
+  ws_schedule(ws);
+  pthread_mutex_unlock(&ws_mutex);
+  return 0;
+}
+
+
+/**
+ *
+ */
+websocket_group_t *
+websocket_group_create(void)
+{
+  websocket_group_t *wg = calloc(1, sizeof(websocket_group_t));
+  LIST_INIT(&wg->wg_members);
+  return wg;
+}
+
+
+/**
+ *
+ */
+void
+websocket_group_destroy(websocket_group_t *wg)
+{
+  websocket_member_t *wm;
+
+  pthread_mutex_lock(&ws_mutex);
+  while((wm = LIST_FIRST(&wg->wg_members)) != NULL) {
+    LIST_REMOVE(wm, wm_group_link);
+    LIST_REMOVE(wm, wm_session_link);
+    free(wm);
+  }
+  pthread_mutex_unlock(&ws_mutex);
+  free(wg);
+}
+
+
+/**
+ *
+ */
+void
+websocket_group_join(websocket_group_t *wg, websocket_session_t *ws)
+{
+  websocket_member_t *wm;
+
+  pthread_mutex_lock(&ws_mutex);
+
+  LIST_FOREACH(wm, &ws->ws_groups, wm_session_link)
+    if(wm->wm_group == wg)
+      break;
+
+  if(wm == NULL && ws->ws_state != WS_STATE_CLOSED) {
+    wm = malloc(sizeof(websocket_member_t));
+    wm->wm_group = wg;
+    wm->wm_session = ws;
+    LIST_INSERT_HEAD(&wg->wg_members, wm, wm_group_link);
+    LIST_INSERT_HEAD(&ws->ws_groups, wm, wm_session_link);
+    wg->wg_size++;
+  }
+  pthread_mutex_unlock(&ws_mutex);
+}
+
+
+/**
+ *
+ */
+void
+websocket_group_leave(websocket_group_t *wg, websocket_session_t *ws)
+{
+  websocket_member_t *wm;
+
+  pthread_mutex_lock(&ws_mutex);
+  LIST_FOREACH(wm, &ws->ws_groups, wm_session_link) {
+    if(wm->wm_group == wg) {
+      LIST_REMOVE(wm, wm_group_link);
+      LIST_REMOVE(wm, wm_session_link);
+      wg->wg_size--;
+      free(wm);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&ws_mutex);
+}
+
+
+/**
+ *
+ */
+int
+websocket_group_size(websocket_group_t *wg)
+{
+  int size;
+
+  pthread_mutex_lock(&ws_mutex);
+  size = wg->wg_size;
+  pthread_mutex_unlock(&ws_mutex);
+  return size;
+}
+
+
+/**
+ *
+ */
+void
+websocket_group_send(websocket_group_t *wg, int opcode,
+                     const void *data, size_t len)
+{
+  websocket_member_t *wm;
+  size_t framelen;
+  uint8_t *frame = ws_frame(opcode, data, len, &framelen);
+
+  pthread_mutex_lock(&ws_mutex);
+  LIST_FOREACH(wm, &wg->wg_members, wm_group_link)
+    ws_enqueue(wm->wm_session, frame, framelen);
+  pthread_mutex_unlock(&ws_mutex);
+  free(frame);
+}
+
+
+/**
+ *
+ */
+void
+websocket_group_send_json(websocket_group_t *wg, htsmsg_t *msg)
+{
+  char *json = htsmsg_json_serialize_to_str(msg, 0);
+  websocket_group_send(wg, WS_OPCODE_TEXT, json, strlen(json));
+  free(json);
+}
@@ -0,0 +1,100 @@
+/*
+ *  WebSocket server (RFC 6455)
+ *  Copyright (C) 2014 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "http.h"
+#include "htsmsg.h"
+
+#define WS_OPCODE_CONTINUATION 0x0
+#define WS_OPCODE_TEXT         0x1
+#define WS_OPCODE_BINARY       0x2
+#define WS_OPCODE_CLOSE        0x8
+#define WS_OPCODE_PING         0x9
+#define WS_OPCODE_PONG         0xa
+
+#define WS_STATUS_NORMAL        1000
+#define WS_STATUS_GOING_AWAY    1001
+#define WS_STATUS_PROTOCOL      1002
+#define WS_STATUS_INVALID_DATA  1007
+#define WS_STATUS_POLICY        1008
+#define WS_STATUS_TOO_BIG       1009
+#define WS_STATUS_INTERNAL      1011
+
+typedef struct websocket_session websocket_session_t;
+
+typedef struct websocket_group websocket_group_t;
+
+/**
+ * All callbacks are invoked on the asyncio thread and must not block.
+ *
+ * connected    - Session is up, ws is valid until disconnected returns
+ *                (retain it to keep it longer)
+ * message      - A complete (defragmented) text or binary message
+ * disconnected - Peer closed, error or websocket_close(). Called once
+ */
+typedef struct websocket_callbacks {
+  void (*connected)(void *opaque, websocket_session_t *ws);
+  void (*message)(void *opaque, int opcode, const void *data, int len);
+  void (*disconnected)(void *opaque, int error);
+} websocket_callbacks_t;
+
+
+/**
+ * Answer a WebSocket handshake from a route or path callback and move
+ * the connection over to asyncio. The return value should be returned
+ * from the callback as is.
+ *
+ * Requires asyncio_init()
+ */
+int websocket_upgrade(http_connection_t *hc,
+                      const websocket_callbacks_t *callbacks, void *opaque);
+
+/**
+ * Functions below are safe to call from any thread. Sends to sessions
+ * that are gone are silently dropped
+ */
+void websocket_send(websocket_session_t *ws, int opcode,
+                    const void *data, size_t len);
+
+void websocket_send_json(websocket_session_t *ws, htsmsg_t *msg);
+
+void websocket_close(websocket_session_t *ws, int status);
+
+void websocket_retain(websocket_session_t *ws);
+
+void websocket_release(websocket_session_t *ws);
+
+/**
+ * Groups for fan out. A message is framed once and copied to each
+ * member. Sessions leave their groups automatically when they close
+ */
+websocket_group_t *websocket_group_create(void);
+
+void websocket_group_destroy(websocket_group_t *wg);
+
+void websocket_group_join(websocket_group_t *wg, websocket_session_t *ws);
+
+void websocket_group_leave(websocket_group_t *wg, websocket_session_t *ws);
+
+int websocket_group_size(websocket_group_t *wg);
+
+void websocket_group_send(websocket_group_t *wg, int opcode,
+                          const void *data, size_t len);
+
+void websocket_group_send_json(websocket_group_t *wg, htsmsg_t *msg);